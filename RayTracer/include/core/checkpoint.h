@@ -0,0 +1,59 @@
+#pragma once
+#include "core/rt.h"
+
+namespace rt
+{
+/*
+	State of a render that is written to disk periodically, so that a crashed or
+	preempted render can be continued: the running sums of the finished passes of
+	every pixel, the passes every pixel got (times the samples per pass gives its
+	sample count) and which tiles of the current pass are finished.
+*/
+struct Checkpoint
+{
+	// settings of the render, a checkpoint only continues a render with the same ones
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t spp = 0;
+	uint32_t grid_dim = 0;
+	uint32_t sampler = 0;
+	uint64_t seed = 0;
+	uint32_t tile_width = 0;
+	uint32_t tile_height = 0;
+	uint32_t adaptive = 0;
+
+	// finished passes and their estimated relative error
+	uint32_t passes = 0;
+	double error = INFINITY;
+
+	// running sums of all and of the odd passes and, for adaptive sampling, of the
+	// squared luminances of the passes
+	std::vector<glm::dvec3> sum;
+	std::vector<glm::dvec3> odd_sum;
+	std::vector<double> lum_sq_sum;
+	std::vector<uint32_t> pixel_passes;
+	// pixels that haven't converged yet
+	std::vector<char> pixel_active;
+
+	// finished tiles of the current pass, row by row on the tile grid
+	std::vector<char> tiles_done;
+
+	// true if both were made by renders with the same settings
+	bool matches(const Checkpoint& other) const;
+
+	/*
+		Write the checkpoint together with the colors of the finished tiles of the
+		current pass. The data goes to a temporary file first, which then replaces
+		file, so that a crash while writing keeps the previous checkpoint intact.
+	*/
+	bool write(const std::string& file, const std::vector<glm::dvec3>& colors) const;
+
+	/*
+		Read a checkpoint written by write, the colors of its finished tiles are
+		copied to colors (of width * height pixels). Returns false and leaves colors
+		unchanged if the file is missing or broken.
+	*/
+	bool read(const std::string& file, std::vector<glm::dvec3>& colors);
+};
+
+} // namespace rt
@@ -1,20 +1,36 @@
 #pragma once
+#include <chrono>
+#include <deque>
+#include <map>
+
+#include "core/checkpoint.h"
 #include "core/rt.h"
 #include "interaction/interaction.h"
+#include "samplers/sampler2D.h"
+#include "threads/cancellation.h"
+#include "threads/dispatcher.h"
+#include "threads/threadpool.h"
 
 
 namespace rt
 {
 
 enum class RenderMode {
-	THREADS, GRADIENT, ANIMATE
+	THREADS, GRADIENT, ANIMATE, SAMPLER_BENCHMARK,
+	// distributed rendering, see set_distributed
+	COORDINATOR, TILE_WORKER
 };
 
+class TileClient;
+class TileWriter;
+
 class Renderer
 {
 public:
 	Renderer(size_t w, size_t h, const std::string& file, size_t max_depth = 4);
 
+	~Renderer();
+
 	void render_with_threads(size_t& width, size_t& height);
 
 	void render_with_threads(
@@ -28,10 +44,147 @@ public:
 
 	void run(RenderMode mode);
 
+	/*
+		Render the scene with every sampler type at 1, 4, 16 and 64 samples per pixel
+		and write the RMS error against a high sample count reference and the render
+		times to sampler_convergence.csv.
+	*/
+	void benchmark_samplers();
+
+	/*
+		Render the frames of the scene's animation to files named after the image file
+		with the frame number appended. The scene is built once, only its animated
+		objects move from frame to frame. Several frames are rendered at once if a
+		frame has too few tiles to keep all workers busy, every frame is written by a
+		separate thread while the next ones are rendered.
+	*/
+	void render_animation();
+
+	// serve the tiles of the image to worker processes until all are rendered, false if
+	// the render failed
+	bool render_coordinator();
+
+	// render tiles for a coordinator until it has none left, false if it isn't reachable
+	bool render_tile_worker();
+
 	std::vector<glm::dvec3> get_colors() const;
 
 	glm::u64vec2 get_image_dim() const;
 
+	/*
+		Override the number of worker threads, 0 keeps the default derived from the
+		available CPUs and the cgroup quota. With pin_threads each worker is bound to
+		one logical CPU, physical cores first.
+	*/
+	void set_threads(size_t num_threads, bool pin_threads);
+
+	/*
+		Order of the tiles, whether the remaining rows of expensive tiles are split for
+		idle workers at the end of a frame and whether a low resolution pre-pass sorts
+		the tiles by their cost first. None of them changes the image.
+	*/
+	void set_tile_scheduling(TileOrder order, bool adaptive_splitting, bool cost_prepass);
+
+	// trace simplified versions of LOD meshes that cover only a few pixels, changes the image
+	void set_level_of_detail(bool enabled);
+
+	// sum the samples of a tile per worker before writing it to the framebuffer, and
+	// write finished tiles to the output file while rendering
+	void set_tile_output(bool tile_buffers, bool stream_output);
+
+	/*
+		Render passes into a running average until one of the budgets is reached: the
+		wall clock time (the last pass has to fit in), the samples per pixel or the
+		estimated relative error. 0 disables a budget. With write_interval > 0 the
+		average is written to the image file every write_interval passes.
+	*/
+	void set_progressive(double time_budget_ms,
+		size_t target_spp,
+		double convergence_threshold,
+		size_t write_interval);
+
+	/*
+		Copy the running average of a progressive render to colors, e.g. for showing it
+		while rendering. Returns the number of passes it contains, 0 if there is none
+		yet (colors is left unchanged then).
+	*/
+	size_t get_preview(std::vector<glm::dvec3>& colors) const;
+
+	/*
+		Render progressively and stop rendering pixels whose standard error, estimated
+		from the variance of their passes, drops below threshold times their luminance
+		after at least min_passes passes. Tiles without such pixels are skipped. The
+		budgets of set_progressive still apply. If heatmap_file isn't empty, the samples
+		per pixel are written to it after rendering.
+	*/
+	void set_adaptive(double threshold,
+		size_t min_passes,
+		const std::string& heatmap_file);
+
+	// write the samples per pixel of the last render as image, brighter means more
+	void write_sample_heatmap(const std::string& file) const;
+
+	/*
+		Write the state of the render to file every interval_s seconds (0 only writes
+		it when a progressive render ends). With resume the render continues from the
+		checkpoint in file if it was written with the same settings.
+	*/
+	void set_checkpoint(const std::string& file,
+		double interval_s,
+		bool resume);
+
+	/*
+		Address ("host:port" or "unix:/path") of a distributed render. The
+		COORDINATOR hands out the tiles to the worker processes connecting to it and
+		writes the image, a TILE_WORKER renders tiles with the coordinator's settings.
+		The tiles of workers that don't answer for timeout_s seconds are rendered by
+		the others.
+	*/
+	void set_distributed(const std::string& address, double timeout_s);
+
+	/*
+		Scene of the following renders, see make_scene. Scenes are built with their
+		BVHs on first use and kept for later renders, the MAX_CACHED_SCENES most
+		recently used ones. Builds the scene now, false if the name is unknown.
+	*/
+	bool set_scene(const std::string& name);
+
+	// view of the following renders instead of the camera of the scene
+	void set_camera(const glm::dvec3& eye, const glm::dvec3& look_at, const glm::dvec3& up);
+
+	// render with the camera of the scene again
+	void reset_camera();
+
+	void set_resolution(size_t width, size_t height);
+
+	void set_spp(size_t spp);
+
+	void set_output_file(const std::string& file);
+
+	// number of frames of an animation and of frames rendered at once, 0 decides by
+	// the number of tiles per frame
+	void set_animation(size_t frames, size_t frames_in_flight);
+
+	/*
+		Renders stop at the next row of a tile or frame of an animation once token is
+		cancelled, every run() resets it first. A checkpoint is written if there is
+		one. A progressive render with finished passes writes their average, other
+		cancelled renders don't write the output file.
+	*/
+	void set_cancellation_token(std::shared_ptr<CancellationToken> token);
+
+	// cancel the current token, from any thread
+	void cancel();
+
+	/*
+		Render the tiles overlapping the pixels [x0, x1) x [y0, y1) before the others,
+		in every pass. Can be changed from any thread while rendering, the tiles of
+		the region that aren't handed out yet are rendered next.
+	*/
+	void set_priority_region(size_t x0, size_t y0, size_t x1, size_t y1);
+
+	void clear_priority_region();
+
 private:
 	size_t MAX_DEPTH;
 
@@ -39,9 +192,303 @@ private:
 	size_t SPP;
 	
 	size_t GRID_DIM;
+
+	// sampler of the image plane positions and its seed
+	SamplerType SAMPLER;
+	uint64_t SAMPLE_SEED;
+
+	// spread a single sample per pixel over the pixel as well, set while benchmark_samplers
+	// compares the samplers
+	bool FORCE_JITTER;
+
 	size_t NUM_THREADS;
 
+	// bind the workers to CPUs, see ThreadPool
+	bool PIN_THREADS;
+
+	// trace primary and shadow rays of neighboring pixels as ray packets
+	bool PACKET_TRACING;
+
+	// collect the reflection and refraction rays of a tile and trace them sorted by
+	// direction and origin instead of recursively
+	bool DEFER_SECONDARY_RAYS;
+
+	// skip the objects and BVH subtrees outside the view frustum of a tile when tracing
+	// its primary rays
+	bool FRUSTUM_CULLING;
+
+	// accumulate the samples of a tile in a buffer of its worker and write the tile to
+	// the framebuffer once, keeps workers from sharing cache lines at tile borders. Off
+	// by default until its effect at 32 and more threads is measured
+	bool TILE_BUFFERS;
+
+	// tone map and write the finished tiles of a single pass render while the others are
+	// traced, instead of the whole image after the render, see TileWriter
+	bool STREAM_OUTPUT;
+
+	// trace simplified versions of LOD meshes that cover only a few pixels
+	bool LEVEL_OF_DETAIL;
+
+	// order in which the tiles are rendered
+	TileOrder TILE_ORDER;
+
+	// split the remaining rows of a tile for idle workers once all tiles are handed out
+	bool ADAPTIVE_TILE_SPLITTING;
+
+	// estimate the cost of every tile with a low resolution pre-pass and render the
+	// most expensive tiles first
+	bool COST_PREPASS;
+
+	// pin the workers, split the tiles into one band per NUMA node and move the
+	// framebuffer rows of each band to its node
+	bool NUMA_AWARE;
+
+	// additionally build one copy of the scene per NUMA node (costs memory and serial
+	// scene builds)
+	bool NUMA_REPLICATE_SCENE;
+
+	// progressive rendering and its budgets, see set_progressive
+	bool PROGRESSIVE;
+	double TIME_BUDGET_MS;
+	size_t TARGET_SPP;
+	double CONVERGENCE_THRESHOLD;
+	size_t PROGRESSIVE_WRITE_INTERVAL;
+
+	// sample only the pixels that haven't converged yet, see set_adaptive
+	bool ADAPTIVE_SAMPLING;
+	double ADAPTIVE_THRESHOLD;
+	size_t ADAPTIVE_MIN_PASSES;
+	std::string SAMPLE_HEATMAP_FILE;
+
+	// periodic checkpoints of the render state, see set_checkpoint
+	std::string CHECKPOINT_FILE;
+	double CHECKPOINT_INTERVAL_S;
+	bool RESUME;
+
+	std::string DISTRIBUTED_ADDRESS;
+	double DISTRIBUTED_TIMEOUT_S;
+
+	// source of the tiles while rendering as worker of a distributed render
+	TileClient* tile_client;
+
+	// destination of the finished tiles of the current render, if they are streamed
+	std::unique_ptr<TileWriter> tile_writer;
+
+	// scene to render and the view overriding its camera, see set_camera
+	std::string SCENE;
+	bool CUSTOM_CAMERA;
+	glm::dvec3 CAMERA_EYE;
+	glm::dvec3 CAMERA_LOOK_AT;
+	glm::dvec3 CAMERA_UP;
+
+	// see set_animation
+	size_t ANIMATION_FRAMES;
+	size_t FRAMES_IN_FLIGHT;
+
+	// renders a frame of an animation with the scene of the animation, with the
+	// transforms of the animated objects in ANIMATION_SLOT (see Instance)
+	bool ANIMATION_FRAME;
+	size_t ANIMATION_SLOT;
+
+	struct CachedScene
+	{
+		// shared with the renderers of the frames of an animation
+		std::shared_ptr<Scene> scene;
+		// copies of the scene on the NUMA nodes in replica_nodes
+		std::vector<std::unique_ptr<Scene>> replicas;
+		std::vector<int> replica_nodes;
+		// the camera the scene was built with
+		std::unique_ptr<Camera> camera;
+		// value of scene_uses when last used, the least recently used scene is dropped first
+		uint64_t last_used = 0;
+	};
+
+	// built scenes by name
+	std::map<std::string, CachedScene> scenes;
+	uint64_t scene_uses;
+
+	// a scene by name, built if it isn't cached, nullptr if the name is unknown
+	CachedScene* cached_scene(const std::string& name);
+
+	// (re)create the worker threads if the settings changed and make them current
+	void start_pool();
+
+	// set the camera and the level of detail of the scene for the next render
+	void prepare_scene(CachedScene& cached);
+
+	// idle time of the workers since the last reset of their busy time
+	void set_idle_stats(double elapsed_ms);
+
+	// trace cost of every tile of slice in rays and visited BVH nodes, measured with a
+	// few primary rays per tile whose colors are thrown away
+	std::vector<double> measure_tile_costs(Slice& slice, const Scene& scene, Integrator& integrator);
+
+	// NUMA node of every part of the tiles, the workers of a node share one part
+	std::vector<int> assign_numa_parts(std::vector<size_t>& worker_part);
+
+	// copy the scene to every node of part_nodes, or drop the copies if they aren't used
+	void replicate_scene(CachedScene& cached, const std::vector<int>& part_nodes,
+		const std::vector<size_t>& worker_part);
+
 	std::unique_ptr<Image> img;
+
+	// worker threads, kept alive between renders and shared with scene loading,
+	// BVH builds, image output and the frames of an animation
+	std::shared_ptr<ThreadPool> pool;
+
+	// running average of the current progressive render, readable from other threads
+	mutable std::mutex preview_mutex;
+	std::vector<glm::dvec3> preview;
+	size_t preview_passes;
+
+	// samples per pixel of the last render
+	std::vector<uint32_t> sample_counts;
+
+	// checked by the workers, shared with the frames of an animation
+	std::shared_ptr<CancellationToken> cancel_token;
+
+	// region rendered first, every change gets a new generation so that a running
+	// render notices it
+	std::mutex priority_mutex;
+	bool has_priority_region;
+	glm::u64vec2 priority_min;
+	glm::u64vec2 priority_max;
+	std::atomic<uint64_t> priority_generation;
+
+	// tiles of the priority region not taken yet in the current pass of a render and
+	// the generation of the region they belong to
+	struct PriorityTiles
+	{
+		std::mutex mutex;
+		std::deque<size_t> tiles;
+		uint64_t generation = 0;
+	};
+
+	/*
+		State of a render shared by its workers: the tiles and their progress in the
+		current pass, the accumulated passes, the scene and the settings of the samples.
+	*/
+	struct RenderState
+	{
+		RenderState(Image& img, TileOrder order, ThreadPool& pool);
+
+		// hand out the tiles of the next pass, each with all of its pixels remaining
+		void reset_tiles();
+
+		// tiles and samples are handed out without locks, see Slice::get_index
+		Slice slice;
+		// the accumulated passes, which can be written to disk
+		Checkpoint state;
+		TaskGroup workers;
+
+		// the scene and its copies on the NUMA nodes, with the part of the tiles and
+		// the copy of every worker
+		Scene* scene = nullptr;
+		const std::vector<std::unique_ptr<Scene>>* replicas = nullptr;
+		std::vector<size_t> worker_part;
+
+		std::unique_ptr<PhongIntegrator> integrator;
+		std::unique_ptr<Sampler2D> sampler;
+		// distance to the view plane, samples per pixel and pass and whether they are
+		// spread over the pixel, pixels per ray packet and weight of every sample
+		double foc_len = 0.0;
+		size_t array_size = 0;
+		bool jitter = false;
+		int packet_width = 1;
+		double sample_weight = 0.0;
+
+		// position of every tile on the tile grid, their order depends on the pre-pass,
+		// and its pixels still to be rendered in the current pass
+		size_t tiles_x = 0;
+		size_t tiles_y = 0;
+		std::vector<size_t> tile_cell;
+		std::unique_ptr<std::atomic<int64_t>[]> tile_remaining;
+		// tiles handed out in the current pass, tiles of the priority region are taken
+		// out of order
+		std::unique_ptr<std::atomic<char>[]> tile_taken;
+		// tiles of a distributed render are identified by their position
+		std::vector<size_t> tile_of_cell;
+		// adaptive sampling: tiles with unconverged pixels and the number of these pixels
+		std::vector<char> tile_active;
+		size_t active_pixels = 0;
+		PriorityTiles priority_tiles;
+
+		// progress of the current pass, counting pixels since tiles may be split
+		std::unique_ptr<pbrt::ProgressReporter> reporter;
+		// set once all tiles of the pass have been handed out, from then on expensive
+		// tiles are split
+		std::atomic<bool> tiles_exhausted;
+		// passes of the render when it started, more if it was resumed
+		uint32_t start_passes = 0;
+	};
+
+	// part of the tiles and scene copy for the calling thread
+	size_t current_part(const RenderState& rs) const;
+	Scene& current_scene(RenderState& rs);
+
+	/*
+		Set up the checkpoint state and the tiles of the first pass, continued from
+		CHECKPOINT_FILE if requested. True if the render was resumed.
+	*/
+	bool start_render(RenderState& rs);
+
+	// render one pass, or the rest of a resumed one, with one tile fetching task per worker
+	void render_pass(RenderState& rs);
+
+	// take tiles and render them until none are left or the render is cancelled
+	void fetch_tiles(RenderState& rs);
+
+	/*
+		Render the pixels [x0, x0 + w_step) x [y0, y0 + h_step) of the given tile. Once all
+		tiles have been handed out, its lower rows are split off to idle workers. The last
+		region of a tile hands it to the writer or the coordinator.
+	*/
+	void render_region(RenderState& rs, size_t tile, int x0, int y0, int w_step, int h_step);
+
+	// hands a finished tile to the writer
+	void push_tile(RenderState& rs, size_t t);
+
+	// the next tile of the priority region that isn't taken yet, marked as taken, -1 if
+	// there is none. The tiles are looked up again once the region changes
+	int next_priority_tile(RenderState& rs);
+
+	/*
+		Continue the render from CHECKPOINT_FILE if it was written with the settings of
+		rs.state: the state and the image are replaced by the saved ones and the tiles
+		finished before have no pixels remaining. False if the render starts from scratch.
+	*/
+	bool resume_checkpoint(RenderState& rs);
+
+	/*
+		Write the state and the finished tiles of rs to CHECKPOINT_FILE if the checkpoint
+		interval has passed or if forced, skipped if another thread is writing one. After
+		a pass no tile of the next one is done yet.
+	*/
+	void write_checkpoint(RenderState& rs, bool pass_finished, bool force);
+
+	/*
+		Add the pass in the image to the running sums of the state and replace the image
+		by the average of the passes of every pixel. The difference of the averages of the
+		even and odd passes estimates the error of the image, adaptive sampling estimates
+		the error of every pixel from the variance of its passes instead and stops
+		sampling the pixels and tiles that have converged.
+	*/
+	void accumulate_pass(RenderState& rs);
+
+	// show the accumulated passes in the preview, and write them every
+	// PROGRESSIVE_WRITE_INTERVAL passes
+	void publish_pass(RenderState& rs);
+
+	// log a finished pass, true if the budget of the progressive render is reached
+	bool render_finished(const RenderState& rs, double total_ms) const;
+
+	// keep the tiles finished before a cancel for a resume, a progressive render goes
+	// back to the average of the finished passes
+	void keep_cancelled_render(RenderState& rs);
+
+	// held while a checkpoint is written, and when the last one was written
+	std::mutex checkpoint_mutex;
+	std::chrono::steady_clock::time_point last_checkpoint;
 };
 
 } // namespace rt
\ No newline at end of file
@@ -90,6 +90,8 @@ class Triangle;
 class Cube;
 class UnitCube;
 class TriangleMesh;
+class LODMesh;
+class Instance;
 
 struct Sphere;
 struct Cylinder;
@@ -99,6 +101,7 @@ struct Paraboloid;
 struct Hyperboloid;
 
 class Bounds3;
+class Frustum;
 
 class Texture;
 class CheckerBoardTexture;
@@ -112,6 +115,7 @@ class DragonScene;
 class Image;
 class Dispatcher;
 class Slice;
+struct TileCull;
 
 class BVH;
 class BVH_Tree;
@@ -23,6 +23,12 @@ public:
 
 	void write_image_to_file();
 
+	// gamma corrected color in [0;255], as written to the file
+	static glm::dvec3 tone_map(const glm::dvec3& color);
+
+	// binary PPM header of an image
+	static void write_header(std::ostream& os, size_t width, size_t height);
+
 	void resize_color_array(size_t new_width, size_t new_height);
 
 	size_t get_width() const
@@ -0,0 +1,77 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#include "core/rt.h"
+
+namespace rt
+{
+/*
+	Writes an image while it is rendered: finished tiles are pushed by the workers,
+	a thread of the writer tone maps and quantizes them like Image::write_image_to_file
+	and appends every row to the file as soon as it and the rows above it are complete.
+	The file is written front to back, so it may also be a pipe.
+*/
+class TileWriter
+{
+public:
+	TileWriter(const std::string& file_name, size_t width, size_t height);
+
+	TileWriter(const TileWriter&) = delete;
+	TileWriter& operator=(const TileWriter&) = delete;
+
+	~TileWriter();
+
+	// open the file and start the writing thread, false if the file can't be opened
+	bool start();
+
+	// copy the pixels [x0, x0 + w) x [y0, y0 + h) of colors, an image of the same
+	// width, every pixel has to be pushed once
+	void push(size_t x0, size_t y0, size_t w, size_t h, const std::vector<glm::dvec3>& colors);
+
+	// wait until everything pushed is written, false if writing failed or pixels are missing
+	bool finish();
+
+	// the written 8 bit colors, as write_image_to_file leaves them
+	void copy_to(std::vector<glm::dvec3>& colors) const;
+
+	size_t tiles_written() const
+	{
+		return tiles;
+	}
+
+private:
+	struct Tile
+	{
+		size_t x0;
+		size_t y0;
+		size_t w;
+		size_t h;
+		std::vector<glm::dvec3> colors;
+	};
+
+	void write_tiles();
+
+	std::string file_name;
+	size_t width;
+	size_t height;
+	std::ofstream ofs;
+
+	// quantized image and the pixels of every row still missing, only used by the thread
+	std::vector<unsigned char> bytes;
+	std::vector<size_t> row_missing;
+	size_t rows_written = 0;
+	size_t tiles = 0;
+	bool failed = false;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<Tile> queue;
+	bool finishing = false;
+	std::thread thread;
+};
+
+} // namespace rt
@@ -1,5 +1,7 @@
 #pragma once
 #include "core/rt.h"
+#include "shape/raypacket.h"
+#include "integrators/rayqueue.h"
 
 namespace rt
 {
@@ -8,26 +10,91 @@ class Integrator
 {
 public:
 
-	virtual glm::dvec3 Li(const Ray& ray, const Scene& scene, int depth) = 0;
+	/*
+		Compute the radiance along ray. If path is given, secondary rays are not traced
+		recursively but pushed to the queue of the path, the returned radiance then only
+		holds the contribution of the first intersection.
+		If cull is given, ray is a primary ray of the tile cull was built for.
+	*/
+	virtual glm::dvec3 Li(const Ray& ray,
+		const Scene& scene,
+		int depth,
+		PathState* path = nullptr,
+		const TileCull* cull = nullptr);
+
+	/*
+		Compute the radiance for all active rays of a packet of primary rays and store it
+		in L. The first intersections and the shadow rays towards each light source are
+		traced as packets, the shading itself continues ray by ray.
+		If queue is given, secondary rays are deferred to it and pixels holds the pixel
+		index of each lane. If cull is given, the first intersections are only searched
+		among the objects inside the frustum of the tile.
+	*/
+	void Li(RayPacket& packet,
+		const Scene& scene,
+		RGB_Color* L,
+		RayQueue* queue = nullptr,
+		const size_t* pixels = nullptr,
+		const TileCull* cull = nullptr);
+
+	/*
+		Trace the deferred secondary rays of queue in sorted batches until no more rays
+		get spawned and add their weighted radiance to the pixels of colors.
+	*/
+	void trace_deferred(RayQueue& queue, const Scene& scene, std::vector<glm::dvec3>& colors);
 
 protected:
+	/*
+		Compute the radiance leaving the first intersection si of ray, which lies at the
+		distance ray.tMax.
+		shadow_masks: visibility of the light sources for the given lane of a packet, if
+		they were already determined by shadow ray packets. nullptr otherwise.
+	*/
+	virtual RGB_Color shade(const Ray& ray,
+		const Scene& scene,
+		SurfaceInteraction& si,
+		int depth,
+		const PacketMask* shadow_masks = nullptr,
+		int lane = 0,
+		PathState* path = nullptr) = 0;
+
+	bool light_visible(const Scene& scene,
+		size_t light_idx,
+		const glm::dvec3& p,
+		const PacketMask* shadow_masks,
+		int lane);
+
 	bool refract(glm::dvec3 V, glm::dvec3 N, double refr_idx, glm::dvec3* refracted);
 
 	glm::dvec3 reflect(glm::dvec3 dir, glm::dvec3 N);
 
 	double fresnel(double rel_eta, double c);
 
+	/*
+		Trace a secondary ray and return its radiance scaled by weight, or defer it to
+		the queue of path and return black.
+	*/
+	glm::dvec3 trace_secondary(const Scene& s,
+		const Ray& ray,
+		int depth,
+		const glm::dvec3& weight,
+		PathState* path);
+
 	glm::dvec3 specular_transmit(const Scene& s,
 		const Ray& ray,
 		const glm::dvec3& isect_p,
 		SurfaceInteraction* isect,
-		int depth);
+		int depth,
+		const glm::dvec3& weight,
+		PathState* path = nullptr);
 
 	glm::dvec3 specular_reflect(const Scene& s,
 		const Ray& ray,
 		const glm::dvec3& isect_p,
 		SurfaceInteraction* isect,
-		int depth);
+		int depth,
+		const glm::dvec3& weight,
+		PathState* path = nullptr);
 };
 
 } // namespace rt
\ No newline at end of file
@@ -7,9 +7,14 @@ namespace rt
 
 class PhongIntegrator : public Integrator
 {
-public:
-
-	glm::dvec3 Li(const Ray& ray, const Scene& scene, int depth);
+protected:
+	RGB_Color shade(const Ray& ray,
+		const Scene& scene,
+		SurfaceInteraction& si,
+		int depth,
+		const PacketMask* shadow_masks = nullptr,
+		int lane = 0,
+		PathState* path = nullptr);
 
 private:
 	glm::dvec3 diff_shade(
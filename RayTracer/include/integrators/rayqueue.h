@@ -0,0 +1,76 @@
+#pragma once
+#include "core/rt.h"
+#include "shape/ray.h"
+
+namespace rt
+{
+/*
+	A secondary ray whose tracing has been deferred, so that it can be sorted
+	together with the other secondary rays of a tile before being traced.
+*/
+struct DeferredRay
+{
+	Ray ray;
+	// path throughput from the camera up to the origin of the ray
+	RGB_Color weight;
+	// index of the pixel the radiance along the ray contributes to
+	size_t pixel;
+	int depth;
+	// sort key, see RayQueue::sort
+	uint64_t key;
+};
+
+/*
+	Collects the deferred secondary rays of a tile.
+*/
+class RayQueue
+{
+public:
+	void push(const Ray& ray, const RGB_Color& weight, size_t pixel, int depth)
+	{
+		rays.push_back(DeferredRay{ ray, weight, pixel, depth, 0 });
+	}
+
+	bool empty() const
+	{
+		return rays.empty();
+	}
+
+	size_t size() const
+	{
+		return rays.size();
+	}
+
+	/*
+		Sort the rays by their direction octant and the Morton code of their origin
+		inside the bounds of all origins, so that rays traced after each other take
+		similar paths through the BVH.
+	*/
+	void sort();
+
+	/*
+		Move all queued rays into batch and leave the queue empty for the rays
+		spawned while tracing the batch.
+	*/
+	void take(std::vector<DeferredRay>& batch)
+	{
+		batch.clear();
+		std::swap(batch, rays);
+	}
+
+private:
+	std::vector<DeferredRay> rays;
+};
+
+/*
+	State of a path whose secondary rays are deferred to a RayQueue instead of being
+	traced recursively.
+*/
+struct PathState
+{
+	RayQueue* queue;
+	RGB_Color weight;
+	size_t pixel;
+};
+
+} // namespace rt
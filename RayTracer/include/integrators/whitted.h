@@ -7,8 +7,14 @@ namespace rt
 
 class WhittedIntegrator : public Integrator
 {
-public:
-	RGB_Color Li(const Ray& ray, const Scene& scene, int depth);
+protected:
+	RGB_Color shade(const Ray& ray,
+		const Scene& scene,
+		SurfaceInteraction& si,
+		int depth,
+		const PacketMask* shadow_masks = nullptr,
+		int lane = 0,
+		PathState* path = nullptr);
 private:
 
 };
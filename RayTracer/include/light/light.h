@@ -1,6 +1,7 @@
 #pragma once
 #include "core/rt.h"
 #include "interaction/interaction.h"
+#include "shape/raypacket.h"
 
 namespace rt
 {
@@ -26,6 +27,12 @@ struct Light
 	virtual RGB_Color sample_light(const glm::dvec3 isect_p, glm::dvec3& dir_to_light, double& pdf) = 0;
 
 	virtual bool visible(const glm::dvec3& p, const Scene &sc) const = 0 ;
+
+	/*
+		Visibility test for the points[i] selected by mask. Returns the mask of the
+		points that are visible to the light.
+	*/
+	virtual PacketMask visible_packet(const glm::dvec3* points, PacketMask mask, const Scene &sc) const;
 };
 
 struct PointLight : public Light
@@ -46,6 +53,8 @@ struct PointLight : public Light
 
 	bool visible(const glm::dvec3& p, const Scene &sc) const;
 
+	PacketMask visible_packet(const glm::dvec3* points, PacketMask mask, const Scene &sc) const;
+
 private:
 	RGB_Color intensity; // dimension: [W/m^2]
 };
@@ -1,6 +1,7 @@
 #pragma once
 #include "core/rt.h"
 #include "shape/shape.h"
+#include "threads/threadpool.h"
 #include <fstream>
 #include <sstream>
 
@@ -72,50 +73,62 @@ std::vector<TriangleMesh> extractMeshes(const std::string& file)
 		std::exit(1);
 	}
 
-	double x, y, z;
-	double nx = 0;
-	double ny = 0;
-	double nz = 0;
-
 	std::vector<TriangleMesh> tr_meshes;
 	for (size_t mesh_num = 0; mesh_num < a_scene->mNumMeshes; ++mesh_num)
 	{
-		std::vector<std::shared_ptr<Shape>> triangles;
+		std::vector<std::shared_ptr<Shape>> triangles(a_scene->mMeshes[mesh_num]->mNumFaces);
 
-		int j = 0;
-		for (size_t i = 0; i < a_scene->mMeshes[mesh_num]->mNumFaces; ++i)
-		{
-			std::vector<glm::dvec3> points;
-			std::vector<glm::dvec3> normals;
-			for (size_t n = 0; n < a_scene->mMeshes[mesh_num]->mFaces[i].mNumIndices; ++n)
+		// the faces are converted in parallel chunks, if there is a thread pool
+		auto convert_faces = [&](size_t first, size_t last) {
+			double x, y, z;
+			double nx = 0;
+			double ny = 0;
+			double nz = 0;
+
+			int j = 0;
+			for (size_t i = first; i < last; ++i)
 			{
-				j = a_scene->mMeshes[mesh_num]->mFaces[i].mIndices[n];
+				std::vector<glm::dvec3> points;
+				std::vector<glm::dvec3> normals;
+				for (size_t n = 0; n < a_scene->mMeshes[mesh_num]->mFaces[i].mNumIndices; ++n)
+				{
+					j = a_scene->mMeshes[mesh_num]->mFaces[i].mIndices[n];
 
-				x = (a_scene->mMeshes[mesh_num]->mVertices[j].x);
-				y = (a_scene->mMeshes[mesh_num]->mVertices[j].y);
-				z = (a_scene->mMeshes[mesh_num]->mVertices[j].z);
+					x = (a_scene->mMeshes[mesh_num]->mVertices[j].x);
+					y = (a_scene->mMeshes[mesh_num]->mVertices[j].y);
+					z = (a_scene->mMeshes[mesh_num]->mVertices[j].z);
 
-				if (a_scene->mMeshes[mesh_num]->mNormals != nullptr)
-				{
-					nx = a_scene->mMeshes[mesh_num]->mNormals[j].x;
-					ny = a_scene->mMeshes[mesh_num]->mNormals[j].y;
-					nz = a_scene->mMeshes[mesh_num]->mNormals[j].z;
+					if (a_scene->mMeshes[mesh_num]->mNormals != nullptr)
+					{
+						nx = a_scene->mMeshes[mesh_num]->mNormals[j].x;
+						ny = a_scene->mMeshes[mesh_num]->mNormals[j].y;
+						nz = a_scene->mMeshes[mesh_num]->mNormals[j].z;
+					}
+
+					points.push_back(glm::dvec3(x, y, z));
+					normals.push_back(glm::dvec3(nx, ny, nz));
 				}
 
-				points.push_back(glm::dvec3(x, y, z));
-				normals.push_back(glm::dvec3(nx, ny, nz));
+				triangles[i] = std::make_shared<Triangle>(
+					points[0],
+					points[1],
+					points[2],
+					normals[0],
+					normals[1],
+					normals[2],
+					glm::normalize(glm::cross(points[1] - points[0], points[2] - points[1])),
+					glm::dmat4(1.0), //TODO: can't be set to unity matrix... look at constructor of Triangle
+					nullptr);
 			}
+		};
 
-			triangles.push_back(std::make_shared<Triangle>(
-				points[0],
-				points[1],
-				points[2],
-				normals[0],
-				normals[1],
-				normals[2],
-				glm::normalize(glm::cross(points[1] - points[0], points[2] - points[1])),
-				glm::dmat4(1.0), //TODO: can't be set to unity matrix... look at constructor of Triangle
-				nullptr));
+		if (ThreadPool* pool = ThreadPool::current())
+		{
+			pool->parallel_for(0, triangles.size(), 4096, convert_faces);
+		}
+		else
+		{
+			convert_faces(0, triangles.size());
 		}
 
 		tr_meshes.push_back(TriangleMesh(triangles));
@@ -0,0 +1,160 @@
+#pragma once
+#include <atomic>
+#include <map>
+#include <mutex>
+
+#include "core/rt.h"
+
+namespace rt
+{
+/*
+	Collects named statistics of a render run (ray counts, timings, ...) and prints
+	them as a report when rendering has finished. Every update takes a lock, so hot
+	code paths should accumulate their values locally (e.g. per thread or per tile)
+	and add them in bulk.
+*/
+class Stats
+{
+public:
+	static void add(const std::string& name, double value);
+
+	static void set(const std::string& name, double value);
+
+	static double get(const std::string& name);
+
+	static void clear();
+
+	// write all statistics to the log
+	static void report();
+
+	// write a single statistic to the log, e.g. one set after the report
+	static void report(const std::string& name);
+
+	/*
+		Page faults of the process so far. Major faults had to read from disk, e.g. for
+		memory mapped meshes. Windows only provides the total count, which is returned
+		as minor faults.
+	*/
+	static void page_faults(int64_t* minor, int64_t* major);
+
+	/*
+		Pages allocated on the NUMA node of the allocating CPU (local) and on another
+		node (remote), summed over all nodes and processes (Linux numastat). Returns
+		false if the platform doesn't provide the counters.
+	*/
+	static bool numa_allocations(int64_t* local, int64_t* remote);
+
+private:
+	static std::mutex stats_mutex;
+	static std::map<std::string, double> values;
+};
+
+// number of rays traced by the calling thread, flushed to Stats by the renderer
+extern thread_local int64_t thread_ray_count;
+
+// number of BVH nodes visited by the calling thread, a measure of the trace cost
+extern thread_local int64_t thread_node_visits;
+
+/*
+	Hardware counters of last level cache references and misses of the calling thread,
+	counting from construction. Uses perf events on Linux; elsewhere, or if the kernel
+	doesn't grant access (perf_event_paranoid, containers), available() is false and
+	the counters read 0.
+*/
+class CacheCounter
+{
+public:
+	CacheCounter();
+
+	~CacheCounter();
+
+	CacheCounter(const CacheCounter&) = delete;
+	CacheCounter& operator=(const CacheCounter&) = delete;
+
+	bool available() const
+	{
+		return misses_fd >= 0 && references_fd >= 0;
+	}
+
+	int64_t misses() const;
+
+	int64_t references() const;
+
+	// add the counters to Stats as "LLC misses" and "LLC references"
+	void report() const;
+
+private:
+	int misses_fd = -1;
+	int references_fd = -1;
+};
+
+/*
+	Usage counters of one lock or a set of locks, see CountingMutex.
+*/
+struct LockStats
+{
+	std::atomic<int64_t> acquisitions{ 0 };
+	// acquisitions which had to wait for another thread
+	std::atomic<int64_t> contentions{ 0 };
+	std::atomic<int64_t> wait_ns{ 0 };
+	std::atomic<int64_t> hold_ns{ 0 };
+
+	void reset();
+
+	// add the counters to Stats, prefixed by name
+	void report(const std::string& name) const;
+};
+
+/*
+	Mutex which records in a LockStats how often it was taken, how often a thread had
+	to wait for it and how long it was waited for and held. Meant for locks that are
+	taken per task or per tile, not per pixel, since it reads the clock on every lock.
+*/
+class CountingMutex
+{
+public:
+	explicit CountingMutex(LockStats& stats) :
+		stats(stats)
+	{
+	}
+
+	void lock()
+	{
+		if (!m.try_lock())
+		{
+			++stats.contentions;
+			auto start = std::chrono::steady_clock::now();
+			m.lock();
+			stats.wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start).count();
+		}
+		++stats.acquisitions;
+		locked_at = std::chrono::steady_clock::now();
+	}
+
+	bool try_lock()
+	{
+		if (!m.try_lock())
+		{
+			return false;
+		}
+		++stats.acquisitions;
+		locked_at = std::chrono::steady_clock::now();
+		return true;
+	}
+
+	void unlock()
+	{
+		stats.hold_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - locked_at).count();
+		m.unlock();
+	}
+
+private:
+	std::mutex m;
+	LockStats& stats;
+	// only accessed by the thread holding the lock
+	std::chrono::steady_clock::time_point locked_at;
+};
+
+} // namespace rt
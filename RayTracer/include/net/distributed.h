@@ -0,0 +1,130 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#include "core/rt.h"
+#include "image/image.h"
+#include "net/socket.h"
+
+namespace rt
+{
+/*
+	Rendering one frame with several processes: a TileCoordinator hands out the
+	tiles of the image to TileClients in worker processes and merges the pixels
+	they send back into its image. A worker asks for a batch of tiles whenever it
+	has run out, the tiles of workers that disconnect or stop answering are handed
+	out again.
+
+	Protocol, every message being a type and a payload (see send_message):
+	worker HELLO -> coordinator JOB, then any number of
+	worker REQUEST (count) -> coordinator TILES (done flag, tile positions) and
+	worker RESULT (tile position and size, pixels). An empty TILES reply without the
+	done flag means that the remaining tiles are still being rendered elsewhere.
+*/
+enum class TileMessage : uint32_t
+{
+	HELLO, JOB, REQUEST, TILES, RESULT
+};
+
+// settings every worker renders with, sent by the coordinator
+struct TileJob
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t spp;
+	uint32_t grid_dim;
+	uint32_t sampler;
+	uint64_t seed;
+	uint32_t tile_width;
+	uint32_t tile_height;
+
+	// scene and the view overriding its camera, see Renderer::set_scene and set_camera
+	std::string scene;
+	bool custom_camera;
+	glm::dvec3 eye;
+	glm::dvec3 look_at;
+	glm::dvec3 up;
+};
+
+class TileCoordinator
+{
+public:
+	/*
+		Serve the tiles at the given positions, in this order, to the workers that
+		connect to address. Workers that don't send anything for timeout_s seconds
+		are considered dead.
+	*/
+	TileCoordinator(const std::string& address,
+		const TileJob& job,
+		const std::vector<std::pair<int, int>>& tiles,
+		double timeout_s);
+
+	// serve tiles until all of them are merged into img, false if listening failed
+	bool run(Image& img);
+
+	// tiles that were handed out again after their worker failed
+	size_t get_requeued() const
+	{
+		return requeued;
+	}
+
+	size_t get_workers() const
+	{
+		return workers;
+	}
+
+private:
+	void serve(Socket& connection, Image& img);
+
+	// merge a RESULT payload, false if it doesn't match a tile
+	bool merge(const std::vector<char>& payload, Image& img, std::vector<size_t>& in_flight);
+
+	std::string address;
+	TileJob job;
+	std::vector<std::pair<int, int>> tiles;
+	double timeout_s;
+
+	std::mutex mutex;
+	std::condition_variable all_done;
+	std::deque<size_t> queue;
+	std::vector<char> done;
+	size_t remaining = 0;
+	size_t requeued = 0;
+	size_t workers = 0;
+	std::vector<Socket*> connections;
+};
+
+class TileClient
+{
+public:
+	// connect to a coordinator and receive the job, false on failure
+	bool connect(const std::string& address, TileJob& job);
+
+	/*
+		Position of the next tile to render, fetching batch_size tiles from the
+		coordinator when the local ones are used up. Returns false once all tiles
+		are done or the connection is lost. Safe to call from several threads.
+	*/
+	bool next_tile(int& x0, int& y0, size_t batch_size);
+
+	// send the pixels of a finished tile, taken from colors (rows of img_width pixels)
+	bool send_tile(int x0, int y0, int w, int h, const std::vector<glm::dvec3>& colors, size_t img_width);
+
+	size_t get_tiles_rendered() const
+	{
+		return tiles_rendered;
+	}
+
+private:
+	Socket socket;
+
+	std::mutex fetch_mutex;
+	std::deque<std::pair<int, int>> local;
+	bool finished = false;
+
+	std::mutex send_mutex;
+	size_t tiles_rendered = 0;
+};
+
+} // namespace rt
@@ -0,0 +1,80 @@
+#pragma once
+#include <mutex>
+
+#include "core/rt.h"
+#include "net/socket.h"
+
+namespace rt
+{
+class Renderer;
+
+/*
+	Render daemon: keeps a Renderer with its worker threads and the scenes it has
+	built alive between the jobs of other processes, so a job starts tracing right
+	away unless it asks for a scene that isn't cached yet. It serves its own machine
+	only, listening on a Unix socket or the loopback interface, and writes images
+	inside its working directory only. At most 16 clients are connected at once.
+
+	Protocol, every message being a type and a text payload (see send_message):
+	client JOB (settings) -> server DONE (timings) or FAILED (reason). Settings are
+	space separated, e.g. "scene=teapot width=640 height=480 spp=4 output=teapot.ppm
+	eye=0,1,5 look_at=0,0,0 up=0,1,0", settings left out take the defaults of the
+	server, outputs have to be relative paths without "..". The timings are
+	"file=<output> queue_ms=<t> scene_ms=<t> render_ms=<t> write_ms=<t>
+	total_ms=<t>". The jobs of all clients are rendered one at a time,
+	the job "quit" stops the server after the current one.
+*/
+enum class RenderServerMessage : uint32_t
+{
+	JOB, DONE, FAILED
+};
+
+struct RenderJob
+{
+	std::string scene = "tetrahedron";
+	size_t width = 1000;
+	size_t height = 600;
+	size_t spp = 1;
+	std::string output = "picture.ppm";
+
+	// view overriding the camera of the scene, set by any of eye, look_at and up
+	bool custom_camera = false;
+	glm::dvec3 eye = glm::dvec3(0.0);
+	glm::dvec3 look_at = glm::dvec3(0.0, 0.0, -1.0);
+	glm::dvec3 up = glm::dvec3(0.0, 1.0, 0.0);
+
+	// apply "key=value ..." settings, false with the reason in error if one is invalid
+	bool parse(const std::string& settings, std::string& error);
+};
+
+class RenderServer
+{
+public:
+	// jobs are rendered with the other settings of renderer
+	RenderServer(Renderer& renderer, const std::string& address, const RenderJob& defaults);
+
+	// build the default scene and serve jobs until one is "quit", false if listening failed
+	bool run();
+
+	// send a job to the server at address and wait for the reply, false if it failed
+	static bool submit(const std::string& address, const std::string& settings, std::string& reply);
+
+private:
+	void serve(Socket& connection);
+
+	// false with the reason in reply if the job couldn't be rendered
+	bool render(const std::string& settings, double queue_ms, std::string& reply);
+
+	Renderer& renderer;
+	std::string address;
+	RenderJob defaults;
+
+	// held while a job is rendered
+	std::mutex render_mutex;
+
+	std::mutex mutex;
+	bool stopping = false;
+	std::vector<Socket*> connections;
+};
+
+} // namespace rt
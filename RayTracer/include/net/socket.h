@@ -0,0 +1,79 @@
+#pragma once
+#include <cstdint>
+
+#include "core/rt.h"
+
+namespace rt
+{
+/*
+	Stream socket, connected over TCP to "host:port" or over a Unix domain socket
+	to "unix:/path". Closed when destroyed.
+*/
+class Socket
+{
+public:
+	Socket() = default;
+
+	Socket(const Socket&) = delete;
+	Socket& operator=(const Socket&) = delete;
+
+	Socket(Socket&& other) noexcept :
+		handle(other.handle)
+	{
+		other.handle = INVALID;
+	}
+
+	Socket& operator=(Socket&& other) noexcept;
+
+	~Socket()
+	{
+		close();
+	}
+
+	// listen on an address, an existing Unix socket file is replaced
+	static Socket listen(const std::string& address);
+
+	static Socket connect(const std::string& address);
+
+	// wait for the next connection of a listening socket, invalid on failure
+	Socket accept();
+
+	bool valid() const
+	{
+		return handle != INVALID;
+	}
+
+	// send or receive exactly bytes, false if the connection is closed, broken or timed out
+	bool send_all(const void* data, size_t bytes);
+	bool recv_all(void* data, size_t bytes);
+
+	// receives fail after waiting this long, 0 waits forever
+	void set_timeout(double seconds);
+
+	// wait at most seconds for data or a connection, true if there is one
+	bool wait_readable(double seconds);
+
+	// wake up threads blocked in receives or accept, e.g. before closing from another thread
+	void shutdown();
+
+	void close();
+
+private:
+	static constexpr intptr_t INVALID = -1;
+
+	explicit Socket(intptr_t handle) :
+		handle(handle)
+	{
+	}
+
+	intptr_t handle = INVALID;
+};
+
+/*
+	Messages are a type and a payload, both in host byte order, so all processes
+	of a render have to run on machines with the same endianness.
+*/
+bool send_message(Socket& socket, uint32_t type, const std::vector<char>& payload);
+bool recv_message(Socket& socket, uint32_t& type, std::vector<char>& payload);
+
+} // namespace rt
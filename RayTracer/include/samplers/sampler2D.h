@@ -1,72 +1,213 @@
 #pragma once
+#include <atomic>
+
 #include "core/rt.h"
 
 namespace rt
 {
+// bit mixing function of splitmix64, turns consecutive numbers into unrelated ones
+inline uint64_t mix_bits(uint64_t v)
+{
+	v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ull;
+	v = (v ^ (v >> 27)) * 0x94d049bb133111ebull;
+	return v ^ (v >> 31);
+}
+
+/*
+	Small random number generator (splitmix64) for the sample streams of single
+	pixels. Cheap to seed, so every pixel can get its own generator.
+*/
+class PixelRNG
+{
+public:
+	explicit PixelRNG(uint64_t seed) :
+		state(seed)
+	{
+	}
+
+	uint64_t next()
+	{
+		state += 0x9e3779b97f4a7c15ull;
+		return mix_bits(state);
+	}
+
+	// uniform in [0, 1)
+	double uniform()
+	{
+		return (next() >> 11) * (1.0 / (uint64_t(1) << 53));
+	}
+
+private:
+	uint64_t state;
+};
+
+enum class SamplerType
+{
+	STRATIFIED, SOBOL, HALTON, PMJ02
+};
+
 /*
 	Sampler for points on a 2D plane.
+	The samples of a pixel are generated on demand from the sampler seed and the pixel
+	index, so nothing is stored per pixel and the samples don't depend on the thread
+	rendering the pixel or on the order of the pixels.
+	Every pixel has a sequence of samples for each dimension (e.g. image plane, lens,
+	light source), of which each pass takes the next samplesPerPixel ones.
 */
 class Sampler2D
 {
 public:
 	Sampler2D(size_t x,
 		size_t y,
-		unsigned int spp) : samplesPerPixel(spp)
+		unsigned int spp,
+		uint64_t seed = 0) :
+		samplesPerPixel(spp), pixelCount(x * y), seed(seed)
 	{
-		for (unsigned int i = 0; i < x * y; ++i)
-		{
-			sampler2Darray.push_back(std::vector<glm::dvec2>(spp));
-		}
 	}
 
-	~Sampler2D() = default;
+	virtual ~Sampler2D() = default;
+
+	/*
+		Write the samplesPerPixel samples of the given pass of a pixel (y * width + x)
+		in the given dimension to out.
+	*/
+	virtual void generate(size_t pixel,
+		glm::dvec2* out,
+		uint32_t pass = 0,
+		uint32_t dimension = 0) const = 0;
+
+	/*
+		Samples of the next pixel in scanline order, nullptr once all pixels have been
+		returned. The array stays valid until the calling thread calls get2DArray again.
+	*/
+	const glm::dvec2* get2DArray();
 
-	virtual const glm::dvec2* get2DArray() = 0;
+	/*
+		Samples of the given pixel in a buffer of the calling thread, valid until its
+		next get2DArray call. Does not touch the shared pixel counter, so threads can
+		get the samples of their tiles without locking.
+	*/
+	const glm::dvec2* get2DArray(size_t pixel) const;
 
 	const unsigned int samplesPerPixel;
 protected:
-	unsigned int currentPixel = 0;
-	std::vector<std::vector<glm::dvec2>> sampler2Darray;
+	const size_t pixelCount;
+	const uint64_t seed;
+	std::atomic<size_t> currentPixel{ 0 };
+
+	// seed of the samples of a pixel in a dimension
+	uint64_t pixel_seed(size_t pixel, uint32_t dimension) const
+	{
+		return mix_bits(seed ^ mix_bits(pixel) ^ mix_bits(~uint64_t(dimension)));
+	}
 };
 
+/*
+	One jittered sample in every cell of a grid_dim x grid_dim grid over the pixel.
+*/
 class StratifiedSampler2D : public Sampler2D
 {
 public:
 	StratifiedSampler2D(size_t width,
 		size_t height,
-		size_t grid_dim) :
-		Sampler2D(width, height, grid_dim * grid_dim),
-		grid_dim(grid_dim)
+		size_t grid_dim,
+		uint64_t seed = 0) :
+		Sampler2D(width, height, static_cast<unsigned int>(grid_dim * grid_dim), seed),
+		grid_dim(static_cast<int>(grid_dim))
 	{
-		std::random_device rd;
-		std::default_random_engine eng(rd());
-		std::uniform_real_distribution<> dist(0,1);
-
-		for (unsigned int i = 0; i < height; ++i)
-		{
-			for (unsigned int j = 0; j < width; ++j)
-			{
-				for (int k = 0; k < grid_dim; ++k)
-				{
-					for (int m = 0; m < grid_dim; ++m)
-					{
-						double u_rnd = double(dist(eng));
-						double v_rnd = double(dist(eng));
-
-						sampler2Darray[i * width + j][k * grid_dim + m] =
-							glm::dvec2((k + u_rnd) / grid_dim,
-							(m + v_rnd) / grid_dim);
-					}
-				}
-			}
-		}
 	}
 
-	const glm::dvec2 * get2DArray();
+	void generate(size_t pixel,
+		glm::dvec2* out,
+		uint32_t pass = 0,
+		uint32_t dimension = 0) const override;
 
 private:
 	int grid_dim;
 
 };
 
-} // namespace rt
\ No newline at end of file
+/*
+	The first two dimensions of the Sobol sequence, Owen scrambled per pixel and
+	dimension with the hash based scrambling of Burley ("Practical Hash-based Owen
+	Scrambling", 2020). Every power of two prefix is stratified in all elementary
+	intervals.
+*/
+class SobolSampler2D : public Sampler2D
+{
+public:
+	SobolSampler2D(size_t width,
+		size_t height,
+		unsigned int spp,
+		uint64_t seed = 0) :
+		Sampler2D(width, height, spp, seed)
+	{
+	}
+
+	void generate(size_t pixel,
+		glm::dvec2* out,
+		uint32_t pass = 0,
+		uint32_t dimension = 0) const override;
+};
+
+/*
+	Halton sequence with the bases 2 and 3 (the next primes for higher dimensions).
+	The digits are scrambled with random shifts that depend on the preceding digits,
+	seeded per pixel.
+*/
+class HaltonSampler2D : public Sampler2D
+{
+public:
+	HaltonSampler2D(size_t width,
+		size_t height,
+		unsigned int spp,
+		uint64_t seed = 0) :
+		Sampler2D(width, height, spp, seed)
+	{
+	}
+
+	void generate(size_t pixel,
+		glm::dvec2* out,
+		uint32_t pass = 0,
+		uint32_t dimension = 0) const override;
+};
+
+/*
+	Progressive multi-jittered (0,2) samples. A few sets of TABLE_SIZE points are
+	generated when the sampler is created, as Owen scrambled (0,2) sequences, which
+	have the same stratification as the pmj02 construction of Christensen et al.
+	Pixels pick a set by hash and apply their own random digital shift, which keeps
+	the stratification. Cheaper per sample than SobolSampler2D.
+*/
+class PMJ02Sampler2D : public Sampler2D
+{
+public:
+	PMJ02Sampler2D(size_t width,
+		size_t height,
+		unsigned int spp,
+		uint64_t seed = 0);
+
+	void generate(size_t pixel,
+		glm::dvec2* out,
+		uint32_t pass = 0,
+		uint32_t dimension = 0) const override;
+
+private:
+	static constexpr uint32_t NUM_SETS = 64;
+
+	// points per set, a power of two
+	uint32_t table_size;
+	// NUM_SETS sets of table_size points in 0.32 fixed point
+	std::vector<std::pair<uint32_t, uint32_t>> sets;
+};
+
+// sampler of the given type, grid_dim^2 samples per pixel and pass
+std::unique_ptr<Sampler2D> make_sampler2D(SamplerType type,
+	size_t width,
+	size_t height,
+	size_t grid_dim,
+	uint64_t seed = 0);
+
+const char* sampler_name(SamplerType type);
+
+} // namespace rt
@@ -6,10 +6,28 @@
 #include <glm/gtx/perpendicular.hpp>
 
 #include "core/rt.h"
+#include "shape/raypacket.h"
 
 namespace rt
 {
 
+/*
+	The scene objects which can be hit by the primary rays of an image tile,
+	see Scene::cull.
+*/
+struct TileCull
+{
+	struct Entry
+	{
+		Shape* shape;
+		// roots of the BVH subtrees of the shape inside the tile frustum
+		std::vector<BVH_Node*> nodes;
+	};
+
+	std::vector<Entry> entries;
+	size_t count = 0;
+};
+
 class Scene
 {
 public:
@@ -27,7 +45,30 @@ public:
 		std::vector<std::unique_ptr<Light>> lights,
 		size_t MAX_DEPTH = 4);
 
-	double shoot_ray(const Ray& ray, SurfaceInteraction* isect) const;
+	/*
+		If cull is given, ray has to be a primary ray of the tile cull was built for
+		and only the objects and BVH subtrees inside the frustum of the tile are tested.
+	*/
+	double shoot_ray(const Ray& ray, SurfaceInteraction* isect, const TileCull* cull = nullptr) const;
+
+	void shoot_packet(RayPacket& packet, SurfaceInteraction* isects, const TileCull* cull = nullptr) const;
+
+	/*
+		Collect the objects and BVH subtrees overlapping the frustum of a tile in cull.
+	*/
+	void cull(const Frustum& frustum, TileCull& cull) const;
+
+	/*
+		Select the level of detail of all LOD meshes by their size seen from eye,
+		where one pixel spans the angle pixel_angle, 0 selects the full meshes.
+	*/
+	void update_lod(const glm::dvec3& eye, double pixel_angle);
+
+	/*
+		Move the animated objects to their place in frame, for the threads rendering
+		with the given animation slot (see Instance). Static scenes don't change.
+	*/
+	virtual void animate(size_t frame, size_t slot);
 
 	const std::vector<std::unique_ptr<Shape>>& get_scene() const
 	{
@@ -103,6 +144,7 @@ public:
 class TetrahedronScene : public Scene
 {
 public:
+	// rotation of the tetrahedron per frame in degrees
 	double degree_step;
 
 	TetrahedronScene(double degree_step, size_t MAX_DEPTH = 4);
@@ -112,6 +154,20 @@ public:
 		size_t MAX_DEPTH = 4);
 
 	void init();
+
+	// rotates the tetrahedron
+	void animate(size_t frame, size_t slot);
+
+private:
+	glm::dmat4 tetrahedron_to_world(size_t frame) const;
+
+	std::vector<Instance*> tetrahedra;
 };
 
+/*
+	Build one of the scenes above by name: "gathering", "mixed", "teapot",
+	"triangle", "dragon" or "tetrahedron". Returns nullptr for unknown names.
+*/
+std::unique_ptr<Scene> make_scene(const std::string& name);
+
 } // namespace rt
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include "core/rt.h"
+#include "shape/raypacket.h"
 #include <vector>
 
 namespace rt
@@ -13,6 +14,8 @@ public:
 	std::vector<std::shared_ptr<Shape>> shapes;
 
 	double intersect(const Ray& ray, SurfaceInteraction* isect);
+
+	void intersect(RayPacket& packet, PacketMask mask, SurfaceInteraction* isects);
 };
 
 class BVH_Tree
@@ -20,6 +23,8 @@ class BVH_Tree
 public:
 	std::unique_ptr<BVH_Node> bvh_node;
 	double intersect(const Ray& ray, SurfaceInteraction* isect);
+
+	void intersect(RayPacket& packet, PacketMask mask, SurfaceInteraction* isects);
 };
 
 
@@ -32,9 +37,33 @@ public:
 
 	bool build_bvh();
 	double traverse_bvh(const Ray& ray, SurfaceInteraction* isect);
+	void traverse_bvh(RayPacket& packet, PacketMask mask, SurfaceInteraction* isects);
+
+	/*
+		Collect the roots of the subtrees overlapping frustum, sorted from near to far.
+		Subtrees outside of the frustum are skipped, the descent stops at subtrees inside
+		of it, at leaves and at max_depth.
+	*/
+	void cull(const Frustum& frustum, std::vector<BVH_Node*>& nodes, int max_depth = 6) const;
+
+	// traverse only the subtrees collected by cull
+	double traverse_bvh(const Ray& ray, SurfaceInteraction* isect, const std::vector<BVH_Node*>& nodes);
+	void traverse_bvh(RayPacket& packet,
+		PacketMask mask,
+		SurfaceInteraction* isects,
+		const std::vector<BVH_Node*>& nodes);
+
+	const Bounds3& bounds() const
+	{
+		return *bvh_tree.bvh_node->box;
+	}
 
 private:
+	// nodes with fewer shapes are built serially
+	static constexpr size_t PARALLEL_BUILD_SIZE = 4096;
+
 	bool build_bvh(BVH_Node* current_node, int depth);
+	void cull(BVH_Node* node, const Frustum& frustum, std::vector<BVH_Node*>& nodes, int depth) const;
 
 	size_t MAX_TRIANGLE_COUNT;
 	size_t MAX_DEPTH;
@@ -0,0 +1,128 @@
+#pragma once
+#include <cstdint>
+
+#include "core/rt.h"
+#include "shape/shape.h"
+
+namespace rt
+{
+// position with 21 bits per axis relative to the bounds of its mesh, packed into 64 bits
+using QuantizedPosition = uint64_t;
+
+// unit vector in octahedral encoding with 16 bits per coordinate
+using OctNormal = uint32_t;
+
+constexpr int POSITION_BITS = 21;
+
+/*
+	Node of a flattened BVH over triangle indices. The two children of an inner node
+	are stored next to each other, offset is the index of the left one. For leaves,
+	offset is the first triangle and count the number of triangles. The bounds are
+	rounded outwards to single precision.
+*/
+struct CompressedNode
+{
+	float bounds[2][3];
+	uint32_t offset;
+	uint32_t count;
+};
+
+/*
+	Read-only view of the arrays of a compressed mesh, which either live in memory
+	or in a mapped file.
+*/
+struct CompressedMeshView
+{
+	// decoded position = origin + scale * quantized position
+	glm::dvec3 origin = glm::dvec3(0.0);
+	glm::dvec3 scale = glm::dvec3(0.0);
+
+	const QuantizedPosition* positions = nullptr;
+	const OctNormal* normals = nullptr;
+	// three vertex indices per triangle
+	const uint32_t* indices = nullptr;
+	const CompressedNode* nodes = nullptr;
+
+	size_t num_vertices = 0;
+	size_t num_triangles = 0;
+	size_t num_nodes = 0;
+
+	glm::dvec3 decode_position(uint32_t vertex) const
+	{
+		constexpr QuantizedPosition mask = (QuantizedPosition(1) << POSITION_BITS) - 1;
+		QuantizedPosition q = positions[vertex];
+
+		return origin + scale * glm::dvec3(
+			static_cast<double>(q & mask),
+			static_cast<double>((q >> POSITION_BITS) & mask),
+			static_cast<double>((q >> (2 * POSITION_BITS)) & mask));
+	}
+};
+
+/*
+	Arrays of a compressed mesh while it gets built.
+*/
+struct CompressedMeshData
+{
+	glm::dvec3 origin = glm::dvec3(0.0);
+	glm::dvec3 scale = glm::dvec3(0.0);
+
+	std::vector<QuantizedPosition> positions;
+	std::vector<OctNormal> normals;
+	std::vector<uint32_t> indices;
+	std::vector<CompressedNode> nodes;
+
+	// set the quantization grid, has to be called before any position gets encoded
+	void set_bounds(const glm::dvec3& b_min, const glm::dvec3& b_max);
+
+	QuantizedPosition encode_position(const glm::dvec3& p) const;
+
+	/*
+		Build the BVH over the triangles and sort the triangles by the leaves and the
+		vertices by their first use. The nodes get laid out as treelets, so that each
+		page of nodes_per_page nodes holds a connected part of the tree.
+	*/
+	void build_bvh(size_t max_triangle_count, size_t nodes_per_page);
+
+	CompressedMeshView view() const;
+};
+
+/*
+	Triangle mesh with shared, quantized vertices, octahedral encoded normals and a
+	compact BVH over triangle indices. It needs about a tenth of the memory of a
+	TriangleMesh made of single Triangle objects. Vertices get decoded on the fly
+	by the intersection routine.
+*/
+class CompressedMesh : public Shape
+{
+public:
+	// nodes of a 4 KiB page
+	static constexpr size_t NODES_PER_PAGE = 4096 / sizeof(CompressedNode);
+
+	CompressedMesh(const std::vector<std::shared_ptr<Shape>>& triangles, size_t max_triangle_count = 4);
+
+	double intersect(const Ray& ray, SurfaceInteraction* isect);
+
+	size_t triangle_count() const
+	{
+		return mesh.num_triangles;
+	}
+
+	// bytes used by vertices, indices and the BVH
+	size_t memory_usage() const;
+
+	static OctNormal encode_normal(const glm::dvec3& n);
+	static glm::dvec3 decode_normal(OctNormal n);
+
+protected:
+	CompressedMesh() = default;
+
+	double intersect(const CompressedNode& node, const Ray& ray) const;
+
+	CompressedMeshView mesh;
+
+private:
+	CompressedMeshData data;
+};
+
+} // namespace rt
@@ -0,0 +1,49 @@
+#pragma once
+#include "core/rt.h"
+#include "shape/ray.h"
+
+namespace rt
+{
+/*
+	Bounding frustum of a bundle of rays, e.g. the primary rays of an image tile.
+	It is bounded by the four side planes spanned by neighboring corner rays, the
+	normals of the planes point inside.
+*/
+class Frustum
+{
+public:
+	enum class Overlap
+	{
+		OUTSIDE,
+		INTERSECTING,
+		INSIDE
+	};
+
+	/*
+		corners: the rays through the four corners of the tile in circular order
+		center: a ray through the inside of the tile, used to orient the planes
+	*/
+	Frustum(const Ray corners[4], const Ray& center);
+
+	/*
+		Conservative box test, boxes that get classified as intersecting may still
+		be outside of the frustum.
+	*/
+	Overlap classify(const Bounds3& box) const;
+
+	/*
+		Distance of the point p along the center ray, used for sorting objects from
+		near to far.
+	*/
+	double depth(const glm::dvec3& p) const
+	{
+		return glm::dot(p - center.ro, center.rd);
+	}
+
+private:
+	glm::dvec3 normals[4];
+	double offsets[4];
+	Ray center;
+};
+
+} // namespace rt
@@ -0,0 +1,68 @@
+#pragma once
+#include "core/rt.h"
+#include "shape/compressedmesh.h"
+
+namespace rt
+{
+/*
+	Compressed mesh whose vertices, indices and BVH live in a memory mapped file, so
+	that meshes larger than the main memory can be rendered. The operating system
+	pages the data in on demand. The BVH nodes are laid out as treelets, one page of
+	nodes holds a connected part of the tree.
+
+	File layout, every section starts at a page boundary:
+		header | BVH nodes | indices | positions | normals
+*/
+class MappedMesh : public CompressedMesh
+{
+public:
+	static constexpr size_t PAGE_SIZE = 4096;
+
+	/*
+		Map the given mesh file. If the file can't be mapped, an error is logged and
+		the mesh stays empty.
+	*/
+	explicit MappedMesh(const std::string& file);
+
+	~MappedMesh();
+
+	MappedMesh(const MappedMesh&) = delete;
+	MappedMesh& operator=(const MappedMesh&) = delete;
+
+	bool is_mapped() const
+	{
+		return base != nullptr;
+	}
+
+	// fraction of the pages of the file currently held in memory, -1 if unknown
+	double residency() const;
+
+	/*
+		Write data to a mesh file. Returns false if the file could not be written.
+	*/
+	static bool write(const std::string& file, const CompressedMeshData& data);
+
+	/*
+		Convert an .obj file into a mesh file without creating a Shape per triangle.
+		The vertices are transformed by obj_to_world, the shading normals are averaged
+		from the faces around each vertex.
+		Returns false if one of the files could not be accessed.
+	*/
+	static bool convert_obj(const std::string& obj_file,
+		const std::string& mesh_file,
+		const glm::dmat4& obj_to_world = glm::dmat4(1.0),
+		size_t max_triangle_count = 4);
+
+private:
+	void* base = nullptr;
+	size_t length = 0;
+
+#if defined(_WIN32)
+	HANDLE file_handle = INVALID_HANDLE_VALUE;
+	HANDLE mapping_handle = nullptr;
+#else
+	int fd = -1;
+#endif
+};
+
+} // namespace rt
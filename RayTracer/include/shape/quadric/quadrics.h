@@ -8,7 +8,7 @@ namespace rt
 class Quadric : public Shape
 {
 public:
-	static bool solveQuadraticEq(double* t, double a, double b, double c);
+	static bool solveQuadraticEq(double* t, double a, double b, double c, double t_min = 0.0);
 };
 
 struct Sphere : public Quadric
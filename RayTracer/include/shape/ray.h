@@ -7,17 +7,42 @@ struct Ray
 {
 	glm::dvec3 ro;
 	glm::dvec3 rd;
-	mutable double tNearest;
 
-	Ray() : ro(0), rd(0), tNearest(INFINITY) {}
+	// reciprocal direction and the index of the near slab per axis,
+	// precomputed once so that box tests need neither divisions nor branches
+	glm::dvec3 inv_rd;
+	int sign[3];
+
+	// valid parameter interval [tMin, tMax]. tMax gets narrowed down to the nearest
+	// intersection found so far while the ray is traced through the scene
+	double tMin;
+	mutable double tMax;
+
+	Ray() : ro(0), rd(0), inv_rd(INFINITY), sign{ 0, 0, 0 }, tMin(0), tMax(INFINITY) {}
 
 	Ray(glm::dvec3 ro, glm::dvec3 rd) :
-		ro(ro), rd(rd), tNearest(INFINITY)
+		Ray(ro, rd, 0.0, INFINITY)
+	{
+	}
+
+	Ray(glm::dvec3 ro, glm::dvec3 rd, double tMax) :
+		Ray(ro, rd, 0.0, tMax)
 	{
 	}
-	Ray(glm::dvec3 ro, glm::dvec3 rd, double tNearest) :
-		ro(ro), rd(rd), tNearest(tNearest)
+
+	Ray(glm::dvec3 ro, glm::dvec3 rd, double tMin, double tMax) :
+		ro(ro), rd(rd), tMin(tMin), tMax(tMax)
+	{
+		// no need for checking division by zero, floating point arithmetic is helping here
+		inv_rd = 1.0 / rd;
+		sign[0] = inv_rd.x < 0;
+		sign[1] = inv_rd.y < 0;
+		sign[2] = inv_rd.z < 0;
+	}
+
+	bool in_range(double t) const
 	{
+		return t >= tMin && t <= tMax;
 	}
 };
 }
\ No newline at end of file
@@ -0,0 +1,87 @@
+#pragma once
+#include <cstdint>
+
+#include "core/rt.h"
+#include "shape/ray.h"
+
+namespace rt
+{
+// number of coherent rays that are traced together, one of 4, 8 or 16
+constexpr int RAY_PACKET_SIZE = 8;
+
+// if fewer rays than this are still active, the packet has diverged and the
+// remaining rays are traced one by one
+constexpr int RAY_PACKET_MIN_ACTIVE = 2;
+
+static_assert(RAY_PACKET_SIZE == 4 || RAY_PACKET_SIZE == 8 || RAY_PACKET_SIZE == 16,
+	"unsupported ray packet size");
+
+// one bit per ray of a packet, set if the ray takes part in the current operation
+using PacketMask = uint32_t;
+
+/*
+	A packet of rays for tracing coherent rays (e.g. primary rays of neighboring
+	pixels or shadow rays to the same light source) through the BVH at once.
+	The data needed by the box tests is kept as structure of arrays, so the loops
+	over the lanes can be vectorized by the compiler.
+*/
+struct RayPacket
+{
+	// the single rays, used by the shape intersection routines
+	Ray rays[RAY_PACKET_SIZE];
+
+	alignas(64) double ro[3][RAY_PACKET_SIZE] = {};
+	alignas(64) double inv_rd[3][RAY_PACKET_SIZE] = {};
+	alignas(64) double t_min[RAY_PACKET_SIZE] = {};
+	alignas(64) double t_max[RAY_PACKET_SIZE] = {};
+
+	// lanes that hold a valid ray
+	PacketMask active = 0;
+
+	void set(int lane, const Ray& ray)
+	{
+		rays[lane] = ray;
+
+		for (int k = 0; k < 3; ++k)
+		{
+			ro[k][lane] = ray.ro[k];
+			inv_rd[k][lane] = ray.inv_rd[k];
+		}
+		t_min[lane] = ray.tMin;
+		t_max[lane] = ray.tMax;
+
+		active |= lane_bit(lane);
+	}
+
+	/*
+		Copy the interval ends of the single rays back to the packet after they
+		have been narrowed by shape intersections.
+	*/
+	void update_t_max(PacketMask mask)
+	{
+		for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+		{
+			if (mask & lane_bit(i))
+			{
+				t_max[i] = rays[i].tMax;
+			}
+		}
+	}
+
+	static PacketMask lane_bit(int lane)
+	{
+		return PacketMask(1) << lane;
+	}
+
+	static int count(PacketMask mask)
+	{
+		int n = 0;
+		for (; mask; mask &= mask - 1)
+		{
+			++n;
+		}
+		return n;
+	}
+};
+
+}
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "core/rt.h"
 #include "material/material.h"
 #include "shape/ray.h"
+#include "shape/raypacket.h"
 #include "interaction/interaction.h"
 #include "texture/texture.h"
 #include "shape/bvh.h"
@@ -28,6 +29,27 @@ struct Shape
 
 	virtual double intersect(const Ray &ray, SurfaceInteraction *isect) = 0;
 
+	/*
+		Intersect all rays of the packet selected by mask. isects holds one entry per lane.
+		Shapes without a dedicated packet routine fall back to the single ray test.
+	*/
+	virtual void intersect_packet(RayPacket &packet, PacketMask mask, SurfaceInteraction *isects);
+
+	/*
+		Test the shape against the frustum of an image tile. Returns false, if none of the
+		rays of the tile can hit the shape. Shapes with a BVH store the roots of their
+		subtrees overlapping the frustum in nodes. Shapes without bounding box are kept.
+	*/
+	virtual bool cull(const Frustum &frustum, std::vector<BVH_Node*> &nodes) const;
+
+	// intersection routines restricted to the subtrees collected by cull
+	virtual double intersect_culled(const Ray &ray, SurfaceInteraction *isect, const std::vector<BVH_Node*> &nodes);
+
+	virtual void intersect_packet_culled(RayPacket &packet,
+		PacketMask mask,
+		SurfaceInteraction *isects,
+		const std::vector<BVH_Node*> &nodes);
+
 	std::unique_ptr<Bounds3> bounding_box;
 };
 
@@ -53,47 +75,44 @@ public:
 		boundaries[1] = (max_bounds);
 	}
 
-	double intersect(const Ray &ray)
+	/*
+		Branchless slab test. The near and far slab per axis are selected by the
+		precomputed direction signs of the ray, so the division and the swap of the
+		interval bounds are gone. Returns the entry parameter clamped to [tMin, tMax]
+		or INFINITY if the box is missed.
+	*/
+	double intersect(const Ray &ray) const
 	{
 		assert(abs(length(ray.rd)) > 0);
 
-		// no need for checking division by zero, doubleing point arithmetic is helping here
-		glm::dvec3 inv_rd = 1.0 / ray.rd;
-		glm::dvec3 t[2] = { glm::dvec3(INFINITY), glm::dvec3(INFINITY) };
-		// interval of intersection
-		double t0 = 0.0, t1 = INFINITY;
-
-		// the case where the ray is parallel to the plane is handled correctly by these two
-		// calculations => if the ray is outside the slabs, the values will both be -/+ inf,
-		// if it is inside, the values will be inf with different signs
-		t[0] = boundaries[0] - ray.ro;
-		t[1] = boundaries[1] - ray.ro;
-
-		for (int i = 0; i < 3; ++i)
-		{
-			t[0][i] *= inv_rd[i];
-			t[1][i] *= inv_rd[i];
-
-			if (t[0][i] > t[1][i])
-			{
-				std::swap(t[0][i], t[1][i]);
-			}
-
-			// narrow interval and check if intersection possible
-			// smaller interval bound may only get larger, the bigger interval bound may only 
-			// become smaller
-			t0 = t0 > t[0][i] ? t0 : t[0][i];
-			t1 = t1 < t[1][i] ? t1 : t[1][i];
-
-			if (t0 > t1)
-			{
-				return INFINITY;
-			}
-		}
-
-		return t0;
+		// the case where the ray is parallel to the plane is handled correctly by the
+		// reciprocal direction => if the ray is outside the slabs, the values will both be
+		// -/+ inf, if it is inside, the values will be inf with different signs
+		double tx0 = (boundaries[ray.sign[0]].x - ray.ro.x) * ray.inv_rd.x;
+		double tx1 = (boundaries[1 - ray.sign[0]].x - ray.ro.x) * ray.inv_rd.x;
+		double ty0 = (boundaries[ray.sign[1]].y - ray.ro.y) * ray.inv_rd.y;
+		double ty1 = (boundaries[1 - ray.sign[1]].y - ray.ro.y) * ray.inv_rd.y;
+		double tz0 = (boundaries[ray.sign[2]].z - ray.ro.z) * ray.inv_rd.z;
+		double tz1 = (boundaries[1 - ray.sign[2]].z - ray.ro.z) * ray.inv_rd.z;
+
+		// narrow interval, the smaller interval bound may only get larger, the bigger
+		// interval bound may only become smaller (NaNs fail the comparisons and are ignored)
+		double t0 = tx0 > ray.tMin ? tx0 : ray.tMin;
+		double t1 = tx1 < ray.tMax ? tx1 : ray.tMax;
+		t0 = ty0 > t0 ? ty0 : t0;
+		t1 = ty1 < t1 ? ty1 : t1;
+		t0 = tz0 > t0 ? tz0 : t0;
+		t1 = tz1 < t1 ? tz1 : t1;
+
+		return t0 <= t1 ? t0 : INFINITY;
 	}
 
+	/*
+		Slab test for all rays of the packet selected by mask. Returns the mask of the
+		rays hitting the box and stores their entry parameters in t_entry.
+	*/
+	PacketMask intersect(const RayPacket &packet, PacketMask mask, double *t_entry) const;
+
 	glm::dvec3 get_normal(glm::dvec3 p) const
 	{
 		return glm::dvec3(0.f);
@@ -409,6 +428,17 @@ private:
 	friend class RGBCubeTexture;
 };
 
+/*
+	Watertight ray-triangle test. Returns the ray parameter of the hit inside the
+	interval of the ray or INFINITY. barycentric receives the weights of p0, p1 and p2
+	at the hit point, if given.
+*/
+double intersect_triangle(const Ray& ray,
+	const glm::dvec3& p0,
+	const glm::dvec3& p1,
+	const glm::dvec3& p2,
+	glm::dvec3* barycentric = nullptr);
+
 class Triangle : public Shape
 {
 public:
@@ -499,6 +529,18 @@ public:
 		return bounding_box.get();
 	}
 
+	// vertex i in world space
+	const glm::dvec3& get_vertex(int i) const
+	{
+		return i == 0 ? p0 : (i == 1 ? p1 : p2);
+	}
+
+	// shading normal at vertex i in world space
+	const glm::dvec3& get_vertex_normal(int i) const
+	{
+		return i == 0 ? n0 : (i == 1 ? n1 : n2);
+	}
+
 private:
 	// vertices
 	glm::dvec3 p0, p1, p2;
@@ -522,10 +564,22 @@ public:
 		tr_mesh(tr_mesh)
 	{
 		bvh = std::make_unique<BVH>(tr_mesh);
+		bounding_box = std::make_unique<Bounds3>(bvh->bounds());
 	}
 
 	double intersect(const Ray& ray, SurfaceInteraction* isect);
 
+	void intersect_packet(RayPacket& packet, PacketMask mask, SurfaceInteraction* isects);
+
+	bool cull(const Frustum& frustum, std::vector<BVH_Node*>& nodes) const;
+
+	double intersect_culled(const Ray& ray, SurfaceInteraction* isect, const std::vector<BVH_Node*>& nodes);
+
+	void intersect_packet_culled(RayPacket& packet,
+		PacketMask mask,
+		SurfaceInteraction* isects,
+		const std::vector<BVH_Node*>& nodes);
+
 	glm::dvec3 get_normal(glm::dvec3 p) const
 	{
 		return glm::dvec3(0.f);
@@ -534,6 +588,125 @@ private:
 	std::unique_ptr<BVH> bvh;
 };
 
+/*
+	Triangle mesh with simplified versions of itself. Every level holds about a quarter
+	of the triangles of the previous one, level 0 is the full mesh. The level used for
+	rendering gets selected by the projected size of the mesh, see select. Until the
+	first select only level 0 is built, so meshes rendered without level of detail
+	don't pay for the simplification.
+*/
+class LODMesh : public Shape
+{
+public:
+	// upper limit of triangles per pixel covered by the mesh
+	static constexpr double TRIANGLES_PER_PIXEL = 1.0;
+
+	LODMesh(std::vector<std::shared_ptr<Shape>> tr_mesh,
+		size_t min_triangle_count = 256,
+		size_t max_levels = 5);
+
+	/*
+		Select the coarsest level with enough triangles for the size of the mesh seen
+		from eye, where one pixel spans the angle pixel_angle. The first call builds
+		the simplified levels, a pixel_angle of 0 selects the full mesh without them.
+	*/
+	void select(const glm::dvec3& eye, double pixel_angle);
+
+	size_t get_level() const
+	{
+		return active;
+	}
+
+	size_t get_level_count() const
+	{
+		return levels.size();
+	}
+
+	double intersect(const Ray& ray, SurfaceInteraction* isect)
+	{
+		return levels[active]->intersect(ray, isect);
+	}
+
+	void intersect_packet(RayPacket& packet, PacketMask mask, SurfaceInteraction* isects)
+	{
+		levels[active]->intersect_packet(packet, mask, isects);
+	}
+
+	bool cull(const Frustum& frustum, std::vector<BVH_Node*>& nodes) const
+	{
+		return levels[active]->cull(frustum, nodes);
+	}
+
+	double intersect_culled(const Ray& ray, SurfaceInteraction* isect, const std::vector<BVH_Node*>& nodes)
+	{
+		return levels[active]->intersect_culled(ray, isect, nodes);
+	}
+
+	void intersect_packet_culled(RayPacket& packet,
+		PacketMask mask,
+		SurfaceInteraction* isects,
+		const std::vector<BVH_Node*>& nodes)
+	{
+		levels[active]->intersect_packet_culled(packet, mask, isects, nodes);
+	}
+
+private:
+	// simplify level 0 down to min_triangle_count triangles or max_levels levels
+	void build_levels();
+
+	size_t min_triangle_count;
+	size_t max_levels;
+	bool levels_built;
+	std::vector<std::unique_ptr<TriangleMesh>> levels;
+	std::vector<size_t> triangle_counts;
+	size_t active;
+};
+
+/*
+	A shape built once in object space and placed in the scene by a transform, so
+	that moving it doesn't rebuild its BVH. The rays are transformed into object
+	space instead. An animation renders several frames with the same scene at once,
+	every frame in flight gets one of MAX_SLOTS slots with its own transform. The
+	slot of the calling thread (thread_animation_slot) selects the transform.
+*/
+class Instance : public Shape
+{
+public:
+	static constexpr size_t MAX_SLOTS = 8;
+
+	Instance(std::unique_ptr<Shape> shape, const glm::dmat4& obj_to_world);
+
+	// not safe while the slot is rendered
+	void set_transform(const glm::dmat4& obj_to_world, size_t slot = 0);
+
+	double intersect(const Ray& ray, SurfaceInteraction* isect);
+
+	void intersect_packet(RayPacket& packet, PacketMask mask, SurfaceInteraction* isects);
+
+	// tests the bounds of the transformed shape, the subtrees of its BVH aren't culled
+	bool cull(const Frustum& frustum, std::vector<BVH_Node*>& nodes) const;
+
+private:
+	struct Placement
+	{
+		glm::dmat4 obj_to_world;
+		glm::dmat4 world_to_obj;
+		// transforms the normals to world space
+		glm::dmat3 normal_to_world;
+		glm::dvec3 min_bounds;
+		glm::dvec3 max_bounds;
+	};
+
+	// move a hit found in object space to world space
+	static void to_world(const Placement& placement, SurfaceInteraction* isect);
+
+	std::unique_ptr<Shape> shape;
+	Placement placements[MAX_SLOTS];
+};
+
+// slot of the animation frame the calling thread renders, see Instance
+extern thread_local size_t thread_animation_slot;
+
 inline void create_cube(glm::dvec3 center,
 	glm::dvec3 up,
 	glm::dvec3 front,
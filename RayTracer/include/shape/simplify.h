@@ -0,0 +1,15 @@
+#pragma once
+#include "core/rt.h"
+
+namespace rt
+{
+/*
+	Simplify a mesh of triangles by quadric error edge collapses (Garland & Heckbert)
+	until at most target_count triangles are left. Vertices at the same position are
+	welded before, the shading normals of collapsed vertices are averaged.
+	Returns new triangles in world space, the input triangles are not modified.
+*/
+std::vector<std::shared_ptr<Shape>> simplify_mesh(const std::vector<std::shared_ptr<Shape>>& triangles,
+	size_t target_count);
+
+} // namespace rt
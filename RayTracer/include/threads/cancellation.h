@@ -0,0 +1,33 @@
+#pragma once
+#include <atomic>
+
+namespace rt
+{
+/*
+	Flag for cooperative cancellation: the owner of a long running operation passes
+	a token, another thread cancels it and the operation stops at its next check.
+	A cancelled token stays cancelled until it is reset.
+*/
+class CancellationToken
+{
+public:
+	void cancel()
+	{
+		cancelled.store(true, std::memory_order_relaxed);
+	}
+
+	void reset()
+	{
+		cancelled.store(false, std::memory_order_relaxed);
+	}
+
+	bool is_cancelled() const
+	{
+		return cancelled.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<bool> cancelled{ false };
+};
+
+} // namespace rt
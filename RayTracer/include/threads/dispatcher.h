@@ -1,4 +1,5 @@
 #pragma once
+#include <atomic>
 #include <thread>
 #include <mutex>
 #include "core/rt.h"
@@ -12,6 +13,18 @@ class Dispatcher
 
 };
 
+/*
+	Order in which the tiles of a Slice are handed out. COLUMNS is the plain raster
+	order (column by column). MORTON and HILBERT follow space filling curves, so
+	consecutive tiles are neighbors and reuse the cached BVH nodes and geometry of
+	the previous tile. SPIRAL starts at the image center and moves outwards, which
+	shows the interesting part of the image first in previews.
+*/
+enum class TileOrder
+{
+	COLUMNS, MORTON, HILBERT, SPIRAL
+};
+
 class Slice
 {
 public:
@@ -28,7 +41,7 @@ public:
 
 	std::vector<std::pair<int, int>> pairs;
 
-	Slice(const rt::Image& img, int w, int h)
+	Slice(const rt::Image& img, int w, int h, TileOrder order = TileOrder::COLUMNS)
 	{
 		/*if ((img.get_height() % 16 != 0) || (img.get_width() % 16 != 0))
 		{
@@ -46,8 +59,6 @@ public:
 		dx = static_cast<int>(img_width / w + (img_width % w == 0 ? 0 : 1));
 		dy = static_cast<int>(img_height / h + (img_height % h == 0 ? 0 : 1));
 
-		idx = -1;
-
 		for (int i = 0; i < dx; ++i)
 		{
 			for (int j = 0; j < dy; ++j)
@@ -56,13 +67,57 @@ public:
 			}
 		}
 		length = pairs.size();
+
+		sort_pairs(order);
+		partition(1);
 	}
 
 	/*
 		Return next index of the raster
 		If no index is left, -1 is returned
+		Safe to call from several threads without locking, every index is
+		handed out exactly once.
+	*/
+	int get_index()
+	{
+		return get_index(0);
+	}
+
+	/*
+		Return the next index of the given part, see partition. Once the part is
+		exhausted, tiles of the other parts are taken.
+	*/
+	int get_index(size_t part);
+
+	/*
+		Split the tiles into parts of horizontal bands of the image, e.g. one per NUMA
+		node, keeping their order within a part. Must be called before tiles are
+		handed out.
 	*/
-	int get_index();
+	void partition(size_t parts);
+
+	// hand out all tiles again, in the same order
+	void rewind();
+
+	size_t get_parts() const
+	{
+		return part_begin.size() - 1;
+	}
+
+	// pixel rows [first, second) covered by the tiles of a part
+	std::pair<size_t, size_t> part_rows(size_t part) const;
+
+	// number of tiles handed out to other parts than their own
+	int64_t get_stolen() const
+	{
+		return stolen;
+	}
+
+	/*
+		Reorder the tiles by decreasing cost, cost[i] belonging to pairs[i]. Tiles of
+		equal cost keep their order. Must be called before tiles are handed out.
+	*/
+	void sort_by_cost(const std::vector<double>& cost);
 
 	size_t get_length()
 	{
@@ -70,8 +125,16 @@ public:
 	}
 
 private:
-	// index variable for the vector of coordinate pairs
-	int idx;
+	void sort_pairs(TileOrder order);
+
+	// part of a tile starting at pixel row y
+	size_t part_of_row(size_t y) const;
+
+	// first index of every part in 'pairs', followed by the length
+	std::vector<size_t> part_begin;
+	// next free index of every part
+	std::unique_ptr<std::atomic<size_t>[]> part_next;
+	std::atomic<int64_t> stolen{ 0 };
 	// size of 'pairs'
 	size_t length;
 };
@@ -0,0 +1,174 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "core/rt.h"
+#include "misc/stats.h"
+
+namespace rt
+{
+class TaskGroup;
+
+/*
+	Persistent pool of worker threads with one task deque per worker. Workers take
+	their own tasks from the back (last in, first out, which keeps recently split work
+	in the cache) and steal from the front of the other deques when they run dry.
+	Threads waiting for a TaskGroup help executing tasks instead of blocking, so task
+	groups can be nested (e.g. recursive BVH builds).
+	Workers can be pinned to logical CPUs, one per physical core before using SMT
+	siblings (see cpu_placement_order).
+*/
+class ThreadPool
+{
+public:
+	explicit ThreadPool(size_t num_threads, bool pin_threads = false);
+
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	size_t size() const
+	{
+		return workers.size();
+	}
+
+	bool pins_threads() const
+	{
+		return !cpus.empty();
+	}
+
+	// logical CPU the given worker is pinned to, -1 if the workers aren't pinned
+	int worker_cpu(size_t worker) const
+	{
+		return cpus.empty() ? -1 : cpus[worker % cpus.size()];
+	}
+
+	// number of workers currently sleeping because they found no task
+	size_t idle_workers() const
+	{
+		return idle;
+	}
+
+	// time the given worker spent executing tasks since the last reset
+	int64_t busy_time_ns(size_t worker) const
+	{
+		return workers[worker]->busy_ns;
+	}
+
+	void reset_busy_time();
+
+	/*
+		Call body(begin, end) for consecutive chunks of [begin, end) with at most grain
+		indices each, distributed over the workers. Returns when all chunks are done.
+	*/
+	void parallel_for(size_t begin,
+		size_t end,
+		size_t grain,
+		const std::function<void(size_t, size_t)>& body);
+
+	// index of the calling worker thread of this pool, -1 for other threads
+	int worker_index() const;
+
+	/*
+		The pool used by code that is not handed a pool explicitly (BVH builds, mesh
+		loading, image output). Set by the owner of the pool, nullptr if there is none,
+		in which case such code runs serially.
+	*/
+	static ThreadPool* current();
+
+	static void set_current(ThreadPool* pool);
+
+	// contention of the task deques, shared by all workers
+	LockStats& lock_stats()
+	{
+		return deque_lock_stats;
+	}
+
+private:
+	friend class TaskGroup;
+
+	struct Task
+	{
+		std::function<void()> fn;
+		TaskGroup* group;
+	};
+
+	struct Worker
+	{
+		explicit Worker(LockStats& stats) :
+			mutex(stats)
+		{
+		}
+
+		CountingMutex mutex;
+		std::deque<Task> tasks;
+		std::atomic<int64_t> busy_ns{ 0 };
+	};
+
+	void submit(Task task);
+
+	// execute one pending task, returns false if there was none
+	bool run_one();
+
+	bool pop_or_steal(int self, Task* task);
+
+	void execute(Task& task);
+
+	void worker_loop(int index);
+
+	LockStats deque_lock_stats;
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+	// CPUs the workers are pinned to in order of the worker index, empty if unpinned
+	std::vector<int> cpus;
+
+	std::atomic<bool> stop;
+	std::atomic<size_t> pending;
+	std::atomic<size_t> next_queue;
+	std::atomic<size_t> idle;
+
+	std::mutex sleep_mutex;
+	std::condition_variable wake_up;
+
+	static ThreadPool* current_pool;
+};
+
+/*
+	Set of tasks that can be waited for. The destructor waits for all tasks of the
+	group.
+*/
+class TaskGroup
+{
+public:
+	explicit TaskGroup(ThreadPool& pool) :
+		pool(pool), count(0)
+	{
+	}
+
+	~TaskGroup()
+	{
+		wait();
+	}
+
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+
+	void run(std::function<void()> task);
+
+	// execute pending tasks of the pool until all tasks of this group are finished,
+	// sleeps while there are none
+	void wait();
+
+private:
+	friend class ThreadPool;
+
+	ThreadPool& pool;
+	std::atomic<size_t> count;
+};
+
+} // namespace rt
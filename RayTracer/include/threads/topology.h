@@ -0,0 +1,33 @@
+#pragma once
+#include "core/rt.h"
+
+namespace rt
+{
+/*
+	Number of worker threads to use by default: the logical CPUs the process may run
+	on (affinity mask), capped by the CPU quota of the cgroup the process runs in, so
+	that a container limited to 4 CPUs on a 64 core node doesn't start 64 workers.
+*/
+size_t default_thread_count();
+
+/*
+	Logical CPUs the process may run on, ordered for placing worker threads: one CPU
+	of every physical core first, then their SMT siblings. NUMA nodes take turns, so
+	that a few threads already use the memory bandwidth of all nodes. Without topology
+	information the CPUs are returned in ascending order.
+*/
+std::vector<int> cpu_placement_order();
+
+// bind the calling thread to the given logical CPU, returns false on failure
+bool pin_current_thread(int cpu);
+
+// NUMA node of each of the given logical CPUs, 0 where the platform doesn't tell
+std::vector<int> cpu_numa_nodes(const std::vector<int>& cpus);
+
+/*
+	Migrate the memory pages lying completely inside [begin, begin + bytes) to the
+	given NUMA node. Returns false if the platform doesn't support moving pages.
+*/
+bool move_to_numa_node(void* begin, size_t bytes, int node);
+
+} // namespace rt
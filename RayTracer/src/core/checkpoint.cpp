@@ -0,0 +1,208 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "core/checkpoint.h"
+
+namespace rt
+{
+
+namespace
+{
+constexpr char CHECKPOINT_MAGIC[8] = { 'R', 'T', 'C', 'K', 'P', 'T', '\0', '\0' };
+constexpr uint32_t CHECKPOINT_VERSION = 1;
+
+struct CheckpointHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t spp;
+	uint32_t grid_dim;
+	uint32_t sampler;
+	uint64_t seed;
+	uint32_t tile_width;
+	uint32_t tile_height;
+	uint32_t adaptive;
+	uint32_t passes;
+	double error;
+};
+
+template <typename T>
+void write_array(std::ofstream& ofs, const std::vector<T>& v)
+{
+	ofs.write(reinterpret_cast<const char*>(v.data()), static_cast<std::streamsize>(v.size() * sizeof(T)));
+}
+
+template <typename T>
+bool read_array(std::ifstream& ifs, std::vector<T>& v, size_t count)
+{
+	v.resize(count);
+	return static_cast<bool>(ifs.read(reinterpret_cast<char*>(v.data()), static_cast<std::streamsize>(count * sizeof(T))));
+}
+
+// calls f(first pixel, pixel count) for every row of the finished tiles
+template <typename F>
+void for_done_tile_rows(const Checkpoint& c, F f)
+{
+	size_t tiles_x = (c.width + c.tile_width - 1) / c.tile_width;
+
+	for (size_t t = 0; t < c.tiles_done.size(); ++t)
+	{
+		if (!c.tiles_done[t])
+		{
+			continue;
+		}
+		size_t x0 = t % tiles_x * c.tile_width;
+		size_t y0 = t / tiles_x * c.tile_height;
+		size_t w = std::min<size_t>(c.tile_width, c.width - x0);
+		size_t h = std::min<size_t>(c.tile_height, c.height - y0);
+
+		for (size_t y = y0; y < y0 + h; ++y)
+		{
+			f(y * c.width + x0, w);
+		}
+	}
+}
+} // namespace
+
+bool Checkpoint::matches(const Checkpoint& other) const
+{
+	return width == other.width && height == other.height &&
+		spp == other.spp && grid_dim == other.grid_dim &&
+		sampler == other.sampler && seed == other.seed &&
+		tile_width == other.tile_width && tile_height == other.tile_height &&
+		adaptive == other.adaptive;
+}
+
+bool Checkpoint::write(const std::string& file, const std::vector<glm::dvec3>& colors) const
+{
+	std::string tmp_file = file + ".tmp";
+	std::ofstream ofs{ tmp_file, std::ios::binary | std::ios::trunc };
+
+	if (!ofs.is_open())
+	{
+		LOG(ERROR) << "Could not open checkpoint file " << tmp_file << " for writing";
+		return false;
+	}
+
+	CheckpointHeader header{};
+	std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	header.version = CHECKPOINT_VERSION;
+	header.width = width;
+	header.height = height;
+	header.spp = spp;
+	header.grid_dim = grid_dim;
+	header.sampler = sampler;
+	header.seed = seed;
+	header.tile_width = tile_width;
+	header.tile_height = tile_height;
+	header.adaptive = adaptive;
+	header.passes = passes;
+	header.error = error;
+	ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	write_array(ofs, pixel_passes);
+	write_array(ofs, pixel_active);
+	// the sums are only needed once a pass has been accumulated
+	if (passes > 0)
+	{
+		write_array(ofs, sum);
+		write_array(ofs, odd_sum);
+		write_array(ofs, lum_sq_sum);
+	}
+	write_array(ofs, tiles_done);
+
+	for_done_tile_rows(*this, [&](size_t first, size_t count) {
+		ofs.write(reinterpret_cast<const char*>(&colors[first]), static_cast<std::streamsize>(count * sizeof(colors[0])));
+	});
+
+	ofs.close();
+	if (!ofs)
+	{
+		LOG(ERROR) << "Could not write checkpoint file " << tmp_file;
+		std::remove(tmp_file.c_str());
+		return false;
+	}
+
+#if defined(_WIN32)
+	bool replaced = MoveFileExA(tmp_file.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	bool replaced = std::rename(tmp_file.c_str(), file.c_str()) == 0;
+#endif
+	if (!replaced)
+	{
+		LOG(ERROR) << "Could not replace checkpoint file " << file;
+	}
+	return replaced;
+}
+
+bool Checkpoint::read(const std::string& file, std::vector<glm::dvec3>& colors)
+{
+	std::ifstream ifs{ file, std::ios::binary };
+
+	if (!ifs.is_open())
+	{
+		LOG(ERROR) << "Could not open checkpoint file " << file;
+		return false;
+	}
+
+	CheckpointHeader header;
+	Checkpoint c;
+
+	if (!ifs.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+		header.version != CHECKPOINT_VERSION ||
+		header.tile_width == 0 || header.tile_height == 0)
+	{
+		LOG(ERROR) << "Checkpoint file " << file << " has an invalid header";
+		return false;
+	}
+
+	c.width = header.width;
+	c.height = header.height;
+	c.spp = header.spp;
+	c.grid_dim = header.grid_dim;
+	c.sampler = header.sampler;
+	c.seed = header.seed;
+	c.tile_width = header.tile_width;
+	c.tile_height = header.tile_height;
+	c.adaptive = header.adaptive;
+	c.passes = header.passes;
+	c.error = header.error;
+
+	size_t pixels = static_cast<size_t>(c.width) * c.height;
+	size_t tiles = ((c.width + c.tile_width - 1) / c.tile_width) * ((c.height + c.tile_height - 1) / c.tile_height);
+	bool ok = read_array(ifs, c.pixel_passes, pixels) &&
+		read_array(ifs, c.pixel_active, pixels);
+
+	if (ok && c.passes > 0)
+	{
+		ok = read_array(ifs, c.sum, pixels) &&
+			read_array(ifs, c.odd_sum, pixels) &&
+			read_array(ifs, c.lum_sq_sum, c.adaptive ? pixels : 0);
+	}
+	ok = ok && read_array(ifs, c.tiles_done, tiles);
+
+	std::vector<glm::dvec3> done_colors(pixels, glm::dvec3(0.0));
+	if (ok)
+	{
+		for_done_tile_rows(c, [&](size_t first, size_t count) {
+			ok = ok && ifs.read(reinterpret_cast<char*>(&done_colors[first]),
+				static_cast<std::streamsize>(count * sizeof(done_colors[0])));
+		});
+	}
+
+	if (!ok)
+	{
+		LOG(ERROR) << "Checkpoint file " << file << " is truncated";
+		return false;
+	}
+
+	*this = std::move(c);
+	colors = std::move(done_colors);
+	return true;
+}
+
+} // namespace rt
@@ -1,25 +1,129 @@
 #include "core/renderer.h"
+#include "core/checkpoint.h"
 #include "shape/ray.h"
+#include "shape/raypacket.h"
+#include "shape/frustum.h"
+#include "shape/mappedmesh.h"
 #include "scene/scene.h"
 #include "camera/camera.h"
 #include "shape/shape.h"
 #include "light/light.h"
 #include "image/image.h"
+#include "image/tilewriter.h"
 #include "samplers/sampler2D.h"
 #include "threads/dispatcher.h"
+#include "threads/topology.h"
 #include "integrators/phong.h"
+#include "integrators/rayqueue.h"
+#include "misc/stats.h"
+#include "net/distributed.h"
 
 namespace rt
 {
 //#define DEBUG_NORMALS
 
+// tiles are only split if both halves get at least this many rows
+static constexpr int MIN_SPLIT_ROWS = 2;
+
+// the cost pre-pass traces one primary ray per PREPASS_STRIDE x PREPASS_STRIDE pixels
+static constexpr int PREPASS_STRIDE = 8;
+
+// width and height of the tiles handed out to the workers
+static constexpr int TILE_SIZE = 16;
+
+// adaptive sampling measures the error of darker pixels relative to this luminance
+static constexpr double ADAPTIVE_MIN_LUMINANCE = 0.05;
+
+// scenes kept with their BVHs between renders, see Renderer::set_scene
+static constexpr size_t MAX_CACHED_SCENES = 4;
+
+// vertical field of view of the camera
+static constexpr double FOV = glm::radians(30.0);
+
+// animations render frames at once until every worker gets this many tiles, at most
+// MAX_FRAMES_IN_FLIGHT frames. Every frame in flight costs an image and its buffers
+static constexpr size_t MIN_TILES_PER_WORKER = 4;
+static constexpr size_t MAX_FRAMES_IN_FLIGHT = 4;
+
+// angle spanned by one pixel of an image of the given height
+static double pixel_angle(size_t height)
+{
+	// distance to view plane
+	double foc_len = 0.5 * 1.0 / tan(FOV / 2);
+	// one pixel has the size 1 on the image plane at the distance of the focal length
+	return 1.0 / (height * foc_len * 0.5);
+}
+
+namespace
+{
+// the frame of an animation the calling thread renders, see Instance
+struct AnimationSlotScope
+{
+	explicit AnimationSlotScope(size_t slot) :
+		previous(thread_animation_slot)
+	{
+		thread_animation_slot = slot;
+	}
+
+	~AnimationSlotScope()
+	{
+		thread_animation_slot = previous;
+	}
+
+	size_t previous;
+};
+} // namespace
+
 Renderer::Renderer(size_t w, size_t h,
 	const std::string& file,
 	size_t max_depth) :
 	img(new Image(w, h, file)),
 	SPP(1),
 	GRID_DIM(1),
-	NUM_THREADS(1)
+	SAMPLER(SamplerType::STRATIFIED),
+	SAMPLE_SEED(0),
+	FORCE_JITTER(false),
+	NUM_THREADS(default_thread_count()),
+	PIN_THREADS(false),
+	PACKET_TRACING(true),
+	DEFER_SECONDARY_RAYS(false),
+	FRUSTUM_CULLING(true),
+	TILE_BUFFERS(false),
+	STREAM_OUTPUT(true),
+	LEVEL_OF_DETAIL(false),
+	TILE_ORDER(TileOrder::HILBERT),
+	ADAPTIVE_TILE_SPLITTING(true),
+	COST_PREPASS(false),
+	NUMA_AWARE(false),
+	NUMA_REPLICATE_SCENE(false),
+	PROGRESSIVE(false),
+	TIME_BUDGET_MS(0.0),
+	TARGET_SPP(256),
+	CONVERGENCE_THRESHOLD(0.0),
+	PROGRESSIVE_WRITE_INTERVAL(0),
+	ADAPTIVE_SAMPLING(false),
+	ADAPTIVE_THRESHOLD(0.05),
+	ADAPTIVE_MIN_PASSES(4),
+	CHECKPOINT_INTERVAL_S(0.0),
+	RESUME(false),
+	DISTRIBUTED_TIMEOUT_S(60.0),
+	tile_client(nullptr),
+	SCENE("tetrahedron"),
+	CUSTOM_CAMERA(false),
+	CAMERA_EYE(0.0),
+	CAMERA_LOOK_AT(0.0, 0.0, -1.0),
+	CAMERA_UP(0.0, 1.0, 0.0),
+	ANIMATION_FRAMES(90),
+	FRAMES_IN_FLIGHT(0),
+	ANIMATION_FRAME(false),
+	ANIMATION_SLOT(0),
+	scene_uses(0),
+	preview_passes(0),
+	cancel_token(std::make_shared<CancellationToken>()),
+	has_priority_region(false),
+	priority_min(0),
+	priority_max(0),
+	priority_generation(0)
 {
 	if (max_depth < 0)
 	{
@@ -32,6 +136,11 @@ Renderer::Renderer(size_t w, size_t h,
 	}
 }
 
+// defined here, where Scene and Camera are complete
+Renderer::~Renderer()
+{
+}
+
 void Renderer::render_gradient(
 	size_t& width_img,
 	const size_t& width_stripe,
@@ -59,11 +168,802 @@ void Renderer::render_gradient(
 	}
 }
 
+std::vector<double> Renderer::measure_tile_costs(Slice& slice, const Scene& scene, Integrator& integrator)
+{
+	// distance to view plane
+	double foc_len = 0.5 * 1.0 / tan(FOV / 2);
+
+	std::vector<double> cost(slice.get_length());
+	pbrt::ProgressReporter prepass_reporter(static_cast<int64_t>(cost.size()), "Pre-pass:");
+
+	pool->parallel_for(0, cost.size(), 16, [&](size_t begin, size_t end) {
+		AnimationSlotScope slot(ANIMATION_SLOT);
+
+		for (size_t t = begin; t < end; ++t)
+		{
+			int x0 = slice.pairs[t].first;
+			int y0 = slice.pairs[t].second;
+			int w_step = static_cast<int>(std::min(slice.w_step, slice.img_width - x0));
+			int h_step = static_cast<int>(std::min(slice.h_step, slice.img_height - y0));
+
+			int64_t rays_start = thread_ray_count;
+			int64_t nodes_start = thread_node_visits;
+
+			for (int i = std::min(PREPASS_STRIDE / 2, h_step / 2); i < h_step; i += PREPASS_STRIDE)
+			{
+				for (int j = std::min(PREPASS_STRIDE / 2, w_step / 2); j < w_step; j += PREPASS_STRIDE)
+				{
+					double u = static_cast<int64_t>(x0) + j - img->get_width()*0.5;
+					double v = -(y0 + i) + img->get_height()*0.5;
+
+					integrator.Li(scene.cam->getPrimaryRay(u, v, img->get_height() * foc_len * 0.5), scene, 0);
+				}
+			}
+
+			cost[t] = static_cast<double>(thread_ray_count - rays_start) +
+				static_cast<double>(thread_node_visits - nodes_start);
+			prepass_reporter.Update();
+		}
+	});
+
+	Stats::set("Pre-pass time [ms]", prepass_reporter.ElapsedMS());
+	prepass_reporter.Done();
+	return cost;
+}
+
+std::vector<int> Renderer::assign_numa_parts(std::vector<size_t>& worker_part)
+{
+	std::vector<int> part_nodes;
+	worker_part.assign(pool->size(), 0);
+
+	if (!NUMA_AWARE)
+	{
+		return part_nodes;
+	}
+
+	std::vector<int> worker_cpus;
+	for (size_t w = 0; w < pool->size(); ++w)
+	{
+		worker_cpus.push_back(pool->worker_cpu(w));
+	}
+	std::vector<int> worker_nodes = cpu_numa_nodes(worker_cpus);
+
+	for (size_t w = 0; w < pool->size(); ++w)
+	{
+		auto it = std::find(part_nodes.begin(), part_nodes.end(), worker_nodes[w]);
+		worker_part[w] = it - part_nodes.begin();
+
+		if (it == part_nodes.end())
+		{
+			part_nodes.push_back(worker_nodes[w]);
+		}
+	}
+	return part_nodes;
+}
+
+void Renderer::replicate_scene(CachedScene& cached, const std::vector<int>& part_nodes,
+	const std::vector<size_t>& worker_part)
+{
+	std::vector<std::unique_ptr<Scene>>& replicas = cached.replicas;
+
+	if (!NUMA_REPLICATE_SCENE || part_nodes.size() <= 1)
+	{
+		replicas.clear();
+	}
+	else if (cached.replica_nodes != part_nodes)
+	{
+		// every copy is built serially by a thread on its node, the first touch places
+		// the memory there. Parallel builds would spread it over the worker nodes
+		replicas.clear();
+		ThreadPool::set_current(nullptr);
+
+		for (size_t p = 0; p < part_nodes.size(); ++p)
+		{
+			size_t w = std::find(worker_part.begin(), worker_part.end(), p) - worker_part.begin();
+			int cpu = pool->worker_cpu(w);
+
+			std::thread builder([&]() {
+				pin_current_thread(cpu);
+				replicas.push_back(make_scene(SCENE));
+			});
+			builder.join();
+		}
+		ThreadPool::set_current(pool.get());
+		LOG(INFO) << "Replicated the scene on " << replicas.size() << " NUMA nodes";
+	}
+	cached.replica_nodes = replicas.empty() ? std::vector<int>() : part_nodes;
+
+	for (auto& replica : replicas)
+	{
+		*replica->cam = *cached.scene->cam;
+		replica->update_lod(glm::dvec3(cached.scene->cam->getOrigin()), LEVEL_OF_DETAIL ? pixel_angle(img->get_height()) : 0.0);
+	}
+}
+
+Renderer::RenderState::RenderState(Image& img, TileOrder order, ThreadPool& pool) :
+	slice(img, TILE_SIZE, TILE_SIZE, order),
+	workers(pool),
+	tiles_exhausted(false)
+{
+}
+
+void Renderer::RenderState::reset_tiles()
+{
+	for (size_t t = 0; t < slice.get_length(); ++t)
+	{
+		tile_taken[t] = 0;
+		size_t x0 = slice.pairs[t].first;
+		size_t y0 = slice.pairs[t].second;
+		tile_cell[t] = y0 / slice.h_step * tiles_x + x0 / slice.w_step;
+		tile_remaining[t] = static_cast<int64_t>(std::min(slice.w_step, slice.img_width - x0) *
+			std::min(slice.h_step, slice.img_height - y0));
+	}
+}
+
+size_t Renderer::current_part(const RenderState& rs) const
+{
+	int w = pool->worker_index();
+	return w >= 0 ? rs.worker_part[w] : 0;
+}
+
+Scene& Renderer::current_scene(RenderState& rs)
+{
+	return rs.replicas->empty() ? *rs.scene : *(*rs.replicas)[current_part(rs)];
+}
+
+void Renderer::push_tile(RenderState& rs, size_t t)
+{
+	Slice& slice = rs.slice;
+	size_t x0 = slice.pairs[t].first;
+	size_t y0 = slice.pairs[t].second;
+	tile_writer->push(x0, y0, std::min(slice.w_step, slice.img_width - x0),
+		std::min(slice.h_step, slice.img_height - y0), img->colors);
+}
+
+int Renderer::next_priority_tile(RenderState& rs)
+{
+	PriorityTiles& queue = rs.priority_tiles;
+	Slice& slice = rs.slice;
+	uint64_t generation = priority_generation.load();
+
+	// never set
+	if (generation == 0)
+	{
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (generation != queue.generation)
+	{
+		queue.generation = generation;
+		queue.tiles.clear();
+
+		std::lock_guard<std::mutex> region_lock(priority_mutex);
+		for (size_t t = 0; t < slice.get_length() && has_priority_region; ++t)
+		{
+			size_t x0 = slice.pairs[t].first;
+			size_t y0 = slice.pairs[t].second;
+
+			if (x0 < priority_max.x && x0 + slice.w_step > priority_min.x &&
+				y0 < priority_max.y && y0 + slice.h_step > priority_min.y)
+			{
+				queue.tiles.push_back(t);
+			}
+		}
+	}
+
+	while (!queue.tiles.empty())
+	{
+		size_t t = queue.tiles.front();
+		queue.tiles.pop_front();
+
+		if (!rs.tile_taken[t].exchange(1))
+		{
+			Stats::add("Priority tiles", 1.0);
+			return static_cast<int>(t);
+		}
+	}
+	return -1;
+}
+
+bool Renderer::resume_checkpoint(RenderState& rs)
+{
+	Checkpoint& state = rs.state;
+	Checkpoint saved;
+	std::vector<glm::dvec3> colors;
+
+	if (!saved.read(CHECKPOINT_FILE, colors))
+	{
+		LOG(WARNING) << "Could not resume from " << CHECKPOINT_FILE << ", starting from scratch";
+		return false;
+	}
+	if (!saved.matches(state))
+	{
+		LOG(WARNING) << "Checkpoint " << CHECKPOINT_FILE << " was written with other render settings, starting from scratch";
+		return false;
+	}
+	if (saved.passes > 0 && !PROGRESSIVE)
+	{
+		LOG(WARNING) << "Checkpoint " << CHECKPOINT_FILE << " continues a progressive render, starting from scratch";
+		return false;
+	}
+
+	// move assignment keeps the member objects, references to them stay valid
+	state = std::move(saved);
+	img->colors = std::move(colors);
+
+	for (size_t t = 0; t < rs.slice.get_length(); ++t)
+	{
+		if (state.tiles_done[rs.tile_cell[t]])
+		{
+			rs.tile_remaining[t] = 0;
+		}
+	}
+	LOG(INFO) << "Resuming from " << CHECKPOINT_FILE << " after " << state.passes << " passes and "
+		<< std::count(state.tiles_done.begin(), state.tiles_done.end(), 1) << " tiles";
+	return true;
+}
+
+void Renderer::write_checkpoint(RenderState& rs, bool pass_finished, bool force)
+{
+	std::unique_lock<std::mutex> lock(checkpoint_mutex, std::try_to_lock);
+	auto now = std::chrono::steady_clock::now();
+
+	if (CHECKPOINT_FILE.empty() || tile_client || !lock.owns_lock() ||
+		(!force && (CHECKPOINT_INTERVAL_S <= 0.0 ||
+			std::chrono::duration<double>(now - last_checkpoint).count() < CHECKPOINT_INTERVAL_S)))
+	{
+		return;
+	}
+
+	for (size_t t = 0; t < rs.slice.get_length(); ++t)
+	{
+		rs.state.tiles_done[rs.tile_cell[t]] = !pass_finished && rs.tile_remaining[t].load() == 0;
+	}
+	if (rs.state.write(CHECKPOINT_FILE, img->colors))
+	{
+		Stats::add("Checkpoints written", 1.0);
+		LOG(INFO) << "Wrote checkpoint " << CHECKPOINT_FILE;
+	}
+	last_checkpoint = std::chrono::steady_clock::now();
+}
+
+bool Renderer::start_render(RenderState& rs)
+{
+	Slice& slice = rs.slice;
+	Checkpoint& state = rs.state;
+	state.width = static_cast<uint32_t>(slice.img_width);
+	state.height = static_cast<uint32_t>(slice.img_height);
+	state.spp = static_cast<uint32_t>(SPP);
+	state.grid_dim = static_cast<uint32_t>(GRID_DIM);
+	state.sampler = static_cast<uint32_t>(SAMPLER);
+	state.seed = SAMPLE_SEED;
+	state.tile_width = static_cast<uint32_t>(slice.w_step);
+	state.tile_height = static_cast<uint32_t>(slice.h_step);
+	state.adaptive = ADAPTIVE_SAMPLING;
+
+	// adaptive sampling: the passes every pixel got and whether it still gets more
+	size_t num_pixels = img->colors.size();
+	std::vector<char>& pixel_active = state.pixel_active;
+	rs.tile_active.assign(slice.get_length(), 1);
+	state.pixel_passes.assign(num_pixels, 0);
+	pixel_active.assign(num_pixels, 1);
+
+	rs.tiles_x = (slice.img_width + slice.w_step - 1) / slice.w_step;
+	rs.tiles_y = (slice.img_height + slice.h_step - 1) / slice.h_step;
+	rs.tile_cell.resize(slice.get_length());
+	rs.tile_remaining.reset(new std::atomic<int64_t>[slice.get_length()]);
+	rs.tile_taken.reset(new std::atomic<char>[slice.get_length()]);
+	rs.reset_tiles();
+	state.tiles_done.assign(rs.tiles_x * rs.tiles_y, 0);
+
+	rs.tile_of_cell.resize(rs.tiles_x * rs.tiles_y);
+	for (size_t t = 0; t < slice.get_length(); ++t)
+	{
+		rs.tile_of_cell[rs.tile_cell[t]] = t;
+	}
+
+	bool resumed = RESUME && !tile_client && resume_checkpoint(rs);
+
+	// the tiles restored from the checkpoint are finished already
+	for (size_t t = 0; t < slice.get_length() && tile_writer; ++t)
+	{
+		if (rs.tile_remaining[t].load() == 0)
+		{
+			push_tile(rs, t);
+		}
+	}
+
+	// tiles without unconverged pixels are skipped
+	rs.active_pixels = 0;
+
+	for (size_t t = 0; t < slice.get_length(); ++t)
+	{
+		size_t x0 = slice.pairs[t].first;
+		size_t y0 = slice.pairs[t].second;
+		char active = 0;
+
+		for (size_t y = y0; y < std::min(y0 + slice.h_step, slice.img_height); ++y)
+		{
+			for (size_t x = x0; x < std::min(x0 + slice.w_step, slice.img_width); ++x)
+			{
+				rs.active_pixels += pixel_active[y * slice.img_width + x];
+				active |= pixel_active[y * slice.img_width + x];
+			}
+		}
+		rs.tile_active[t] = active;
+	}
+	rs.start_passes = state.passes;
+	last_checkpoint = std::chrono::steady_clock::now();
+	return resumed;
+}
+
+void Renderer::render_region(RenderState& rs, size_t tile, int x0, int y0, int w_step, int h_step)
+{
+	int64_t rays_start = thread_ray_count;
+	Slice& slice = rs.slice;
+	Scene& scene = current_scene(rs);
+	const std::vector<char>& pixel_active = rs.state.pixel_active;
+	const std::vector<uint32_t>& pixel_passes = rs.state.pixel_passes;
+	// samples of the pixels of the current packet, generated on demand by the sampler
+	std::vector<glm::dvec2> samples(static_cast<size_t>(rs.packet_width) * rs.array_size);
+	// secondary rays of the current region, if they are deferred
+	RayQueue queue;
+	RayQueue* tile_queue = DEFER_SECONDARY_RAYS ? &queue : nullptr;
+	// objects inside the frustum of the current region
+	TileCull cull;
+	TileCull* tile_cull = FRUSTUM_CULLING ? &cull : nullptr;
+	// samples are summed in a buffer of the worker and the region is written to the
+	// framebuffer once it's done, instead of once per sample next to the regions
+	// of other workers. Regions don't nest on a thread, so one buffer is enough
+	thread_local std::vector<glm::dvec3> tile_buffer;
+	std::vector<glm::dvec3>& colors = TILE_BUFFERS ? tile_buffer : img->colors;
+
+	if (TILE_BUFFERS)
+	{
+		tile_buffer.assign(static_cast<size_t>(w_step) * h_step, glm::dvec3(0.0));
+	}
+
+	if (tile_cull)
+	{
+		double d = img->get_height() * rs.foc_len * 0.5;
+
+		// image plane coordinates of the region border, padded by one pixel on every side
+		double u0 = static_cast<int64_t>(x0) - img->get_width()*0.5 - 1.0;
+		double u1 = u0 + w_step + 2.0;
+		double v0 = -static_cast<int64_t>(y0) + img->get_height()*0.5 + 1.0;
+		double v1 = v0 - h_step - 2.0;
+
+		Ray corners[4] = {
+			scene.cam->getPrimaryRay(u0, v0, d),
+			scene.cam->getPrimaryRay(u1, v0, d),
+			scene.cam->getPrimaryRay(u1, v1, d),
+			scene.cam->getPrimaryRay(u0, v1, d)
+		};
+		Frustum frustum(corners, scene.cam->getPrimaryRay(0.5 * (u0 + u1), 0.5 * (v0 + v1), d));
+
+		scene.cull(frustum, cull);
+		Stats::add("Frustum culled objects", static_cast<double>(scene.sc.size() - cull.count));
+	}
+
+	for (int i = 0; i < h_step; ++i)
+	{
+		// the unfinished region is dropped
+		if (cancel_token->is_cancelled())
+		{
+			return;
+		}
+
+		// at the end of the frame hand the lower half of the remaining rows to idle
+		// workers, so that a single expensive tile doesn't keep the others waiting
+		if (ADAPTIVE_TILE_SPLITTING && h_step - i >= 2 * MIN_SPLIT_ROWS &&
+			rs.tiles_exhausted.load(std::memory_order_relaxed) && pool->idle_workers() > 0)
+		{
+			int rows = (h_step - i) / 2;
+			int split_y = y0 + h_step - rows;
+
+			h_step -= rows;
+			Stats::add("Split tiles", 1.0);
+
+			rs.workers.run([this, &rs, tile, x0, split_y, w_step, rows]() {
+				AnimationSlotScope slot(ANIMATION_SLOT);
+				CacheCounter cache_counter;
+				render_region(rs, tile, x0, split_y, w_step, rows);
+				cache_counter.report();
+			});
+		}
+
+		// neighboring pixels of a row are traced together as one ray packet
+		for (int j = 0; j < w_step; j += rs.packet_width)
+		{
+			int lanes = std::min(rs.packet_width, w_step - j);
+			size_t row_offset = (static_cast<size_t>(y0) + i) * slice.img_width + x0 + j;
+			// index of the first pixel in colors
+			size_t color_offset = TILE_BUFFERS ? static_cast<size_t>(i) * w_step + j : row_offset;
+
+			// converged pixels are skipped by adaptive sampling
+			int active_lanes = 0;
+			for (int k = 0; k < lanes; ++k)
+			{
+				active_lanes += pixel_active[row_offset + k];
+			}
+			if (active_lanes == 0)
+			{
+				continue;
+			}
+
+			for (int s = 0; s < SPP; ++s)
+			{
+				// every pass continues the sample sequences of the pixels
+				for (int k = 0; k < lanes && rs.jitter; ++k)
+				{
+					rs.sampler->generate(row_offset + k, &samples[k * rs.array_size],
+						static_cast<uint32_t>(pixel_passes[row_offset + k] * SPP + s));
+				}
+
+				for (size_t n = 0; n < rs.array_size; ++n)
+				{
+					 //map pixel coordinates to[-1, 1]x[-1, 1]
+					/*double u = (2.0 * (x0 + j + samplingArray[n].x) - img->get_width()) / img->get_height();
+					double v = (-2.0 * (y0 + i + samplingArray[n].y) + img->get_height()) / img->get_height();
+					*/
+			//		double z = -(img->get_height() * 0.5) / fov_tan;
+
+					if (PACKET_TRACING)
+					{
+						RayPacket packet;
+						RGB_Color L[RAY_PACKET_SIZE];
+						size_t pixels[RAY_PACKET_SIZE];
+
+						for (int k = 0; k < lanes; ++k)
+						{
+							pixels[k] = color_offset + k;
+							if (!pixel_active[row_offset + k])
+							{
+								continue;
+							}
+							glm::dvec2 offset = rs.jitter ? samples[k * rs.array_size + n] : glm::dvec2(0.0);
+							double u = static_cast<int64_t>(x0) + j + k + offset.x - img->get_width()*0.5;
+							double v = -(y0 + i + offset.y) + img->get_height()*0.5;
+							packet.set(k, scene.cam->getPrimaryRay(u, v, img->get_height() * rs.foc_len * 0.5));
+						}
+
+						rs.integrator->Li(packet, scene, L, tile_queue, pixels, tile_cull);
+
+						for (int k = 0; k < lanes; ++k)
+						{
+							if (packet.active & RayPacket::lane_bit(k))
+							{
+								colors[color_offset + k] += clamp(L[k]);
+							}
+						}
+					}
+					else
+					{
+						glm::dvec2 offset = rs.jitter ? samples[n] : glm::dvec2(0.0);
+						double u = static_cast<int64_t>(x0) + j + offset.x - img->get_width()*0.5;
+						double v = -(y0 + i + offset.y) + img->get_height()*0.5;
+						PathState path{ tile_queue, glm::dvec3(1.0), color_offset };
+
+						colors[color_offset] +=
+							clamp(rs.integrator->Li(
+								scene.cam->getPrimaryRay(u, v, img->get_height() * rs.foc_len * 0.5), scene, 0,
+								tile_queue ? &path : nullptr, tile_cull));
+						//scene.cam->getPrimaryRay(u, v, /*img->get_height()**/foc_len/**0.5*/), scene, 0));
+					}
+				}
+			}
+		}
+	}
+
+	// trace the collected reflection and refraction rays of the region
+	// sorted as a batch
+	if (tile_queue)
+	{
+		Stats::add("Deferred secondary rays", static_cast<double>(queue.size()));
+		rs.integrator->trace_deferred(queue, scene, colors);
+	}
+
+	// the pixels of a pass start at 0, so the normalized sums replace them
+	for (int i = 0; i < h_step; ++i)
+	{
+		size_t row_offset = (static_cast<size_t>(y0) + i) * slice.img_width + x0;
+		size_t color_offset = TILE_BUFFERS ? static_cast<size_t>(i) * w_step : row_offset;
+
+		for (int j = 0; j < w_step; ++j)
+		{
+			if (pixel_active[row_offset + j])
+			{
+				img->colors[row_offset + j] = colors[color_offset + j] * rs.sample_weight;
+			}
+		}
+	}
+	if (TILE_BUFFERS)
+	{
+		Stats::add("Tile buffer commits", 1.0);
+	}
+	rs.reporter->Update(static_cast<int64_t>(w_step) * h_step);
+	Stats::add("Rays traced", static_cast<double>(thread_ray_count - rays_start));
+
+	// the last region of a tile finishes it
+	int64_t pixels = static_cast<int64_t>(w_step) * h_step;
+	if (rs.tile_remaining[tile].fetch_sub(pixels) == pixels)
+	{
+		if (tile_client)
+		{
+			int tile_x = slice.pairs[tile].first;
+			int tile_y = slice.pairs[tile].second;
+			tile_client->send_tile(tile_x, tile_y,
+				static_cast<int>(std::min(slice.w_step, slice.img_width - tile_x)),
+				static_cast<int>(std::min(slice.h_step, slice.img_height - tile_y)),
+				img->colors, slice.img_width);
+		}
+		else
+		{
+			if (tile_writer)
+			{
+				push_tile(rs, tile);
+			}
+			write_checkpoint(rs, false, false);
+		}
+	}
+}
+
+void Renderer::fetch_tiles(RenderState& rs)
+{
+	AnimationSlotScope slot(ANIMATION_SLOT);
+	CacheCounter cache_counter;
+	Slice& slice = rs.slice;
+
+	while (true)
+	{
+		// try to access the next free image raster, of a distributed render
+		// ask the coordinator for one
+		int idx = -1;
+		int tile_x;
+		int tile_y;
+
+		if (cancel_token->is_cancelled())
+		{
+			break;
+		}
+		else if (!tile_client)
+		{
+			idx = next_priority_tile(rs);
+			while (idx < 0 && (idx = slice.get_index(current_part(rs))) >= 0 && rs.tile_taken[idx].exchange(1))
+			{
+				// taken before as a tile of the priority region
+				idx = -1;
+			}
+		}
+		else if (tile_client->next_tile(tile_x, tile_y, 2 * NUM_THREADS) &&
+			tile_x >= 0 && tile_x < static_cast<int>(slice.img_width) && tile_x % TILE_SIZE == 0 &&
+			tile_y >= 0 && tile_y < static_cast<int>(slice.img_height) && tile_y % TILE_SIZE == 0)
+		{
+			idx = static_cast<int>(rs.tile_of_cell[tile_y / TILE_SIZE * rs.tiles_x + tile_x / TILE_SIZE]);
+		}
+
+		if (idx < 0)
+		{
+			rs.tiles_exhausted = true;
+			break;
+		}
+
+		assert(idx < slice.get_length());
+
+		// get step range
+		int w_step = static_cast<int>(std::min(slice.w_step, slice.img_width - slice.pairs[idx].first));
+		int h_step = static_cast<int>(std::min(slice.h_step, slice.img_height - slice.pairs[idx].second));
+
+		// converged tiles and tiles restored from a checkpoint
+		if (!rs.tile_active[idx] || rs.tile_remaining[idx].load() == 0)
+		{
+			rs.reporter->Update(static_cast<int64_t>(w_step) * h_step);
+			continue;
+		}
+
+		render_region(rs, idx, slice.pairs[idx].first, slice.pairs[idx].second, w_step, h_step);
+	}
+
+	cache_counter.report();
+}
+
+void Renderer::render_pass(RenderState& rs)
+{
+	// every pass starts with the priority region
+	rs.priority_tiles.generation = 0;
+	rs.tiles_exhausted = false;
+	rs.reporter = std::make_unique<pbrt::ProgressReporter>(
+		static_cast<int64_t>(rs.slice.img_width) * rs.slice.img_height, "Rendering:");
+
+	for (int i = 0; i < NUM_THREADS; ++i)
+	{
+		rs.workers.run([this, &rs]() { fetch_tiles(rs); });
+	}
+
+	rs.workers.wait();
+	rs.reporter->Done();
+	rs.reporter.reset();
+}
+
+void Renderer::accumulate_pass(RenderState& rs)
+{
+	Checkpoint& state = rs.state;
+	Slice& slice = rs.slice;
+	size_t num_pixels = img->colors.size();
+	// running sums of all passes and of the odd ones, for the average and its error
+	std::vector<glm::dvec3>& sum = state.sum;
+	std::vector<glm::dvec3>& odd_sum = state.odd_sum;
+	// adaptive sampling: sum of the squared luminances of the passes of every pixel
+	// for its variance
+	std::vector<double>& lum_sq_sum = state.lum_sq_sum;
+	std::vector<uint32_t>& pixel_passes = state.pixel_passes;
+	std::vector<char>& pixel_active = state.pixel_active;
+
+	sum.resize(num_pixels, glm::dvec3(0.0));
+	odd_sum.resize(num_pixels, glm::dvec3(0.0));
+	lum_sq_sum.resize(ADAPTIVE_SAMPLING ? num_pixels : 0, 0.0);
+	double sq_diff = 0.0;
+	double brightness = 0.0;
+	std::mutex sums_mutex;
+
+	pool->parallel_for(0, slice.get_length(), 16, [&](size_t begin, size_t end) {
+		double tiles_sq_diff = 0.0;
+		double tiles_brightness = 0.0;
+
+		for (size_t t = begin; t < end; ++t)
+		{
+			size_t x0 = slice.pairs[t].first;
+			size_t y0 = slice.pairs[t].second;
+			size_t x1 = std::min(x0 + slice.w_step, slice.img_width);
+			size_t y1 = std::min(y0 + slice.h_step, slice.img_height);
+			bool converged = true;
+
+			for (size_t y = y0; y < y1; ++y)
+			{
+				for (size_t i = y * slice.img_width + x0; i < y * slice.img_width + x1; ++i)
+				{
+					// converged pixels keep their average, they weren't rendered
+					bool rendered = pixel_active[i] != 0;
+					glm::dvec3 c = img->colors[i];
+					uint32_t n = rendered ? ++pixel_passes[i] : pixel_passes[i];
+
+					if (rendered)
+					{
+						sum[i] += c;
+						if (n % 2 == 0)
+						{
+							odd_sum[i] += c;
+						}
+					}
+					img->colors[i] = sum[i] / static_cast<double>(n);
+
+					double lum = (img->colors[i].x + img->colors[i].y + img->colors[i].z) / 3.0;
+					tiles_brightness += lum;
+
+					if (!ADAPTIVE_SAMPLING)
+					{
+						if (n % 2 == 0)
+						{
+							glm::dvec3 d = (sum[i] - 2.0 * odd_sum[i]) * (2.0 / n);
+							tiles_sq_diff += glm::dot(d, d) / 3.0;
+						}
+						continue;
+					}
+
+					if (rendered)
+					{
+						double pass_lum = (c.x + c.y + c.z) / 3.0;
+						lum_sq_sum[i] += pass_lum * pass_lum;
+					}
+
+					// variance of the average of the n passes
+					double var = n > 1 ? std::max(lum_sq_sum[i] / n - lum * lum, 0.0) / (n - 1) : 0.0;
+					tiles_sq_diff += var;
+
+					if (rendered && n >= ADAPTIVE_MIN_PASSES &&
+						std::sqrt(var) < ADAPTIVE_THRESHOLD * std::max(lum, ADAPTIVE_MIN_LUMINANCE))
+					{
+						pixel_active[i] = 0;
+					}
+					converged = converged && !pixel_active[i];
+				}
+			}
+
+			if (ADAPTIVE_SAMPLING && converged)
+			{
+				rs.tile_active[t] = 0;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(sums_mutex);
+		sq_diff += tiles_sq_diff;
+		brightness += tiles_brightness;
+	});
+
+	double n = static_cast<double>(std::max<size_t>(num_pixels, 1));
+
+	if (ADAPTIVE_SAMPLING)
+	{
+		state.error = std::sqrt(sq_diff / n) / std::max(brightness / n, 1.0);
+	}
+	else if (state.passes % 2 == 0)
+	{
+		// each half average has twice the variance of the full one
+		state.error = 0.5 * std::sqrt(sq_diff / n) / std::max(brightness / n, 1.0);
+	}
+
+	if (ADAPTIVE_SAMPLING)
+	{
+		rs.active_pixels = std::count(pixel_active.begin(), pixel_active.end(), 1);
+	}
+}
+
+void Renderer::publish_pass(RenderState& rs)
+{
+	{
+		std::lock_guard<std::mutex> lock(preview_mutex);
+		preview = img->colors;
+		preview_passes = rs.state.passes;
+	}
+
+	if (PROGRESSIVE_WRITE_INTERVAL > 0 && rs.state.passes % PROGRESSIVE_WRITE_INTERVAL == 0)
+	{
+		img->write_image_to_file();
+
+		// writing converts the colors to 8 bit in place
+		std::lock_guard<std::mutex> lock(preview_mutex);
+		img->colors = preview;
+	}
+}
+
+bool Renderer::render_finished(const RenderState& rs, double total_ms) const
+{
+	uint32_t passes = rs.state.passes;
+	double error = rs.state.error;
+	size_t spp = static_cast<size_t>(passes) * SPP * rs.array_size;
+
+	LOG(INFO) << "Pass " << passes << ": " << spp << " spp, relative error " << error
+		<< ", " << rs.active_pixels << " pixels active, " << total_ms << " ms";
+
+	// stop before a pass that would overrun the time budget, which only counts the
+	// passes since a resume
+	double session_passes = passes - rs.start_passes;
+	return (TARGET_SPP > 0 && spp >= TARGET_SPP) ||
+		(ADAPTIVE_SAMPLING && rs.active_pixels == 0) ||
+		(TIME_BUDGET_MS > 0.0 && total_ms * (session_passes + 1.0) / session_passes > TIME_BUDGET_MS) ||
+		(CONVERGENCE_THRESHOLD > 0.0 && error < CONVERGENCE_THRESHOLD) ||
+		(TARGET_SPP == 0 && TIME_BUDGET_MS <= 0.0 && CONVERGENCE_THRESHOLD <= 0.0);
+}
+
+void Renderer::keep_cancelled_render(RenderState& rs)
+{
+	Checkpoint& state = rs.state;
+	LOG(WARNING) << "Render cancelled after " << state.passes << " passes";
+	Stats::set("Cancelled", 1.0);
+
+	// the tiles finished so far can be resumed, the image of a progressive render goes
+	// back to the average of the finished passes, which run() still writes
+	write_checkpoint(rs, false, true);
+	if (PROGRESSIVE && !tile_client && state.passes > 0)
+	{
+		for (size_t i = 0; i < img->colors.size(); ++i)
+		{
+			img->colors[i] = state.pixel_passes[i] > 0 ?
+				state.sum[i] / static_cast<double>(state.pixel_passes[i]) : glm::dvec3(0.0);
+		}
+
+		std::lock_guard<std::mutex> lock(preview_mutex);
+		preview = img->colors;
+		preview_passes = state.passes;
+	}
+}
+
 void Renderer::render_with_threads(
 	size_t& width,
 	size_t& height)
 {
-	constexpr double fov = glm::radians(30.0);
+	constexpr double fov = FOV;
 	double fov_tan = tan(fov / 2);
 	double u = 0.0, v = 0.0;
 	// distance to view plane
@@ -92,92 +992,219 @@ void Renderer::render_with_threads(
 	return col;
 #endif
 
-	StratifiedSampler2D sampler{ width, height, GRID_DIM };
-	size_t array_size = GRID_DIM * GRID_DIM;
-	const glm::dvec2* samplingArray;
+	// the animation has started the workers of its frames
+	if (!ANIMATION_FRAME)
+	{
+		start_pool();
+	}
+
+	// the tiles of the render and the settings of its samples, shared by the workers
+	RenderState rs(*img, TILE_ORDER, *pool);
+	Slice& slice = rs.slice;
+	Checkpoint& state = rs.state;
+	rs.sampler = make_sampler2D(SAMPLER, img->get_width(), img->get_height(), GRID_DIM, SAMPLE_SEED);
+	rs.array_size = GRID_DIM * GRID_DIM;
+	// a single sample per pixel stays at the pixel corner, more are spread over the pixel
+	rs.jitter = rs.array_size * SPP > 1 || PROGRESSIVE || FORCE_JITTER;
+	// pixels per ray packet, single rays are traced if packet tracing is disabled
+	rs.packet_width = PACKET_TRACING ? RAY_PACKET_SIZE : 1;
+	rs.foc_len = foc_len;
 	inv_spp = 1.0 / SPP;
+	rs.sample_weight = inv_grid_dim * inv_spp;
+
+	// only the first render of a scene builds it and its BVHs
+	auto scene_start = std::chrono::steady_clock::now();
+	CachedScene& cached = *cached_scene(SCENE);
+	double scene_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - scene_start).count();
+	Scene* sc = cached.scene.get();
+	rs.integrator = std::make_unique<PhongIntegrator>();
+
+	// the frames of an animation share the scene and the statistics, both are set up
+	// by the animation
+	if (!ANIMATION_FRAME)
+	{
+		prepare_scene(cached);
+		Stats::clear();
+		pool->lock_stats().reset();
+		Stats::set("Scene build time [ms]", scene_ms);
+	}
+
+	int64_t minor_faults_start;
+	int64_t major_faults_start;
+	Stats::page_faults(&minor_faults_start, &major_faults_start);
+
+	// copies of the scene, one per node, so that BVH and triangles are read from local memory
+	std::vector<int> part_nodes = assign_numa_parts(rs.worker_part);
+	replicate_scene(cached, part_nodes, rs.worker_part);
+	rs.scene = sc;
+	rs.replicas = &cached.replicas;
+
+	int64_t numa_local_start;
+	int64_t numa_remote_start;
+	bool numa_stats = Stats::numa_allocations(&numa_local_start, &numa_remote_start);
 
-	std::unique_ptr<Scene> sc = std::make_unique<TetrahedronScene>(1);
-	auto integrator = std::make_unique<PhongIntegrator>();
+	// a distributed render's coordinator decides the order of the tiles
+	if (COST_PREPASS && !tile_client)
+	{
+		slice.sort_by_cost(measure_tile_costs(slice, *sc, *rs.integrator));
+	}
 
-	// enclose with braces for destructor of ProgressReporter at the end of rendering
+	if (part_nodes.size() > 1)
 	{
-		Slice slice(*img, 16, 16);
-		std::mutex pairs_mutex;
-		std::mutex sampler_mutex;
-		std::vector<std::thread> threads_v;
+		// one band of tile rows per node, with its framebuffer rows moved to the node
+		slice.partition(part_nodes.size());
+
+		for (size_t p = 0; p < slice.get_parts(); ++p)
+		{
+			auto rows = slice.part_rows(p);
 
-		// launch progress reporter
-		int64_t total_tile_pixels = static_cast<int64_t>(slice.dx) * slice.dy;
-		pbrt::ProgressReporter reporter(total_tile_pixels, "Rendering:");
+			if (rows.second > rows.first && !move_to_numa_node(&img->colors[rows.first * slice.img_width],
+				(rows.second - rows.first) * slice.img_width * sizeof(img->colors[0]), part_nodes[p]))
+			{
+				LOG(WARNING) << "Could not move framebuffer rows to NUMA node " << part_nodes[p];
+			}
+		}
+	}
+
+	if (!ANIMATION_FRAME)
+	{
+		pool->reset_busy_time();
+	}
+	{
+		std::lock_guard<std::mutex> lock(preview_mutex);
+		preview_passes = 0;
+	}
+	auto render_start = std::chrono::steady_clock::now();
+	bool resumed = start_render(rs);
 
-		// start rendering with threads
-		for (int i = 0; i < NUM_THREADS; ++i)
+	if (PROGRESSIVE && TARGET_SPP == 0 && TIME_BUDGET_MS <= 0.0 && CONVERGENCE_THRESHOLD <= 0.0)
+	{
+		LOG(WARNING) << "Progressive rendering without a budget, rendering a single pass";
+	}
+
+	// one pass renders SPP * GRID_DIM^2 samples per pixel, progressive rendering
+	// repeats them until a budget is reached
+	while (true)
+	{
+		// a resumed pass keeps the tiles finished before
+		if (state.passes > 0 && !resumed)
 		{
-			threads_v.push_back(std::thread([&]() {
-				int idx = 0;
-				int h_step;
-				int w_step;
+			slice.rewind();
+			std::fill(img->colors.begin(), img->colors.end(), glm::dvec3(0.0));
+			rs.reset_tiles();
+		}
+		resumed = false;
+		render_pass(rs);
 
-				while (idx != -1)
-				{
-					// try to access the next free image raster
-					pairs_mutex.lock();
-					idx = slice.get_index();
-					pairs_mutex.unlock();
+		if (cancel_token->is_cancelled())
+		{
+			keep_cancelled_render(rs);
+			break;
+		}
+		++state.passes;
 
-					if (idx < 0)
-					{
-						break;
-					}
+		// workers of a distributed render only render their tiles once
+		if (!PROGRESSIVE || tile_client)
+		{
+			break;
+		}
 
-					assert(idx < slice.get_length());
+		accumulate_pass(rs);
+		publish_pass(rs);
 
-					// get step range
-					w_step = static_cast<int>(std::min(slice.w_step, slice.img_width - slice.pairs[idx].first));
-					h_step = static_cast<int>(std::min(slice.h_step, slice.img_height - slice.pairs[idx].second));
+		double total_ms = std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - render_start).count();
+		bool finished = render_finished(rs, total_ms);
+
+		// the final state is always written, so that the render can be continued later
+		write_checkpoint(rs, true, finished);
+
+		if (finished)
+		{
+			break;
+		}
+	}
+
+	double elapsed_ms = std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - render_start).count();
+	size_t num_pixels = img->colors.size();
+	uint32_t passes = state.passes;
+
+	Stats::set("Passes", static_cast<double>(passes));
+	Stats::set("Samples per pixel", static_cast<double>(passes) * SPP * rs.array_size);
+	if (PROGRESSIVE && state.error < INFINITY)
+	{
+		Stats::set("Estimated relative error", state.error);
+	}
+
+	// samples of every pixel, all pixels got every pass without adaptive sampling
+	sample_counts.assign(num_pixels, static_cast<uint32_t>(passes * SPP * rs.array_size));
+
+	if (ADAPTIVE_SAMPLING)
+	{
+		double total_samples = 0.0;
+		for (size_t i = 0; i < num_pixels; ++i)
+		{
+			sample_counts[i] = static_cast<uint32_t>(state.pixel_passes[i] * SPP * rs.array_size);
+			total_samples += sample_counts[i];
+		}
+		Stats::set("Average samples per pixel", total_samples / std::max<size_t>(num_pixels, 1));
+		Stats::set("Converged pixels [%]",
+			100.0 * (num_pixels - rs.active_pixels) / std::max<size_t>(num_pixels, 1));
+
+		if (!SAMPLE_HEATMAP_FILE.empty())
+		{
+			write_sample_heatmap(SAMPLE_HEATMAP_FILE);
+		}
+	}
+
+	Stats::set("Render time [ms]", elapsed_ms);
+	Stats::set("Worker threads", static_cast<double>(NUM_THREADS));
+	set_idle_stats(elapsed_ms);
+	if (Stats::get("LLC references") > 0)
+	{
+		Stats::set("LLC miss rate [%]", 100.0 * Stats::get("LLC misses") / Stats::get("LLC references"));
+	}
+	Stats::set("Mrays/s", Stats::get("Rays traced") / (std::max(elapsed_ms, 1.0) * 1e3));
+
+	int64_t minor_faults;
+	int64_t major_faults;
+	Stats::page_faults(&minor_faults, &major_faults);
+	Stats::set("Page faults (minor)", static_cast<double>(minor_faults - minor_faults_start));
+	Stats::set("Page faults (major)", static_cast<double>(major_faults - major_faults_start));
+
+	if (!ANIMATION_FRAME)
+	{
+		pool->lock_stats().report("Task deque lock");
+	}
 
-					for (int i = 0; i < h_step; ++i)
-					{
-						for (int j = 0; j < w_step; ++j)
-						{
-							sampler_mutex.lock();
-							samplingArray = sampler.get2DArray();
-							sampler_mutex.unlock();
+	if (part_nodes.size() > 1)
+	{
+		Stats::set("NUMA nodes", static_cast<double>(part_nodes.size()));
+		Stats::set("Tiles taken from other nodes", static_cast<double>(slice.get_stolen()));
+	}
 
-							for (int s = 0; s < SPP; ++s)
-							{
-								for (size_t n = 0; n < array_size; ++n)
-								{
-									 //map pixel coordinates to[-1, 1]x[-1, 1]
-									/*double u = (2.0 * (slice.pairs[idx].first + j + samplingArray[n].x) - img->get_width()) / img->get_height();
-									double v = (-2.0 * (slice.pairs[idx].second + i + samplingArray[n].y) + img->get_height()) / img->get_height();
-									*/
-									double u = static_cast<int64_t>(slice.pairs[idx].first) + j - img->get_width()*0.5;
-									double v = -(slice.pairs[idx].second + i) + img->get_height()*0.5;
-							//		double z = -(img->get_height() * 0.5) / fov_tan;
-							
-									img->colors[(static_cast<size_t>(slice.pairs[idx].second) + i) * slice.img_width + slice.pairs[idx].first + j] +=
-										clamp(integrator->Li(
-											sc->cam->getPrimaryRay(u, v, img->get_height() * foc_len * 0.5), *sc.get(), 0));
-									//sc->cam->getPrimaryRay(u, v, /*img->get_height()**/foc_len/**0.5*/), *sc.get(), 0));
-								}
-							}
-							img->colors[(static_cast<size_t>(slice.pairs[idx].second) + i) * slice.img_width + slice.pairs[idx].first + j] *=
-								inv_grid_dim * inv_spp;
-						}
-					}
-					reporter.Update();
-				}
-				}));
-		}
+	int64_t numa_local;
+	int64_t numa_remote;
+	if (numa_stats && Stats::numa_allocations(&numa_local, &numa_remote))
+	{
+		Stats::set("NUMA local page allocations", static_cast<double>(numa_local - numa_local_start));
+		Stats::set("NUMA remote page allocations", static_cast<double>(numa_remote - numa_remote_start));
+	}
 
-		for (int i = 0; i < NUM_THREADS; ++i)
+	int mapped_count = 0;
+	for (const auto& objs : sc->sc)
+	{
+		if (auto mapped = dynamic_cast<const MappedMesh*>(objs.get()))
 		{
-			threads_v[i].join();
+			Stats::set("Mapped mesh " + std::to_string(mapped_count++) + " pages resident [%]",
+				100.0 * mapped->residency());
 		}
+	}
 
-		reporter.Done();
+	if (!ANIMATION_FRAME)
+	{
+		Stats::report();
 	}
 }
 
@@ -301,6 +1328,583 @@ void Renderer::render_with_threads(
 //	}
 //}
 
+/*
+	Convergence of every sampler against a Sobol reference, see renderer.h
+*/
+void Renderer::benchmark_samplers()
+{
+	// grid_dim of the reference, 1024 samples per pixel
+	constexpr size_t REFERENCE_GRID_DIM = 32;
+
+	size_t saved_grid_dim = GRID_DIM;
+	size_t saved_spp = SPP;
+	SamplerType saved_sampler = SAMPLER;
+	uint64_t saved_seed = SAMPLE_SEED;
+	size_t width, height;
+
+	// at 1 spp every sampler would trace the pixel corners
+	FORCE_JITTER = true;
+
+	auto render = [&](SamplerType type, size_t grid_dim, uint64_t seed) {
+		SAMPLER = type;
+		GRID_DIM = grid_dim;
+		SPP = 1;
+		SAMPLE_SEED = seed;
+		std::fill(img->colors.begin(), img->colors.end(), glm::dvec3(0.0));
+		render_with_threads(width, height);
+		return img->colors;
+	};
+
+	// independent seed, so that the errors of the reference don't correlate with the others
+	std::vector<glm::dvec3> reference = render(SamplerType::SOBOL, REFERENCE_GRID_DIM, 0x5eed);
+
+	std::ofstream csv("sampler_convergence.csv");
+	csv << "sampler,spp,rmse,render_ms\n";
+
+	for (SamplerType type : { SamplerType::STRATIFIED, SamplerType::SOBOL, SamplerType::HALTON, SamplerType::PMJ02 })
+	{
+		for (size_t grid_dim : { 1, 2, 4, 8 })
+		{
+			std::vector<glm::dvec3> colors = render(type, grid_dim, 0);
+			double sq_error = 0.0;
+
+			for (size_t i = 0; i < colors.size(); ++i)
+			{
+				glm::dvec3 d = colors[i] - reference[i];
+				sq_error += glm::dot(d, d) / 3.0;
+			}
+			double rmse = std::sqrt(sq_error / std::max<size_t>(colors.size(), 1));
+			double ms = Stats::get("Render time [ms]");
+
+			csv << sampler_name(type) << "," << grid_dim * grid_dim << "," << rmse << "," << ms << "\n";
+			LOG(INFO) << "Sampler " << sampler_name(type) << ", " << grid_dim * grid_dim
+				<< " spp: RMSE " << rmse << ", " << ms << " ms";
+		}
+	}
+
+	GRID_DIM = saved_grid_dim;
+	SPP = saved_spp;
+	SAMPLER = saved_sampler;
+	SAMPLE_SEED = saved_seed;
+	FORCE_JITTER = false;
+	std::fill(img->colors.begin(), img->colors.end(), glm::dvec3(0.0));
+}
+
+void Renderer::set_progressive(double time_budget_ms,
+	size_t target_spp,
+	double convergence_threshold,
+	size_t write_interval)
+{
+	PROGRESSIVE = true;
+	TIME_BUDGET_MS = time_budget_ms;
+	TARGET_SPP = target_spp;
+	CONVERGENCE_THRESHOLD = convergence_threshold;
+	PROGRESSIVE_WRITE_INTERVAL = write_interval;
+}
+
+void Renderer::set_adaptive(double threshold,
+	size_t min_passes,
+	const std::string& heatmap_file)
+{
+	PROGRESSIVE = true;
+	ADAPTIVE_SAMPLING = true;
+	ADAPTIVE_THRESHOLD = threshold;
+	// the variance of a pixel needs at least two passes
+	ADAPTIVE_MIN_PASSES = std::max<size_t>(min_passes, 2);
+	SAMPLE_HEATMAP_FILE = heatmap_file;
+}
+
+void Renderer::set_checkpoint(const std::string& file,
+	double interval_s,
+	bool resume)
+{
+	CHECKPOINT_FILE = file;
+	CHECKPOINT_INTERVAL_S = interval_s;
+	RESUME = resume;
+}
+
+void Renderer::write_sample_heatmap(const std::string& file) const
+{
+	Image heatmap(img->get_width(), img->get_height(), file);
+	uint32_t max_count = 1;
+
+	for (uint32_t count : sample_counts)
+	{
+		max_count = std::max(max_count, count);
+	}
+
+	// black over red and yellow to white for the most samples
+	for (size_t i = 0; i < sample_counts.size() && i < heatmap.colors.size(); ++i)
+	{
+		double t = 3.0 * sample_counts[i] / max_count;
+		heatmap.colors[i] = glm::clamp(glm::dvec3(t, t - 1.0, t - 2.0), 0.0, 1.0);
+	}
+	heatmap.write_image_to_file();
+}
+
+size_t Renderer::get_preview(std::vector<glm::dvec3>& colors) const
+{
+	std::lock_guard<std::mutex> lock(preview_mutex);
+
+	if (preview_passes > 0)
+	{
+		colors = preview;
+	}
+	return preview_passes;
+}
+
+void Renderer::set_animation(size_t frames, size_t frames_in_flight)
+{
+	ANIMATION_FRAMES = frames;
+	FRAMES_IN_FLIGHT = std::min(frames_in_flight, Instance::MAX_SLOTS);
+}
+
+void Renderer::set_cancellation_token(std::shared_ptr<CancellationToken> token)
+{
+	cancel_token = token ? std::move(token) : std::make_shared<CancellationToken>();
+}
+
+void Renderer::cancel()
+{
+	cancel_token->cancel();
+}
+
+void Renderer::set_priority_region(size_t x0, size_t y0, size_t x1, size_t y1)
+{
+	std::lock_guard<std::mutex> lock(priority_mutex);
+	has_priority_region = x0 < x1 && y0 < y1;
+	priority_min = glm::u64vec2(x0, y0);
+	priority_max = glm::u64vec2(x1, y1);
+	++priority_generation;
+}
+
+void Renderer::clear_priority_region()
+{
+	std::lock_guard<std::mutex> lock(priority_mutex);
+	has_priority_region = false;
+	++priority_generation;
+}
+
+void Renderer::render_animation()
+{
+	start_pool();
+	Stats::clear();
+	pool->lock_stats().reset();
+
+	auto scene_start = std::chrono::steady_clock::now();
+	CachedScene& cached = *cached_scene(SCENE);
+	Stats::set("Scene build time [ms]", std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - scene_start).count());
+	prepare_scene(cached);
+
+	size_t width = img->get_width();
+	size_t height = img->get_height();
+	size_t tiles = ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+	size_t in_flight = FRAMES_IN_FLIGHT;
+
+	if (in_flight == 0)
+	{
+		in_flight = std::min((MIN_TILES_PER_WORKER * NUM_THREADS + tiles - 1) / tiles, MAX_FRAMES_IN_FLIGHT);
+	}
+	in_flight = std::max<size_t>(std::min(in_flight, ANIMATION_FRAMES), 1);
+	LOG(INFO) << "Rendering " << ANIMATION_FRAMES << " frames, " << in_flight << " at once";
+
+	// picture.ppm becomes picture_0000.ppm, picture_0001.ppm, ...
+	std::string file = img->get_file_name();
+	size_t dot = file.find_last_of('.');
+	size_t slash = file.find_last_of("\\/");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+	{
+		dot = file.size();
+	}
+	auto frame_file = [&](size_t frame) {
+		char number[16];
+		snprintf(number, sizeof(number), "_%04zu", frame);
+		return file.substr(0, dot) + number + file.substr(dot);
+	};
+
+	// one renderer per frame in flight, sharing the workers and the scene. Their
+	// settings are those of this renderer, without output, checkpoints and replicas
+	std::vector<std::unique_ptr<Renderer>> frames;
+	for (size_t slot = 0; slot < in_flight; ++slot)
+	{
+		auto frame = std::make_unique<Renderer>(width, height, "", MAX_DEPTH);
+		frame->SPP = SPP;
+		frame->GRID_DIM = GRID_DIM;
+		frame->SAMPLER = SAMPLER;
+		frame->SAMPLE_SEED = SAMPLE_SEED;
+		frame->NUM_THREADS = NUM_THREADS;
+		frame->PIN_THREADS = PIN_THREADS;
+		frame->PACKET_TRACING = PACKET_TRACING;
+		frame->DEFER_SECONDARY_RAYS = DEFER_SECONDARY_RAYS;
+		frame->FRUSTUM_CULLING = FRUSTUM_CULLING;
+		frame->TILE_BUFFERS = TILE_BUFFERS;
+		frame->STREAM_OUTPUT = STREAM_OUTPUT;
+		frame->LEVEL_OF_DETAIL = LEVEL_OF_DETAIL;
+		frame->TILE_ORDER = TILE_ORDER;
+		frame->ADAPTIVE_TILE_SPLITTING = ADAPTIVE_TILE_SPLITTING;
+		frame->COST_PREPASS = COST_PREPASS;
+		frame->NUMA_AWARE = NUMA_AWARE;
+		frame->PROGRESSIVE = PROGRESSIVE;
+		frame->TIME_BUDGET_MS = TIME_BUDGET_MS;
+		frame->TARGET_SPP = TARGET_SPP;
+		frame->CONVERGENCE_THRESHOLD = CONVERGENCE_THRESHOLD;
+		frame->ADAPTIVE_SAMPLING = ADAPTIVE_SAMPLING;
+		frame->ADAPTIVE_THRESHOLD = ADAPTIVE_THRESHOLD;
+		frame->ADAPTIVE_MIN_PASSES = ADAPTIVE_MIN_PASSES;
+		frame->SCENE = SCENE;
+		frame->ANIMATION_FRAME = true;
+		frame->ANIMATION_SLOT = slot;
+		frame->pool = pool;
+		frame->cancel_token = cancel_token;
+
+		CachedScene& shared = frame->scenes[SCENE];
+		shared.scene = cached.scene;
+		shared.camera = std::make_unique<Camera>(*cached.camera);
+		frames.push_back(std::move(frame));
+	}
+
+	// finished frames are written by their own thread while the next ones are
+	// rendered, at most in_flight of them wait for it
+	std::mutex write_mutex;
+	std::condition_variable write_cv;
+	std::deque<std::unique_ptr<Image>> write_queue;
+	bool rendering_done = false;
+
+	std::thread writer([&]() {
+		while (true)
+		{
+			std::unique_ptr<Image> frame;
+			{
+				std::unique_lock<std::mutex> lock(write_mutex);
+				write_cv.wait(lock, [&]() { return !write_queue.empty() || rendering_done; });
+
+				if (write_queue.empty())
+				{
+					break;
+				}
+				frame = std::move(write_queue.front());
+				write_queue.pop_front();
+			}
+			write_cv.notify_all();
+			frame->write_image_to_file();
+		}
+	});
+
+	pool->reset_busy_time();
+	auto render_start = std::chrono::steady_clock::now();
+	std::atomic<size_t> next_frame(0);
+	std::atomic<size_t> frames_rendered(0);
+	std::vector<std::thread> slots;
+
+	for (size_t slot = 0; slot < in_flight; ++slot)
+	{
+		slots.emplace_back([&, slot]() {
+			Renderer& renderer = *frames[slot];
+			size_t f;
+
+			while (!cancel_token->is_cancelled() && (f = next_frame++) < ANIMATION_FRAMES)
+			{
+				// only the threads of this slot see the moved objects
+				cached.scene->animate(f, slot);
+				renderer.set_resolution(width, height);
+
+				size_t w, h;
+				renderer.render_with_threads(w, h);
+
+				// a cancelled frame is incomplete
+				if (cancel_token->is_cancelled())
+				{
+					break;
+				}
+				++frames_rendered;
+
+				auto output = std::make_unique<Image>(width, height, frame_file(f));
+				output->colors.swap(renderer.img->colors);
+				{
+					std::unique_lock<std::mutex> lock(write_mutex);
+					write_cv.wait(lock, [&]() { return write_queue.size() < in_flight; });
+					write_queue.push_back(std::move(output));
+				}
+				write_cv.notify_all();
+				LOG(INFO) << "Rendered frame " << f;
+			}
+		});
+	}
+
+	for (auto& t : slots)
+	{
+		t.join();
+	}
+	double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - render_start).count();
+
+	{
+		std::lock_guard<std::mutex> lock(write_mutex);
+		rendering_done = true;
+	}
+	write_cv.notify_all();
+	writer.join();
+
+	// still renders show the first frame
+	for (size_t slot = 0; slot < in_flight; ++slot)
+	{
+		cached.scene->animate(0, slot);
+	}
+
+	if (cancel_token->is_cancelled())
+	{
+		LOG(WARNING) << "Animation cancelled after " << frames_rendered << " frames";
+		Stats::set("Cancelled", 1.0);
+	}
+
+	// the frames have set their own statistics, the ones of the animation replace them
+	Stats::set("Frames", static_cast<double>(frames_rendered));
+	Stats::set("Frames in flight", static_cast<double>(in_flight));
+	Stats::set("Render time [ms]", elapsed_ms);
+	Stats::set("Frames per second", frames_rendered * 1e3 / std::max(elapsed_ms, 1.0));
+	Stats::set("Total time [ms]", std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - scene_start).count());
+	set_idle_stats(elapsed_ms);
+	Stats::set("Mrays/s", Stats::get("Rays traced") / (std::max(elapsed_ms, 1.0) * 1e3));
+	pool->lock_stats().report("Task deque lock");
+	Stats::report();
+}
+
+void Renderer::set_distributed(const std::string& address, double timeout_s)
+{
+	DISTRIBUTED_ADDRESS = address;
+	DISTRIBUTED_TIMEOUT_S = timeout_s;
+}
+
+bool Renderer::render_coordinator()
+{
+	Slice slice(*img, TILE_SIZE, TILE_SIZE, TILE_ORDER);
+	TileJob job{
+		static_cast<uint32_t>(img->get_width()),
+		static_cast<uint32_t>(img->get_height()),
+		static_cast<uint32_t>(SPP),
+		static_cast<uint32_t>(GRID_DIM),
+		static_cast<uint32_t>(SAMPLER),
+		SAMPLE_SEED,
+		TILE_SIZE,
+		TILE_SIZE,
+		SCENE,
+		CUSTOM_CAMERA,
+		CAMERA_EYE,
+		CAMERA_LOOK_AT,
+		CAMERA_UP
+	};
+	TileCoordinator coordinator(DISTRIBUTED_ADDRESS, job, slice.pairs, DISTRIBUTED_TIMEOUT_S);
+
+	Stats::clear();
+	auto start = std::chrono::steady_clock::now();
+
+	if (!coordinator.run(*img))
+	{
+		LOG(ERROR) << "Could not coordinate a distributed render on " << DISTRIBUTED_ADDRESS;
+		return false;
+	}
+
+	Stats::set("Render time [ms]", std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - start).count());
+	Stats::set("Distributed workers", static_cast<double>(coordinator.get_workers()));
+	Stats::set("Tiles handed out again", static_cast<double>(coordinator.get_requeued()));
+	Stats::report();
+	return true;
+}
+
+bool Renderer::render_tile_worker()
+{
+	TileClient client;
+	TileJob job;
+
+	if (!client.connect(DISTRIBUTED_ADDRESS, job))
+	{
+		return false;
+	}
+	if (job.tile_width != TILE_SIZE || job.tile_height != TILE_SIZE)
+	{
+		LOG(ERROR) << "The coordinator uses tiles of " << job.tile_width << "x" << job.tile_height
+			<< " pixels, this worker " << TILE_SIZE << "x" << TILE_SIZE;
+		return false;
+	}
+
+	// render the scene and view of the coordinator with its settings, workers rendering
+	// something else would be stitched into the same image
+	if (!set_scene(job.scene))
+	{
+		LOG(ERROR) << "The coordinator renders the scene " << job.scene << ", which this worker doesn't know";
+		return false;
+	}
+	if (job.custom_camera)
+	{
+		set_camera(job.eye, job.look_at, job.up);
+	}
+	else
+	{
+		reset_camera();
+	}
+	SPP = job.spp;
+	GRID_DIM = job.grid_dim;
+	SAMPLER = static_cast<SamplerType>(job.sampler);
+	SAMPLE_SEED = job.seed;
+	img->resize_color_array(job.width, job.height);
+
+	size_t width, height;
+	tile_client = &client;
+	render_with_threads(width, height);
+	tile_client = nullptr;
+
+	LOG(INFO) << "Rendered " << client.get_tiles_rendered() << " tiles for " << DISTRIBUTED_ADDRESS;
+	return true;
+}
+
+bool Renderer::set_scene(const std::string& name)
+{
+	// the BVHs are built in parallel
+	start_pool();
+
+	if (!cached_scene(name))
+	{
+		LOG(ERROR) << "Unknown scene " << name;
+		return false;
+	}
+	SCENE = name;
+	return true;
+}
+
+void Renderer::set_camera(const glm::dvec3& eye, const glm::dvec3& look_at, const glm::dvec3& up)
+{
+	CUSTOM_CAMERA = true;
+	CAMERA_EYE = eye;
+	CAMERA_LOOK_AT = look_at;
+	CAMERA_UP = up;
+}
+
+void Renderer::reset_camera()
+{
+	CUSTOM_CAMERA = false;
+}
+
+void Renderer::set_resolution(size_t width, size_t height)
+{
+	img->resize_color_array(width, height);
+	std::fill(img->colors.begin(), img->colors.end(), glm::dvec3(0.0));
+}
+
+void Renderer::set_spp(size_t spp)
+{
+	SPP = std::max<size_t>(spp, 1);
+}
+
+void Renderer::set_output_file(const std::string& file)
+{
+	img->change_file_name(file);
+}
+
+Renderer::CachedScene* Renderer::cached_scene(const std::string& name)
+{
+	auto it = scenes.find(name);
+
+	if (it == scenes.end())
+	{
+		std::unique_ptr<Scene> scene = make_scene(name);
+
+		if (!scene)
+		{
+			return nullptr;
+		}
+		LOG(INFO) << "Built scene " << name;
+		it = scenes.emplace(name, CachedScene()).first;
+		it->second.camera = std::make_unique<Camera>(*scene->cam);
+		it->second.scene = std::move(scene);
+	}
+	CachedScene& cached = it->second;
+	cached.last_used = ++scene_uses;
+
+	while (scenes.size() > MAX_CACHED_SCENES)
+	{
+		auto oldest = std::min_element(scenes.begin(), scenes.end(), [](const auto& a, const auto& b) {
+			return a.second.last_used < b.second.last_used;
+		});
+		LOG(INFO) << "Dropping cached scene " << oldest->first;
+		scenes.erase(oldest);
+	}
+	return &cached;
+}
+
+void Renderer::set_idle_stats(double elapsed_ms)
+{
+	// time the workers waited for work, mostly at the end of the frame
+	double total_idle_ms = 0.0;
+	for (size_t w = 0; w < pool->size(); ++w)
+	{
+		double idle_ms = std::max(0.0, elapsed_ms - pool->busy_time_ns(w) * 1e-6);
+		char name[64];
+		snprintf(name, sizeof(name), "Worker %02zu idle time [ms]", w);
+		Stats::set(name, idle_ms);
+		total_idle_ms += idle_ms;
+	}
+	Stats::set("Idle time [%]", 100.0 * total_idle_ms / (std::max(elapsed_ms, 1.0) * pool->size()));
+}
+
+void Renderer::prepare_scene(CachedScene& cached)
+{
+	Scene* sc = cached.scene.get();
+
+	if (CUSTOM_CAMERA)
+	{
+		sc->cam = std::make_unique<Camera>();
+		sc->cam->setCamToWorld(CAMERA_EYE, CAMERA_LOOK_AT, CAMERA_UP);
+		sc->cam->update();
+	}
+	else
+	{
+		sc->cam = std::make_unique<Camera>(*cached.camera);
+	}
+
+	// a cached scene may come from a render with level of detail
+	sc->update_lod(glm::dvec3(sc->cam->getOrigin()), LEVEL_OF_DETAIL ? pixel_angle(img->get_height()) : 0.0);
+}
+
+void Renderer::start_pool()
+{
+	// NUMA placement needs to know the node of every worker
+	bool pin_threads = PIN_THREADS || NUMA_AWARE;
+
+	if (!pool || pool->size() != NUM_THREADS || pool->pins_threads() != pin_threads)
+	{
+		// join the old workers first, so that they don't compete for the pinned CPUs
+		pool.reset();
+		pool = std::make_unique<ThreadPool>(NUM_THREADS, pin_threads);
+	}
+	ThreadPool::set_current(pool.get());
+}
+
+void Renderer::set_threads(size_t num_threads, bool pin_threads)
+{
+	NUM_THREADS = num_threads > 0 ? num_threads : default_thread_count();
+	PIN_THREADS = pin_threads;
+}
+
+void Renderer::set_tile_scheduling(TileOrder order, bool adaptive_splitting, bool cost_prepass)
+{
+	TILE_ORDER = order;
+	ADAPTIVE_TILE_SPLITTING = adaptive_splitting;
+	COST_PREPASS = cost_prepass;
+}
+
+void Renderer::set_level_of_detail(bool enabled)
+{
+	LEVEL_OF_DETAIL = enabled;
+}
+
+void Renderer::set_tile_output(bool tile_buffers, bool stream_output)
+{
+	TILE_BUFFERS = tile_buffers;
+	STREAM_OUTPUT = stream_output;
+}
+
 /*
 	Short helper function
 */
@@ -308,31 +1912,94 @@ void Renderer::run(RenderMode mode)
 {
 	size_t width, height;
 
+	// a cancel ends only the render it was meant for
+	cancel_token->reset();
+
 	if (mode == RenderMode::THREADS)
 	{
+		// the tiles of a single pass are final once rendered and can be written right away
+		if (STREAM_OUTPUT && !PROGRESSIVE && !img->get_file_name().empty())
+		{
+			tile_writer = std::make_unique<TileWriter>(img->get_file_name(), img->get_width(), img->get_height());
+			if (!tile_writer->start())
+			{
+				tile_writer.reset();
+			}
+		}
 		render_with_threads(width, height);
+
+		// the image is incomplete unless it's the average of finished passes, a partly
+		// streamed one is removed
+		if (cancel_token->is_cancelled())
+		{
+			if (tile_writer)
+			{
+				tile_writer->finish();
+				tile_writer.reset();
+				std::remove(img->get_file_name().c_str());
+			}
+
+			std::lock_guard<std::mutex> lock(preview_mutex);
+			if (!PROGRESSIVE || preview_passes == 0)
+			{
+				return;
+			}
+		}
 	}
 	else if (mode == RenderMode::GRADIENT)
 	{
 		render_gradient(width, 10, height);
 	}
-	else if (mode == RenderMode::ANIMATE)
+	else if (mode == RenderMode::COORDINATOR)
 	{
-		/*for (int i = 0; i < 90; ++i)
+		// keep the output file of an earlier render instead of writing an empty image
+		if (!render_coordinator())
 		{
-			std::string new_file_name = "picture" + std::to_string(i) + ".ppm";
-			render_with_threads(width, height, i);
-			img->change_file_name(new_file_name);
-			img->write_image_to_file();
-			std::fill(img->colors.begin(), img->colors.end(), glm::dvec3(0));
-		}*/
+			return;
+		}
+	}
+	else if (mode == RenderMode::TILE_WORKER)
+	{
+		// the coordinator writes the image
+		render_tile_worker();
+		return;
+	}
+	else if (mode == RenderMode::SAMPLER_BENCHMARK)
+	{
+		// the benchmark writes its own results, no image
+		benchmark_samplers();
+		return;
+	}
+	else if (mode == RenderMode::ANIMATE)
+	{
+		// every frame is written to its own file
+		render_animation();
+		return;
 	}
 	else
 	{
 		render_with_threads(width, height);
 	}
 
-	if (img->get_file_name().empty())
+	auto write_start = std::chrono::steady_clock::now();
+	if (tile_writer)
+	{
+		// only the tiles finished last are left to write, the image is written again if
+		// streaming failed
+		bool streamed = tile_writer->finish();
+		Stats::set("Streamed tiles", static_cast<double>(tile_writer->tiles_written()));
+
+		if (streamed)
+		{
+			tile_writer->copy_to(img->colors);
+		}
+		else
+		{
+			img->write_image_to_file();
+		}
+		tile_writer.reset();
+	}
+	else if (img->get_file_name().empty())
 	{
 		char buf[200];
 		GET_PWD(buf, 200);
@@ -350,6 +2017,12 @@ void Renderer::run(RenderMode mode)
 		//img->append_to_file_name(".ppm");
 		img->write_image_to_file();
 	}
+	Stats::set("Image write time [ms]", std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - write_start).count());
+
+	// the render has reported its statistics before the image was written
+	Stats::report("Streamed tiles");
+	Stats::report("Image write time [ms]");
 }
 
 std::vector<glm::dvec3> Renderer::get_colors() const
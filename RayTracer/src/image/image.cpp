@@ -1,5 +1,6 @@
 #include <core/rt.h>
 #include "image/image.h"
+#include "threads/threadpool.h"
 
 namespace rt
 {
@@ -32,37 +33,56 @@ void Image::write_image_to_file()
 
 	LOG(INFO) << "Writing image to \"" << file_name << "\"";
 
-	// don't use \n as ending white space, because of Windows
-	ofs << "P6 " << width << " " << height << " 255 ";
+	write_header(ofs, width, height);
 
-	// write to image file
-	for (size_t i = 0; i < colors.size(); ++i)
-	{
-#ifdef GAMMA_CORRECTION
-		// gamma correction and mapping to [0;255]
-		colors[i] = glm::pow(glm::min(glm::dvec3(1), colors[i]),
-			glm::dvec3(1 / 2.2f)) * 255.0;
-#else
-		colors[i] = glm::min(glm::dvec3(1), col[i]) * 255.f;
-#endif
+	std::vector<unsigned char> bytes(3 * colors.size());
 
-#ifdef DEBUG
-		i_debug = (++i_debug) % 3000;
-#endif
+	// encode the pixels in parallel chunks, if there is a thread pool
+	auto encode = [this, &bytes](size_t first, size_t last) {
+		for (size_t i = first; i < last; ++i)
+		{
+			colors[i] = tone_map(colors[i]);
 
-		// prevent sign extension by casting to unsigned int
-		unsigned char r = (unsigned int)round(colors[i].x);
-		unsigned char g = (unsigned int)round(colors[i].y);
-		unsigned char b = (unsigned int)round(colors[i].z);
+			// prevent sign extension by casting to unsigned int
+			bytes[3 * i] = (unsigned int)round(colors[i].x);
+			bytes[3 * i + 1] = (unsigned int)round(colors[i].y);
+			bytes[3 * i + 2] = (unsigned int)round(colors[i].z);
+		}
+	};
 
-		ofs << r << g << b;
+	if (ThreadPool* pool = ThreadPool::current())
+	{
+		pool->parallel_for(0, colors.size(), 16384, encode);
+	}
+	else
+	{
+		encode(0, colors.size());
 	}
 
+	// write to image file
+	ofs.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+
 	ofs.close();
 
 	LOG(INFO) << "Writing image to \"" << file_name << "\" finished.";
 }
 
+glm::dvec3 Image::tone_map(const glm::dvec3& color)
+{
+#ifdef GAMMA_CORRECTION
+	// gamma correction and mapping to [0;255]
+	return glm::pow(glm::min(glm::dvec3(1), color), glm::dvec3(1 / 2.2f)) * 255.0;
+#else
+	return glm::min(glm::dvec3(1), color) * 255.0;
+#endif
+}
+
+void Image::write_header(std::ostream& os, size_t width, size_t height)
+{
+	// don't use \n as ending white space, because of Windows
+	os << "P6 " << width << " " << height << " 255 ";
+}
+
 void Image::resize_color_array(size_t new_width, size_t new_height)
 {
 	colors.resize(new_width * new_height);
@@ -0,0 +1,142 @@
+#include "image/tilewriter.h"
+#include "image/image.h"
+
+namespace rt
+{
+
+TileWriter::TileWriter(const std::string& file_name, size_t width, size_t height) :
+	file_name(file_name),
+	width(width),
+	height(height)
+{
+}
+
+TileWriter::~TileWriter()
+{
+	finish();
+}
+
+bool TileWriter::start()
+{
+	ofs.open(file_name, std::ios::binary);
+
+	if (ofs.fail())
+	{
+		LOG(WARNING) << "Could not open \"" << file_name << "\" for writing tiles";
+		return false;
+	}
+	LOG(INFO) << "Writing image to \"" << file_name << "\" while rendering";
+
+	Image::write_header(ofs, width, height);
+	bytes.assign(3 * width * height, 0);
+	row_missing.assign(height, width);
+	thread = std::thread([this]() { write_tiles(); });
+	return true;
+}
+
+void TileWriter::push(size_t x0, size_t y0, size_t w, size_t h, const std::vector<glm::dvec3>& colors)
+{
+	Tile tile{ x0, y0, w, h, std::vector<glm::dvec3>(w * h) };
+
+	for (size_t y = 0; y < h; ++y)
+	{
+		std::copy_n(&colors[(y0 + y) * width + x0], w, &tile.colors[y * w]);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back(std::move(tile));
+	}
+	cv.notify_one();
+}
+
+bool TileWriter::finish()
+{
+	if (!thread.joinable())
+	{
+		return !failed && rows_written == height;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		finishing = true;
+	}
+	cv.notify_one();
+	thread.join();
+	ofs.close();
+
+	if (!failed && rows_written != height)
+	{
+		LOG(WARNING) << "Only " << rows_written << " of " << height << " rows of \"" << file_name << "\" were rendered";
+	}
+	else if (!failed)
+	{
+		LOG(INFO) << "Writing image to \"" << file_name << "\" finished.";
+	}
+	return !failed && rows_written == height;
+}
+
+void TileWriter::copy_to(std::vector<glm::dvec3>& colors) const
+{
+	for (size_t i = 0; i < colors.size() && 3 * i + 2 < bytes.size(); ++i)
+	{
+		colors[i] = glm::dvec3(bytes[3 * i], bytes[3 * i + 1], bytes[3 * i + 2]);
+	}
+}
+
+void TileWriter::write_tiles()
+{
+	while (true)
+	{
+		Tile tile;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this]() { return !queue.empty() || finishing; });
+
+			if (queue.empty())
+			{
+				break;
+			}
+			tile = std::move(queue.front());
+			queue.pop_front();
+		}
+
+		for (size_t y = 0; y < tile.h; ++y)
+		{
+			unsigned char* row = &bytes[3 * ((tile.y0 + y) * width + tile.x0)];
+
+			for (size_t x = 0; x < tile.w; ++x)
+			{
+				glm::dvec3 c = Image::tone_map(tile.colors[y * tile.w + x]);
+
+				// prevent sign extension by casting to unsigned int
+				row[3 * x] = (unsigned int)round(c.x);
+				row[3 * x + 1] = (unsigned int)round(c.y);
+				row[3 * x + 2] = (unsigned int)round(c.z);
+			}
+			row_missing[tile.y0 + y] -= tile.w;
+		}
+		++tiles;
+
+		// append the rows that are complete now
+		size_t first = rows_written;
+		while (rows_written < height && row_missing[rows_written] == 0)
+		{
+			++rows_written;
+		}
+		if (rows_written > first && !failed)
+		{
+			ofs.write(reinterpret_cast<const char*>(&bytes[3 * first * width]),
+				static_cast<std::streamsize>(3 * (rows_written - first) * width));
+			ofs.flush();
+
+			if (ofs.fail())
+			{
+				LOG(ERROR) << "Could not write to \"" << file_name << "\"";
+				failed = true;
+			}
+		}
+	}
+}
+
+} // namespace rt
@@ -2,9 +2,149 @@
 #include "interaction/interaction.h"
 #include "integrators/integrator.h"
 #include "scene/scene.h"
+#include "light/light.h"
+#include "core/utility.h"
 
 namespace rt
 {
+glm::dvec3 Integrator::Li(const Ray& ray,
+	const Scene& scene,
+	int depth,
+	PathState* path,
+	const TileCull* cull)
+{
+	if (static_cast<size_t>(depth) == scene.MAX_DEPTH)
+	{
+		return glm::dvec3(0);
+	}
+
+	SurfaceInteraction si;
+	double distance;
+
+	distance = scene.shoot_ray(ray, &si, cull);
+
+	// check for no intersection
+	if (distance < 0 || distance == INFINITY)
+	{
+		return glm::dvec3(0.0f);
+	}
+
+	return shade(ray, scene, si, depth, nullptr, 0, path);
+}
+
+void Integrator::Li(RayPacket& packet,
+	const Scene& scene,
+	RGB_Color* L,
+	RayQueue* queue,
+	const size_t* pixels,
+	const TileCull* cull)
+{
+	SurfaceInteraction isects[RAY_PACKET_SIZE];
+	glm::dvec3 isect_p[RAY_PACKET_SIZE];
+	std::vector<PacketMask> shadow_masks(scene.lights.size(), 0);
+	PacketMask hit = 0;
+
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+	{
+		L[i] = glm::dvec3(0);
+	}
+
+	if (scene.MAX_DEPTH == 0)
+	{
+		return;
+	}
+
+	scene.shoot_packet(packet, isects, cull);
+
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+	{
+		const Ray& ray = packet.rays[i];
+
+		if ((packet.active & RayPacket::lane_bit(i)) && ray.tMax >= 0 && ray.tMax < INFINITY)
+		{
+			hit |= RayPacket::lane_bit(i);
+			isect_p[i] = ray.ro + ray.tMax * ray.rd;
+		}
+	}
+
+	// shadow rays of all hit points towards the same light source
+	for (size_t l = 0; l < scene.lights.size(); ++l)
+	{
+		shadow_masks[l] = scene.lights[l]->visible_packet(isect_p, hit, scene);
+	}
+
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+	{
+		if (hit & RayPacket::lane_bit(i))
+		{
+			if (queue)
+			{
+				PathState path{ queue, glm::dvec3(1.0), pixels[i] };
+				L[i] = shade(packet.rays[i], scene, isects[i], 0, shadow_masks.data(), i, &path);
+			}
+			else
+			{
+				L[i] = shade(packet.rays[i], scene, isects[i], 0, shadow_masks.data(), i);
+			}
+		}
+	}
+}
+
+void Integrator::trace_deferred(RayQueue& queue, const Scene& scene, std::vector<glm::dvec3>& colors)
+{
+	std::vector<DeferredRay> batch;
+
+	// every pass traces the rays of one bounce, the rays spawned by it are collected
+	// in the queue for the next pass
+	while (!queue.empty())
+	{
+		queue.sort();
+		queue.take(batch);
+
+		for (const auto& r : batch)
+		{
+			PathState path{ &queue, r.weight, r.pixel };
+
+			colors[r.pixel] += clamp(r.weight * Li(r.ray, scene, r.depth, &path));
+		}
+	}
+}
+
+glm::dvec3 Integrator::trace_secondary(const Scene& s,
+	const Ray& ray,
+	int depth,
+	const glm::dvec3& weight,
+	PathState* path)
+{
+	if (path)
+	{
+		if (static_cast<size_t>(depth) < s.MAX_DEPTH)
+		{
+			path->queue->push(ray, path->weight * weight, path->pixel, depth);
+		}
+		return glm::dvec3(0.0);
+	}
+
+	return weight * Li(ray, s, depth);
+}
+
+/*
+	Return true, if the point p is visible to the light source with index light_idx.
+	Uses the result of a shadow ray packet for the given lane, if available.
+*/
+bool Integrator::light_visible(const Scene& scene,
+	size_t light_idx,
+	const glm::dvec3& p,
+	const PacketMask* shadow_masks,
+	int lane)
+{
+	if (shadow_masks)
+	{
+		return shadow_masks[light_idx] & RayPacket::lane_bit(lane);
+	}
+	return scene.lights[light_idx]->visible(p, scene);
+}
+
 /*
 	Calculate the normalized reflection vector.
 	dir	: the incident ray
@@ -74,23 +214,26 @@ glm::dvec3 Integrator::specular_reflect(const Scene& s,
 	const Ray& ray,
 	const glm::dvec3& isect_p,
 	SurfaceInteraction* isect,
-	int depth)
+	int depth,
+	const glm::dvec3& weight,
+	PathState* path)
 {
 	glm::dvec3 reflected = reflect(ray.rd, isect->normal);
 
-	auto new_ray = Ray(isect_p + shadowEpsilon * reflected, reflected);
-
-	return Li(
+	return trace_secondary(s,
 		Ray(isect_p + shadowEpsilon * reflected, reflected),
-		s,
-		depth);
+		depth,
+		weight,
+		path);
 }
 
 glm::dvec3 Integrator::specular_transmit(const Scene& s,
 	const Ray& ray,
 	const glm::dvec3& isect_p,
 	SurfaceInteraction* isect,
-	int depth)
+	int depth,
+	const glm::dvec3& weight,
+	PathState* path)
 {
 	glm::dvec3 reflected, refracted;
 	double f;
@@ -101,24 +244,27 @@ glm::dvec3 Integrator::specular_transmit(const Scene& s,
 	if (!refract(ray.rd, isect->normal, isect->mat->getRefractiveIdx(), &refracted))
 	{
 		//reflected = glm::normalize(reflect(ray.rd, (*o)->get_normal(isect_p)));
-		return Li(
+		return trace_secondary(s,
 			Ray(isect_p + shadowEpsilon * reflected, reflected),
-			s,
-			depth);
+			depth,
+			weight,
+			path);
 	}
 
 	f = fresnel(1.f / isect->mat->getRefractiveIdx(),
 		glm::dot(-ray.rd, isect->normal));
 	depth;
 
-	return f * Li(
+	return trace_secondary(s,
 		Ray(isect_p + shadowEpsilon * reflected, reflected),
-		s,
-		depth) +
-		(1.f - f) * Li(
+		depth,
+		f * weight,
+		path) +
+		trace_secondary(s,
 			Ray(isect_p + shadowEpsilon * refracted, refracted),
-			s,
-			depth);
+			depth,
+			(1.f - f) * weight,
+			path);
 }
 
 
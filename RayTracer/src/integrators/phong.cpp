@@ -54,19 +54,13 @@ glm::dvec3 PhongIntegrator::spec_shade(
 
 glm::dvec3 PhongIntegrator::phong_shade(
 	const Light& light,
-	const Scene& sc,
+	const Scene& /*sc*/,
 	const Ray& ray,
 	const glm::dvec3& ob_pos,
 	const SurfaceInteraction& si)
 {
-	bool visible = true;
 	glm::dvec3 color(0);
 
-	if (!light.visible(ob_pos, sc))
-	{
-		return glm::dvec3(0);
-	}
-
 	glm::dvec3 light_dir = light.p - ob_pos;
 	glm::dvec3 half = (glm::normalize(light_dir) - ray.rd);
 	half /= glm::length(half);
@@ -86,16 +80,15 @@ glm::dvec3 PhongIntegrator::phong_shade(
 	return color;
 }
 
-RGB_Color PhongIntegrator::Li(const Ray& ray, const Scene& scene, int depth)
+RGB_Color PhongIntegrator::shade(const Ray& ray,
+	const Scene& scene,
+	SurfaceInteraction& si,
+	int depth,
+	const PacketMask* shadow_masks,
+	int lane,
+	PathState* path)
 {
-	if (depth == scene.MAX_DEPTH)
-	{
-		return glm::dvec3(0);
-	}
-
 	glm::dvec3 isect_p;
-	SurfaceInteraction si;
-	double distance;
 	RGB_Color Lo = glm::dvec3(0); // received radiance at camera point
 
 	// map direction of normals to a color for debugging
@@ -103,23 +96,16 @@ RGB_Color PhongIntegrator::Li(const Ray& ray, const Scene& scene, int depth)
 	return contribution = (glm::dvec3(1.f) + isect->normal) * 0.5f;
 #endif
 
-	distance = scene.shoot_ray(ray, &si);
-
-	// check for no intersection
-	if (distance < 0 || distance == INFINITY)
-	{
-		return glm::dvec3(0.0f);
-	}
-
-	isect_p = ray.ro + distance * ray.rd;
+	isect_p = ray.ro + ray.tMax * ray.rd;
 
 	// TODO: handle shadows correctly
 	// TODO: enhance support for different light types
 	// TODO: Add emission term Le if area light source was hit
 	// => Lo += Le;
 
-	for (auto& l : scene.lights)
+	for (size_t l_idx = 0; l_idx < scene.lights.size(); ++l_idx)
 	{
+		auto& l = scene.lights[l_idx];
 		glm::dvec3 light_dir;
 		double pdf;
 
@@ -130,6 +116,11 @@ RGB_Color PhongIntegrator::Li(const Ray& ray, const Scene& scene, int depth)
 			continue;
 		}
 
+		if (!light_visible(scene, l_idx, isect_p, shadow_masks, lane))
+		{
+			continue;
+		}
+
 		Lo += phong_shade(
 			*l.get(),
 			scene,
@@ -146,13 +137,13 @@ RGB_Color PhongIntegrator::Li(const Ray& ray, const Scene& scene, int depth)
 	if (glm::length(si.mat->getReflective()) > 0)
 	{
 		glm::dvec3 reflective = si.mat->getReflective();
-		Lo += reflective * specular_reflect(scene, ray, isect_p, &si, depth);
+		Lo += specular_reflect(scene, ray, isect_p, &si, depth, reflective, path);
 	}
 
 	if (glm::length(si.mat->getTransparent()) > 0)
 	{
 		glm::dvec3 transparent = si.mat->getTransparent();
-		Lo += transparent * specular_transmit(scene, ray, isect_p, &si, depth);
+		Lo += specular_transmit(scene, ray, isect_p, &si, depth, transparent, path);
 	}
 
 	return Lo;
@@ -0,0 +1,65 @@
+#include <algorithm>
+
+#include "integrators/rayqueue.h"
+
+namespace rt
+{
+
+// spread the lower 10 bits of x, so that there are two zero bits between each bit
+static inline uint32_t left_shift_3(uint32_t x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x30000ff;
+	x = (x | (x << 8)) & 0x300f00f;
+	x = (x | (x << 4)) & 0x30c30c3;
+	x = (x | (x << 2)) & 0x9249249;
+	return x;
+}
+
+static inline uint32_t encode_morton_3(const glm::dvec3& v)
+{
+	return (left_shift_3(static_cast<uint32_t>(v.z)) << 2) |
+		(left_shift_3(static_cast<uint32_t>(v.y)) << 1) |
+		left_shift_3(static_cast<uint32_t>(v.x));
+}
+
+void RayQueue::sort()
+{
+	if (rays.size() < 2)
+	{
+		return;
+	}
+
+	glm::dvec3 b_min(INFINITY);
+	glm::dvec3 b_max(-INFINITY);
+
+	for (const auto& r : rays)
+	{
+		b_min = glm::min(b_min, r.ray.ro);
+		b_max = glm::max(b_max, r.ray.ro);
+	}
+
+	constexpr double morton_scale = 1 << 10;
+	glm::dvec3 extent = b_max - b_min;
+
+	for (auto& r : rays)
+	{
+		glm::dvec3 offset = r.ray.ro - b_min;
+
+		for (int i = 0; i < 3; ++i)
+		{
+			offset[i] = extent[i] > 0 ? offset[i] / extent[i] : 0.0;
+		}
+
+		uint64_t octant = (r.ray.sign[0] << 2) | (r.ray.sign[1] << 1) | r.ray.sign[2];
+		glm::dvec3 cell = glm::min(offset * morton_scale, glm::dvec3(morton_scale - 1));
+
+		r.key = (octant << 30) | encode_morton_3(cell);
+	}
+
+	std::sort(rays.begin(), rays.end(), [](const DeferredRay& a, const DeferredRay& b) {
+		return a.key < b.key;
+		});
+}
+
+} // namespace rt
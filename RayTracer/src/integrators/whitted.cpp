@@ -8,16 +8,15 @@
 namespace rt
 {
 
-RGB_Color WhittedIntegrator::Li(const Ray& ray, const Scene& scene, int depth)
+RGB_Color WhittedIntegrator::shade(const Ray& ray,
+	const Scene& scene,
+	SurfaceInteraction& si,
+	int depth,
+	const PacketMask* /*shadow_masks*/,
+	int /*lane*/,
+	PathState* path)
 {
-	if (depth == scene.MAX_DEPTH)
-	{
-		return glm::dvec3(0);
-	}
-
 	glm::dvec3 isect_p;
-	SurfaceInteraction si;
-	double distance;
 	RGB_Color Lo = glm::dvec3(0); // received radiance at camera point
 
 	// map direction of normals to a color for debugging
@@ -25,15 +24,7 @@ RGB_Color WhittedIntegrator::Li(const Ray& ray, const Scene& scene, int depth)
 	return contribution = (glm::dvec3(1.f) + isect->normal) * 0.5f;
 #endif
 
-	distance = scene.shoot_ray(ray, &si);
-
-	// check for no intersection
-	if (distance < 0 || distance == INFINITY)
-	{
-		return glm::dvec3(0.0f);
-	}
-
-	isect_p = ray.ro + distance * ray.rd;
+	isect_p = ray.ro + ray.tMax * ray.rd;
 
 	// TODO: handle shadows correctly
 	// TODO: enhance support for different light types
@@ -61,13 +52,13 @@ RGB_Color WhittedIntegrator::Li(const Ray& ray, const Scene& scene, int depth)
 	if (glm::length(si.mat->getReflective()) > 0)
 	{
 		glm::dvec3 reflective = si.mat->getReflective();
-		Lo += reflective * specular_reflect(scene, ray, isect_p, &si, depth);
+		Lo += specular_reflect(scene, ray, isect_p, &si, depth, reflective, path);
 	}
 
 	if (glm::length(si.mat->getTransparent()) > 0)
 	{
 		glm::dvec3 transparent = si.mat->getTransparent();
-		Lo += transparent * specular_transmit(scene, ray, isect_p, &si, depth);
+		Lo += specular_transmit(scene, ray, isect_p, &si, depth, transparent, path);
 	}
 
 	return Lo;
@@ -3,12 +3,27 @@
 #include "shape/shape.h"
 #include "scene/scene.h"
 #include "camera/camera.h"
+#include "misc/stats.h"
 
 namespace rt
 {
 
 Light::~Light() {}
 
+PacketMask Light::visible_packet(const glm::dvec3* points, PacketMask mask, const Scene &sc) const
+{
+	PacketMask vis = 0;
+
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+	{
+		if ((mask & RayPacket::lane_bit(i)) && visible(points[i], sc))
+		{
+			vis |= RayPacket::lane_bit(i);
+		}
+	}
+	return vis;
+}
+
 RGB_Color PointLight::sample_light(const glm::dvec3 isect_p, glm::dvec3& dir_to_light, double& pdf)
 {
 	glm::dvec3 diff_vec = this->p - isect_p;
@@ -29,11 +44,15 @@ bool PointLight::visible(const glm::dvec3& p, const Scene &sc) const
 
 	glm::dvec3 dist_v = this->p - p;
 
-	Ray ray = Ray(p, glm::normalize(dist_v));
-
 	dist = glm::length(dist_v);
+
+	// occluders behind the light source are of no interest, so limit the shadow ray
+	// to the distance between the surface point and the light
+	Ray ray = Ray(p, glm::normalize(dist_v), dist);
 	ray.ro += ray.rd * shadowEpsilon;
 
+	++thread_ray_count;
+
 	SurfaceInteraction isect;
 
 	// send shadow rays
@@ -55,6 +74,42 @@ bool PointLight::visible(const glm::dvec3& p, const Scene &sc) const
 	return false;
 }
 
+/*
+	Shadow rays of neighboring points all converge at the light position, so they
+	are coherent enough to be traced as one packet.
+*/
+PacketMask PointLight::visible_packet(const glm::dvec3* points, PacketMask mask, const Scene &sc) const
+{
+	RayPacket packet;
+	SurfaceInteraction isects[RAY_PACKET_SIZE];
+	double dist[RAY_PACKET_SIZE];
+
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+	{
+		if (mask & RayPacket::lane_bit(i))
+		{
+			glm::dvec3 dist_v = this->p - points[i];
+			glm::dvec3 dir = glm::normalize(dist_v);
+
+			dist[i] = glm::length(dist_v);
+			packet.set(i, Ray(points[i] + dir * shadowEpsilon, dir, dist[i]));
+		}
+	}
+
+	sc.shoot_packet(packet, isects);
+
+	// rays without intersection reach the light with their full interval
+	PacketMask vis = 0;
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+	{
+		if ((mask & RayPacket::lane_bit(i)) && packet.rays[i].tMax >= dist[i])
+		{
+			vis |= RayPacket::lane_bit(i);
+		}
+	}
+	return vis;
+}
+
 //glm::dvec3 DistantLight::diff_shade(const SurfaceInteraction & isect,
 //
 //	const glm::dvec3 &ob_pos)
@@ -100,6 +155,8 @@ bool DistantLight::visible(const glm::dvec3& p, const Scene &sc) const
 	Ray ray = Ray(p, -this->dir);
 	ray.ro += ray.rd * shadowEpsilon;
 
+	++thread_ray_count;
+
 	SurfaceInteraction isect;
 
 	// send shadow rays
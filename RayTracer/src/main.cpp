@@ -13,6 +13,7 @@
 #include "scene/scene.h"
 #include "camera/camera.h"
 #include "core/utility.h"
+#include "net/renderserver.h"
 
 //threading
 #include "image/image.h"
@@ -30,6 +31,42 @@ using namespace rt;
 
 bool RT_EXIT_PROGRAM = false;
 
+/*
+	Parse the value of an option like "--threads <n>", exits on a missing, malformed
+	or negative number.
+*/
+static double parse_number(int& pos, int argc, const char* const* argv)
+{
+	const char* option = argv[pos];
+	char* end = nullptr;
+	double value = 0.0;
+
+	if (++pos < argc)
+	{
+		value = strtod(argv[pos], &end);
+	}
+	if (pos == argc || end == argv[pos] || *end != '\0' || value < 0.0)
+	{
+		printf("Error: %s expects a number\n", option);
+		exit(1);
+	}
+	++pos;
+	return value;
+}
+
+// parse the value of an option like "--heatmap <file>", exits if it is missing
+static const char* parse_string(int& pos, int argc, const char* const* argv)
+{
+	const char* option = argv[pos];
+
+	if (++pos == argc)
+	{
+		printf("Error: %s expects a value\n", option);
+		exit(1);
+	}
+	return argv[pos++];
+}
+
 
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mode);
 
@@ -75,6 +112,8 @@ int main(int argc, const char** argv)
 	size_t img_w = 800;
 	size_t img_h = 600;
 	std::string dest = "";
+	size_t num_threads = 0;
+	bool pin_threads = false;
 
 	// Windows stuff
 	HINSTANCE hInstance = GetModuleHandle(0);
@@ -101,6 +140,15 @@ int main(int argc, const char** argv)
 				printf("argc = %i, pos == %i\n", argc, pos);
 				dest = argv[pos++];
 			}
+			else if (!strcmp(argv[pos], "--threads"))
+			{
+				num_threads = static_cast<size_t>(parse_number(pos, argc, argv));
+			}
+			else if (!strcmp(argv[pos], "--pin-threads"))
+			{
+				pin_threads = true;
+				++pos;
+			}
 			else
 			{
 				printf("Error: USAGE\n");
@@ -110,6 +158,7 @@ int main(int argc, const char** argv)
 	}
 	// launch rendering
 	Renderer renderer(img_w, img_h, std::string("picture.ppm"));
+	renderer.set_threads(num_threads, pin_threads);
 	renderer.run(RenderMode::THREADS);
 
 	// create window and draw in it
@@ -246,22 +295,307 @@ int main(int argc, char* argv[])
 	GLsizei render_h = 600;
 
 	bool rt_headless = false;
-	if (argc > 1)
+	bool rt_animate = false;
+	size_t animation_frames = 90;
+	size_t frames_in_flight = 0;
+	bool rt_benchmark_samplers = false;
+	size_t num_threads = 0;
+	bool pin_threads = false;
+	TileOrder tile_order = TileOrder::HILBERT;
+	bool tile_splitting = true;
+	bool cost_prepass = false;
+	bool level_of_detail = false;
+	bool tile_buffers = false;
+	bool stream_output = true;
+	bool progressive = false;
+	double time_budget_ms = 0.0;
+	size_t target_spp = 0;
+	double convergence_threshold = 0.0;
+	size_t write_interval = 0;
+	bool adaptive = false;
+	double adaptive_threshold = 0.0;
+	size_t min_passes = 4;
+	std::string heatmap_file;
+	std::string checkpoint_file = "render.checkpoint";
+	double checkpoint_interval_s = 0.0;
+	bool checkpoint = false;
+	bool resume = false;
+	std::string coordinator_address;
+	std::string worker_address;
+	double worker_timeout_s = 60.0;
+	std::string scene;
+	std::string serve_address;
+	std::string submit_address;
+	std::string job;
+
+	int pos = 1;
+	while (pos < argc)
 	{
-		if (!strcmp(argv[1], "--headless"))
+		if (!strcmp(argv[pos], "--headless"))
 		{
-			Renderer renderer(render_w, render_h, std::string("picture.ppm"));
-			renderer.run(RenderMode::THREADS);
-			LOG(INFO) << "Running headless mode, exiting.";
-			return 0;
+			rt_headless = true;
+			++pos;
+		}
+		else if (!strcmp(argv[pos], "--animate"))
+		{
+			rt_animate = true;
+			++pos;
+		}
+		else if (!strcmp(argv[pos], "--frames"))
+		{
+			animation_frames = static_cast<size_t>(parse_number(pos, argc, argv));
+		}
+		else if (!strcmp(argv[pos], "--frames-in-flight"))
+		{
+			frames_in_flight = static_cast<size_t>(parse_number(pos, argc, argv));
+		}
+		else if (!strcmp(argv[pos], "--benchmark-samplers"))
+		{
+			rt_benchmark_samplers = true;
+			++pos;
+		}
+		else if (!strcmp(argv[pos], "--threads"))
+		{
+			num_threads = static_cast<size_t>(parse_number(pos, argc, argv));
+		}
+		else if (!strcmp(argv[pos], "--pin-threads"))
+		{
+			pin_threads = true;
+			++pos;
+		}
+		else if (!strcmp(argv[pos], "--tile-order"))
+		{
+			const char* option = argv[pos];
+			std::string order = parse_string(pos, argc, argv);
+
+			if (order == "columns")
+			{
+				tile_order = TileOrder::COLUMNS;
+			}
+			else if (order == "morton")
+			{
+				tile_order = TileOrder::MORTON;
+			}
+			else if (order == "hilbert")
+			{
+				tile_order = TileOrder::HILBERT;
+			}
+			else if (order == "spiral")
+			{
+				tile_order = TileOrder::SPIRAL;
+			}
+			else
+			{
+				printf("Error: %s expects columns, morton, hilbert or spiral\n", option);
+				exit(1);
+			}
+		}
+		else if (!strcmp(argv[pos], "--no-tile-splitting"))
+		{
+			tile_splitting = false;
+			++pos;
+		}
+		else if (!strcmp(argv[pos], "--cost-prepass"))
+		{
+			cost_prepass = true;
+			++pos;
+		}
+		else if (!strcmp(argv[pos], "--lod"))
+		{
+			level_of_detail = true;
+			++pos;
+		}
+		else if (!strcmp(argv[pos], "--tile-buffers"))
+		{
+			tile_buffers = true;
+			++pos;
+		}
+		else if (!strcmp(argv[pos], "--no-stream-output"))
+		{
+			stream_output = false;
+			++pos;
+		}
+		else if (!strcmp(argv[pos], "--progressive"))
+		{
+			progressive = true;
+			++pos;
+		}
+		else if (!strcmp(argv[pos], "--time-budget"))
+		{
+			progressive = true;
+			time_budget_ms = parse_number(pos, argc, argv);
+		}
+		else if (!strcmp(argv[pos], "--target-spp"))
+		{
+			progressive = true;
+			target_spp = static_cast<size_t>(parse_number(pos, argc, argv));
+		}
+		else if (!strcmp(argv[pos], "--threshold"))
+		{
+			progressive = true;
+			convergence_threshold = parse_number(pos, argc, argv);
+		}
+		else if (!strcmp(argv[pos], "--write-interval"))
+		{
+			write_interval = static_cast<size_t>(parse_number(pos, argc, argv));
+		}
+		else if (!strcmp(argv[pos], "--adaptive"))
+		{
+			progressive = true;
+			adaptive = true;
+			adaptive_threshold = parse_number(pos, argc, argv);
+		}
+		else if (!strcmp(argv[pos], "--min-passes"))
+		{
+			min_passes = static_cast<size_t>(parse_number(pos, argc, argv));
+		}
+		else if (!strcmp(argv[pos], "--heatmap"))
+		{
+			heatmap_file = parse_string(pos, argc, argv);
+		}
+		else if (!strcmp(argv[pos], "--checkpoint"))
+		{
+			checkpoint = true;
+			checkpoint_file = parse_string(pos, argc, argv);
+		}
+		else if (!strcmp(argv[pos], "--checkpoint-interval"))
+		{
+			checkpoint = true;
+			checkpoint_interval_s = parse_number(pos, argc, argv);
+		}
+		else if (!strcmp(argv[pos], "--resume"))
+		{
+			checkpoint = true;
+			resume = true;
+			++pos;
 		}
-		else if (!strcmp(argv[1], "--animate"))
+		else if (!strcmp(argv[pos], "--coordinator"))
 		{
-			Renderer renderer(render_w, render_h, std::string("picture.ppm"));
-			renderer.run(RenderMode::ANIMATE);
-			LOG(INFO) << "Running animate mode, exiting.";
-			return 0;
+			coordinator_address = parse_string(pos, argc, argv);
 		}
+		else if (!strcmp(argv[pos], "--worker"))
+		{
+			worker_address = parse_string(pos, argc, argv);
+		}
+		else if (!strcmp(argv[pos], "--worker-timeout"))
+		{
+			worker_timeout_s = parse_number(pos, argc, argv);
+		}
+		else if (!strcmp(argv[pos], "--scene"))
+		{
+			scene = parse_string(pos, argc, argv);
+		}
+		else if (!strcmp(argv[pos], "--serve"))
+		{
+			serve_address = parse_string(pos, argc, argv);
+		}
+		else if (!strcmp(argv[pos], "--submit"))
+		{
+			submit_address = parse_string(pos, argc, argv);
+		}
+		else if (!strcmp(argv[pos], "--job"))
+		{
+			job = parse_string(pos, argc, argv);
+		}
+		else
+		{
+			printf("Usage: %s [--headless | --animate | --benchmark-samplers] [--threads <n>] [--pin-threads]\n"
+				"\t[--tile-order columns|morton|hilbert|spiral] [--no-tile-splitting] [--cost-prepass] [--lod]\n"
+				"\t[--tile-buffers] [--no-stream-output]\n"
+				"\t[--frames <n>] [--frames-in-flight <n>]\n"
+				"\t[--progressive] [--time-budget <ms>] [--target-spp <n>] [--threshold <relative error>]\n"
+				"\t[--write-interval <passes>] [--adaptive <relative error>] [--min-passes <n>]\n"
+				"\t[--heatmap <file>] [--checkpoint <file>] [--checkpoint-interval <s>] [--resume]\n"
+				"\t[--coordinator <address> | --worker <address>] [--worker-timeout <s>] [--scene <name>]\n"
+				"\t[--serve <address> | --submit <address> [--job <settings>]]\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+
+	auto configure = [&](Renderer& renderer) {
+		renderer.set_threads(num_threads, pin_threads);
+		renderer.set_tile_scheduling(tile_order, tile_splitting, cost_prepass);
+		renderer.set_level_of_detail(level_of_detail);
+		renderer.set_tile_output(tile_buffers, stream_output);
+
+		if (progressive)
+		{
+			// without any budget stop at 256 samples per pixel
+			bool budget = time_budget_ms > 0.0 || target_spp > 0 || convergence_threshold > 0.0;
+			renderer.set_progressive(time_budget_ms, budget ? target_spp : 256, convergence_threshold,
+				write_interval);
+		}
+		if (adaptive)
+		{
+			renderer.set_adaptive(adaptive_threshold, min_passes, heatmap_file);
+		}
+		if (checkpoint)
+		{
+			renderer.set_checkpoint(checkpoint_file, checkpoint_interval_s, resume);
+		}
+		if (!scene.empty() && !renderer.set_scene(scene))
+		{
+			exit(1);
+		}
+		renderer.set_animation(animation_frames, frames_in_flight);
+	};
+
+	if (!submit_address.empty())
+	{
+		// settings left out are taken from the server, "quit" stops it
+		std::string reply;
+		bool ok = RenderServer::submit(submit_address, job, reply);
+		printf("%s: %s\n", ok ? "done" : "failed", reply.c_str());
+		return ok ? 0 : 1;
+	}
+	else if (!serve_address.empty())
+	{
+		// the scenes and worker threads stay alive between the jobs of other processes
+		Renderer renderer(render_w, render_h, std::string("picture.ppm"));
+		configure(renderer);
+
+		RenderJob defaults;
+		defaults.width = render_w;
+		defaults.height = render_h;
+		defaults.scene = scene.empty() ? defaults.scene : scene;
+
+		RenderServer server(renderer, serve_address, defaults);
+		return server.run() ? 0 : 1;
+	}
+	else if (!coordinator_address.empty() || !worker_address.empty())
+	{
+		// distributed renders run headless, the coordinator writes the image
+		bool coordinator = !coordinator_address.empty();
+		Renderer renderer(render_w, render_h, std::string("picture.ppm"));
+		configure(renderer);
+		renderer.set_distributed(coordinator ? coordinator_address : worker_address, worker_timeout_s);
+		renderer.run(coordinator ? RenderMode::COORDINATOR : RenderMode::TILE_WORKER);
+		return 0;
+	}
+	else if (rt_headless)
+	{
+		Renderer renderer(render_w, render_h, std::string("picture.ppm"));
+		configure(renderer);
+		renderer.run(RenderMode::THREADS);
+		LOG(INFO) << "Running headless mode, exiting.";
+		return 0;
+	}
+	else if (rt_benchmark_samplers)
+	{
+		Renderer renderer(render_w, render_h, std::string("picture.ppm"));
+		configure(renderer);
+		renderer.run(RenderMode::SAMPLER_BENCHMARK);
+		LOG(INFO) << "Sampler convergence written to sampler_convergence.csv, exiting.";
+		return 0;
+	}
+	else if (rt_animate)
+	{
+		Renderer renderer(render_w, render_h, std::string("picture.ppm"));
+		configure(renderer);
+		renderer.run(RenderMode::ANIMATE);
+		LOG(INFO) << "Running animate mode, exiting.";
+		return 0;
 	}
 
 	int error_code;
@@ -333,18 +667,42 @@ int main(int argc, char* argv[])
 	glViewport(0, 0, render_w, render_h);
 
 	Renderer renderer(render_w, render_h, std::string("picture.ppm"));
-	renderer.run(RenderMode::THREADS);
-	
-	auto&& updated_img_dim = renderer.get_image_dim();
-	int idx = 0;
-	std::unique_ptr<char[]> img_data(new char[updated_img_dim.x * updated_img_dim.y * 3]);
+	configure(renderer);
 
-	for (const auto& c : renderer.get_colors())
+	// progressive renders run in the background, the window shows their passes
+	std::thread render_thread;
+	std::atomic<bool> render_finished(false);
+	if (progressive)
 	{
-		for (size_t i = 0; i < c.length(); ++i)
+		render_thread = std::thread([&renderer, &render_finished]() {
+			renderer.run(RenderMode::THREADS);
+			render_finished = true;
+		});
+	}
+	else
+	{
+		renderer.run(RenderMode::THREADS);
+	}
+
+	auto&& updated_img_dim = renderer.get_image_dim();
+	std::unique_ptr<char[]> img_data(new char[updated_img_dim.x * updated_img_dim.y * 3]());
+
+	// written images are tone mapped in place already, previews hold linear colors
+	auto fill_img_data = [&img_data](const std::vector<glm::dvec3>& colors, bool tone_map) {
+		int idx = 0;
+		for (const auto& color : colors)
 		{
-			img_data[idx++] = static_cast<unsigned char>(std::round(c[i]));
+			glm::dvec3 c = tone_map ? Image::tone_map(color) : color;
+			for (size_t i = 0; i < c.length(); ++i)
+			{
+				img_data[idx++] = static_cast<unsigned char>(std::round(c[i]));
+			}
 		}
+	};
+
+	if (!progressive)
+	{
+		fill_img_data(renderer.get_colors(), false);
 	}
 
 	// Create an OpenGL texture identifier
@@ -364,9 +722,46 @@ int main(int argc, char* argv[])
 
 	glfwShowWindow(window);
 
+	size_t shown_passes = 0;
+	std::vector<glm::dvec3> preview;
+
 	while (!glfwWindowShouldClose(window)) {
-		// TODO: change to glfwPollEvents, waiting is not good for interactive applications
-		glfwWaitEvents();
+		if (render_finished)
+		{
+			// show the written image once the render is done
+			render_thread.join();
+			render_finished = false;
+			progressive = false;
+			fill_img_data(renderer.get_colors(), false);
+
+			glBindTexture(GL_TEXTURE_2D, image_texture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, updated_img_dim.x, updated_img_dim.y, 0, GL_RGB,
+				GL_UNSIGNED_BYTE,
+				img_data.get());
+		}
+
+		if (progressive)
+		{
+			// wake up regularly to show new passes
+			glfwWaitEventsTimeout(0.1);
+
+			size_t passes = renderer.get_preview(preview);
+			if (passes != shown_passes)
+			{
+				shown_passes = passes;
+				fill_img_data(preview, true);
+
+				glBindTexture(GL_TEXTURE_2D, image_texture);
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, updated_img_dim.x, updated_img_dim.y, 0, GL_RGB,
+					GL_UNSIGNED_BYTE,
+					img_data.get());
+			}
+		}
+		else
+		{
+			// TODO: change to glfwPollEvents, waiting is not good for interactive applications
+			glfwWaitEvents();
+		}
 
 		// Start the Dear ImGui frame
 		ImGui_ImplOpenGL3_NewFrame();
@@ -385,6 +780,30 @@ int main(int argc, char* argv[])
 			ImGuiWindowFlags_NoScrollWithMouse);
 		//ImGui::Text("size = %d x %d", render_w, render_h);
 		ImGui::Image((void*)image_texture, ImVec2(static_cast<float>(render_w), static_cast<float>(render_h)));
+
+		// clicking into a progressive render makes the area around the cursor render
+		// first in the following passes, a right click renders in the normal order again
+		if (progressive && ImGui::IsItemHovered())
+		{
+			if (ImGui::IsMouseClicked(0))
+			{
+				ImVec2 mouse = ImGui::GetMousePos();
+				ImVec2 origin = ImGui::GetItemRectMin();
+				double x = (mouse.x - origin.x) * updated_img_dim.x / render_w;
+				double y = (mouse.y - origin.y) * updated_img_dim.y / render_h;
+				double radius = updated_img_dim.y / 8.0;
+
+				renderer.set_priority_region(
+					static_cast<size_t>(std::max(x - radius, 0.0)),
+					static_cast<size_t>(std::max(y - radius, 0.0)),
+					static_cast<size_t>(x + radius),
+					static_cast<size_t>(y + radius));
+			}
+			else if (ImGui::IsMouseClicked(1))
+			{
+				renderer.clear_priority_region();
+			}
+		}
 		ImGui::End();
 
 		ImGui::Render();
@@ -398,6 +817,13 @@ int main(int argc, char* argv[])
 		glfwSwapBuffers(window);
 	}
 
+	// closing the window ends a progressive render that is still running
+	if (render_thread.joinable())
+	{
+		renderer.cancel();
+		render_thread.join();
+	}
+
 	// Cleanup
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplGlfw_Shutdown();
@@ -0,0 +1,214 @@
+#include "misc/stats.h"
+
+#if defined(_WIN32)
+#include <psapi.h>
+#else
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+namespace rt
+{
+
+std::mutex Stats::stats_mutex;
+std::map<std::string, double> Stats::values;
+
+thread_local int64_t thread_ray_count = 0;
+thread_local int64_t thread_node_visits = 0;
+
+void Stats::add(const std::string& name, double value)
+{
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	values[name] += value;
+}
+
+void Stats::set(const std::string& name, double value)
+{
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	values[name] = value;
+}
+
+double Stats::get(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	auto it = values.find(name);
+	return it == values.end() ? 0.0 : it->second;
+}
+
+void Stats::clear()
+{
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	values.clear();
+}
+
+void Stats::report()
+{
+	std::lock_guard<std::mutex> lock(stats_mutex);
+
+	LOG(INFO) << "Statistics:";
+	for (const auto& v : values)
+	{
+		LOG(INFO) << "    " << v.first << ": " << v.second;
+	}
+}
+
+void Stats::report(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	auto it = values.find(name);
+
+	if (it != values.end())
+	{
+		LOG(INFO) << "    " << it->first << ": " << it->second;
+	}
+}
+
+#if !defined(_WIN32)
+// counter of the calling thread on any CPU, -1 if perf events are unavailable
+static int open_counter(uint64_t config)
+{
+	perf_event_attr attr{};
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+static int64_t read_counter(int fd)
+{
+	int64_t value = 0;
+
+	if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+	{
+		return 0;
+	}
+	return value;
+}
+#endif
+
+CacheCounter::CacheCounter()
+{
+#if !defined(_WIN32)
+	misses_fd = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+	references_fd = open_counter(PERF_COUNT_HW_CACHE_REFERENCES);
+#endif
+}
+
+CacheCounter::~CacheCounter()
+{
+#if !defined(_WIN32)
+	if (misses_fd >= 0)
+	{
+		close(misses_fd);
+	}
+	if (references_fd >= 0)
+	{
+		close(references_fd);
+	}
+#endif
+}
+
+int64_t CacheCounter::misses() const
+{
+#if !defined(_WIN32)
+	return read_counter(misses_fd);
+#else
+	return 0;
+#endif
+}
+
+int64_t CacheCounter::references() const
+{
+#if !defined(_WIN32)
+	return read_counter(references_fd);
+#else
+	return 0;
+#endif
+}
+
+void CacheCounter::report() const
+{
+	if (available())
+	{
+		Stats::add("LLC misses", static_cast<double>(misses()));
+		Stats::add("LLC references", static_cast<double>(references()));
+	}
+}
+
+void LockStats::reset()
+{
+	acquisitions = 0;
+	contentions = 0;
+	wait_ns = 0;
+	hold_ns = 0;
+}
+
+void LockStats::report(const std::string& name) const
+{
+	int64_t n = acquisitions;
+
+	Stats::set(name + " acquisitions", static_cast<double>(n));
+	Stats::set(name + " contended [%]", n > 0 ? 100.0 * contentions / n : 0.0);
+	Stats::set(name + " wait time [ms]", wait_ns * 1e-6);
+	Stats::set(name + " mean hold time [ns]", n > 0 ? static_cast<double>(hold_ns) / n : 0.0);
+}
+
+bool Stats::numa_allocations(int64_t* local, int64_t* remote)
+{
+	*local = 0;
+	*remote = 0;
+
+#if defined(_WIN32)
+	return false;
+#else
+	bool found = false;
+
+	// node ids are usually contiguous, stop at the first missing one
+	for (int node = 0; ; ++node)
+	{
+		std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) + "/numastat");
+		if (!ifs)
+		{
+			break;
+		}
+
+		std::string name;
+		int64_t value;
+		while (ifs >> name >> value)
+		{
+			if (name == "local_node")
+			{
+				*local += value;
+			}
+			else if (name == "other_node")
+			{
+				*remote += value;
+			}
+		}
+		found = true;
+	}
+	return found;
+#endif
+}
+
+void Stats::page_faults(int64_t* minor, int64_t* major)
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	*minor = counters.PageFaultCount;
+	*major = 0;
+#else
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	*minor = usage.ru_minflt;
+	*major = usage.ru_majflt;
+#endif
+}
+
+} // namespace rt
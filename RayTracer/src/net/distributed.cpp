@@ -0,0 +1,424 @@
+#include <cstring>
+
+#include "net/distributed.h"
+
+namespace rt
+{
+
+namespace
+{
+// how long an idle worker waits before asking again for tiles that are in flight elsewhere
+constexpr auto RETRY_DELAY = std::chrono::milliseconds(50);
+
+struct TileHeader
+{
+	int32_t x0;
+	int32_t y0;
+	int32_t w;
+	int32_t h;
+};
+
+template <typename T>
+void append(std::vector<char>& payload, const T& value)
+{
+	const char* p = reinterpret_cast<const char*>(&value);
+	payload.insert(payload.end(), p, p + sizeof(T));
+}
+
+template <typename T>
+bool extract(const std::vector<char>& payload, size_t& offset, T& value)
+{
+	if (offset + sizeof(T) > payload.size())
+	{
+		return false;
+	}
+	std::memcpy(&value, payload.data() + offset, sizeof(T));
+	offset += sizeof(T);
+	return true;
+}
+
+// the scene name is sent as its length and characters, the other fields as they are
+std::vector<char> job_payload(const TileJob& job)
+{
+	std::vector<char> payload;
+	append(payload, job.width);
+	append(payload, job.height);
+	append(payload, job.spp);
+	append(payload, job.grid_dim);
+	append(payload, job.sampler);
+	append(payload, job.seed);
+	append(payload, job.tile_width);
+	append(payload, job.tile_height);
+	append(payload, static_cast<uint32_t>(job.custom_camera));
+	append(payload, job.eye);
+	append(payload, job.look_at);
+	append(payload, job.up);
+	append(payload, static_cast<uint32_t>(job.scene.size()));
+	payload.insert(payload.end(), job.scene.begin(), job.scene.end());
+	return payload;
+}
+
+bool extract_job(const std::vector<char>& payload, TileJob& job)
+{
+	size_t offset = 0;
+	uint32_t custom_camera = 0;
+	uint32_t scene_size = 0;
+
+	if (!extract(payload, offset, job.width) || !extract(payload, offset, job.height) ||
+		!extract(payload, offset, job.spp) || !extract(payload, offset, job.grid_dim) ||
+		!extract(payload, offset, job.sampler) || !extract(payload, offset, job.seed) ||
+		!extract(payload, offset, job.tile_width) || !extract(payload, offset, job.tile_height) ||
+		!extract(payload, offset, custom_camera) || !extract(payload, offset, job.eye) ||
+		!extract(payload, offset, job.look_at) || !extract(payload, offset, job.up) ||
+		!extract(payload, offset, scene_size) || payload.size() - offset != scene_size)
+	{
+		return false;
+	}
+	job.custom_camera = custom_camera != 0;
+	job.scene.assign(payload.data() + offset, scene_size);
+	return true;
+}
+
+// pixels are sent as 16 bit fixed point, a quarter of the doubles and still far
+// more precise than the 8 bit output
+uint16_t encode_channel(double c)
+{
+	return static_cast<uint16_t>(std::round(glm::clamp(c, 0.0, 1.0) * 65535.0));
+}
+
+double decode_channel(uint16_t c)
+{
+	return c / 65535.0;
+}
+} // namespace
+
+TileCoordinator::TileCoordinator(const std::string& address,
+	const TileJob& job,
+	const std::vector<std::pair<int, int>>& tiles,
+	double timeout_s) :
+	address(address),
+	job(job),
+	tiles(tiles),
+	timeout_s(timeout_s)
+{
+}
+
+bool TileCoordinator::run(Image& img)
+{
+	Socket listener = Socket::listen(address);
+
+	if (!listener.valid())
+	{
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.clear();
+		for (size_t t = 0; t < tiles.size(); ++t)
+		{
+			queue.push_back(t);
+		}
+		done.assign(tiles.size(), 0);
+		remaining = tiles.size();
+		requeued = 0;
+		workers = 0;
+	}
+
+	LOG(INFO) << "Serving " << tiles.size() << " tiles on " << address;
+
+	// accept workers until all tiles are done, every worker is served by its own thread
+	std::vector<std::thread> threads;
+	std::thread acceptor([&]() {
+		while (true)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (remaining == 0)
+				{
+					break;
+				}
+			}
+			if (!listener.wait_readable(0.1))
+			{
+				continue;
+			}
+
+			Socket connection = listener.accept();
+			if (connection.valid())
+			{
+				threads.emplace_back([this, &img, c = std::move(connection)]() mutable {
+					serve(c, img);
+				});
+			}
+		}
+	});
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		all_done.wait(lock, [this]() { return remaining == 0; });
+
+		// wake up the workers still waiting for tiles, they take the lost connection
+		// as the end of the frame
+		for (Socket* connection : connections)
+		{
+			connection->shutdown();
+		}
+	}
+
+	acceptor.join();
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	listener.close();
+
+	if (address.compare(0, 5, "unix:") == 0)
+	{
+		std::remove(address.substr(5).c_str());
+	}
+	return true;
+}
+
+void TileCoordinator::serve(Socket& connection, Image& img)
+{
+	// tiles handed to this worker and not merged yet
+	std::vector<size_t> in_flight;
+	uint32_t type;
+	std::vector<char> payload;
+
+	connection.set_timeout(timeout_s);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		// connected after the frame was finished
+		if (remaining == 0)
+		{
+			return;
+		}
+		connections.push_back(&connection);
+		++workers;
+	}
+
+	if (recv_message(connection, type, payload) && type == static_cast<uint32_t>(TileMessage::HELLO))
+	{
+		bool ok = send_message(connection, static_cast<uint32_t>(TileMessage::JOB), job_payload(job));
+
+		while (ok && recv_message(connection, type, payload))
+		{
+			if (type == static_cast<uint32_t>(TileMessage::REQUEST))
+			{
+				uint32_t count = 0;
+				size_t offset = 0;
+				extract(payload, offset, count);
+
+				std::vector<char> reply;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					uint32_t finished = remaining == 0;
+					uint32_t n = static_cast<uint32_t>(std::min<size_t>(count, queue.size()));
+
+					append(reply, finished);
+					append(reply, n);
+					for (uint32_t i = 0; i < n; ++i)
+					{
+						size_t t = queue.front();
+						queue.pop_front();
+						in_flight.push_back(t);
+						append(reply, static_cast<int32_t>(tiles[t].first));
+						append(reply, static_cast<int32_t>(tiles[t].second));
+					}
+				}
+				ok = send_message(connection, static_cast<uint32_t>(TileMessage::TILES), reply);
+			}
+			else if (type == static_cast<uint32_t>(TileMessage::RESULT))
+			{
+				ok = merge(payload, img, in_flight);
+			}
+			else
+			{
+				ok = false;
+			}
+		}
+	}
+
+	// the worker is gone or broke the protocol, its unfinished tiles are handed out again
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t lost = 0;
+
+	for (size_t t : in_flight)
+	{
+		if (!done[t])
+		{
+			queue.push_front(t);
+			++lost;
+		}
+	}
+	if (lost > 0)
+	{
+		requeued += lost;
+		LOG(WARNING) << "Lost a worker, handing out its " << lost << " tiles again";
+	}
+	connections.erase(std::find(connections.begin(), connections.end(), &connection));
+}
+
+bool TileCoordinator::merge(const std::vector<char>& payload, Image& img, std::vector<size_t>& in_flight)
+{
+	TileHeader header;
+	size_t offset = 0;
+
+	if (!extract(payload, offset, header))
+	{
+		return false;
+	}
+
+	auto it = std::find_if(in_flight.begin(), in_flight.end(), [&](size_t t) {
+		return tiles[t].first == header.x0 && tiles[t].second == header.y0;
+	});
+	size_t w = 0;
+	size_t h = 0;
+
+	if (it != in_flight.end())
+	{
+		w = std::min<size_t>(job.tile_width, img.get_width() - tiles[*it].first);
+		h = std::min<size_t>(job.tile_height, img.get_height() - tiles[*it].second);
+	}
+
+	if (w == 0 || header.w != static_cast<int32_t>(w) || header.h != static_cast<int32_t>(h) ||
+		payload.size() != offset + w * h * 3 * sizeof(uint16_t))
+	{
+		LOG(ERROR) << "Received an invalid tile at " << header.x0 << ", " << header.y0;
+		return false;
+	}
+	size_t t = *it;
+	in_flight.erase(it);
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// a tile handed out again may arrive twice
+	if (done[t])
+	{
+		return true;
+	}
+
+	const char* pixels = payload.data() + offset;
+	for (size_t y = 0; y < h; ++y)
+	{
+		for (size_t x = 0; x < w; ++x)
+		{
+			uint16_t c[3];
+			std::memcpy(c, pixels + (y * w + x) * sizeof(c), sizeof(c));
+			img.colors[(header.y0 + y) * img.get_width() + header.x0 + x] =
+				glm::dvec3(decode_channel(c[0]), decode_channel(c[1]), decode_channel(c[2]));
+		}
+	}
+
+	done[t] = 1;
+	if (--remaining == 0)
+	{
+		all_done.notify_all();
+	}
+	return true;
+}
+
+bool TileClient::connect(const std::string& address, TileJob& job)
+{
+	socket = Socket::connect(address);
+
+	uint32_t type;
+	std::vector<char> payload;
+
+	if (!socket.valid() ||
+		!send_message(socket, static_cast<uint32_t>(TileMessage::HELLO), {}) ||
+		!recv_message(socket, type, payload) ||
+		type != static_cast<uint32_t>(TileMessage::JOB) ||
+		!extract_job(payload, job))
+	{
+		LOG(ERROR) << "Could not receive a job from " << address;
+		socket.close();
+		return false;
+	}
+	return true;
+}
+
+bool TileClient::next_tile(int& x0, int& y0, size_t batch_size)
+{
+	std::lock_guard<std::mutex> lock(fetch_mutex);
+
+	while (local.empty() && !finished)
+	{
+		std::vector<char> request;
+		append(request, static_cast<uint32_t>(batch_size));
+
+		uint32_t type;
+		std::vector<char> reply;
+		uint32_t done = 0;
+		uint32_t n = 0;
+		size_t offset = 0;
+		bool ok;
+		{
+			std::lock_guard<std::mutex> send_lock(send_mutex);
+			ok = send_message(socket, static_cast<uint32_t>(TileMessage::REQUEST), request);
+		}
+		ok = ok && recv_message(socket, type, reply) && type == static_cast<uint32_t>(TileMessage::TILES) &&
+			extract(reply, offset, done) && extract(reply, offset, n);
+
+		for (uint32_t i = 0; ok && i < n; ++i)
+		{
+			int32_t x;
+			int32_t y;
+			ok = extract(reply, offset, x) && extract(reply, offset, y);
+			local.emplace_back(x, y);
+		}
+
+		if (!ok)
+		{
+			// also the way the coordinator ends the frame
+			LOG(INFO) << "Connection to the coordinator closed";
+			finished = true;
+		}
+		else if (done)
+		{
+			finished = true;
+		}
+		else if (n == 0)
+		{
+			// the remaining tiles are being rendered by other workers, which may fail
+			std::this_thread::sleep_for(RETRY_DELAY);
+		}
+	}
+
+	if (local.empty())
+	{
+		return false;
+	}
+	x0 = local.front().first;
+	y0 = local.front().second;
+	local.pop_front();
+	return true;
+}
+
+bool TileClient::send_tile(int x0, int y0, int w, int h, const std::vector<glm::dvec3>& colors, size_t img_width)
+{
+	std::vector<char> payload;
+	payload.reserve(sizeof(TileHeader) + static_cast<size_t>(w) * h * 3 * sizeof(uint16_t));
+	append(payload, TileHeader{ x0, y0, w, h });
+
+	for (int y = 0; y < h; ++y)
+	{
+		for (int x = 0; x < w; ++x)
+		{
+			const glm::dvec3& c = colors[(static_cast<size_t>(y0) + y) * img_width + x0 + x];
+			append(payload, encode_channel(c.x));
+			append(payload, encode_channel(c.y));
+			append(payload, encode_channel(c.z));
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(send_mutex);
+	++tiles_rendered;
+	return send_message(socket, static_cast<uint32_t>(TileMessage::RESULT), payload);
+}
+
+} // namespace rt
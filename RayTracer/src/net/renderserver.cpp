@@ -0,0 +1,375 @@
+#include <cstdio>
+#include <sstream>
+
+#include "net/renderserver.h"
+#include "core/renderer.h"
+#include "misc/stats.h"
+
+namespace rt
+{
+
+namespace
+{
+// larger images are rejected instead of allocated
+constexpr size_t MAX_JOB_RESOLUTION = 16384;
+
+// clients connected at once, further ones are turned away
+constexpr size_t MAX_CONNECTIONS = 16;
+
+double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool parse_size(const std::string& value, size_t max, size_t& result)
+{
+	char* end = nullptr;
+	unsigned long long v = strtoull(value.c_str(), &end, 10);
+
+	if (value.empty() || value[0] == '-' || *end != '\0' || v == 0 || v > max)
+	{
+		return false;
+	}
+	result = static_cast<size_t>(v);
+	return true;
+}
+
+// "x,y,z"
+bool parse_vector(const std::string& value, glm::dvec3& result)
+{
+	char rest;
+	return sscanf(value.c_str(), "%lf,%lf,%lf%c", &result.x, &result.y, &result.z, &rest) == 3;
+}
+
+std::vector<char> to_payload(const std::string& text)
+{
+	return std::vector<char>(text.begin(), text.end());
+}
+
+// Unix sockets and TCP on the loopback interface, the server renders for its own machine
+bool is_local_address(const std::string& address)
+{
+	if (address.compare(0, 5, "unix:") == 0)
+	{
+		return true;
+	}
+
+	size_t colon = address.find_last_of(':');
+	std::string host = colon == std::string::npos ? "" : address.substr(0, colon);
+	return host == "localhost" || host == "::1" || host.compare(0, 4, "127.") == 0;
+}
+
+// relative paths that stay inside the working directory of the server
+bool is_confined_path(const std::string& path)
+{
+	if (path.empty() || path[0] == '/' || path[0] == '\\' || path.find(':') != std::string::npos)
+	{
+		return false;
+	}
+
+	size_t begin = 0;
+	while (begin <= path.size())
+	{
+		size_t end = path.find_first_of("/\\", begin);
+		end = end == std::string::npos ? path.size() : end;
+
+		if (path.compare(begin, end - begin, "..") == 0)
+		{
+			return false;
+		}
+		begin = end + 1;
+	}
+	return true;
+}
+} // namespace
+
+bool RenderJob::parse(const std::string& settings, std::string& error)
+{
+	std::istringstream iss(settings);
+	std::string setting;
+
+	while (iss >> setting)
+	{
+		size_t eq = setting.find('=');
+		std::string key = setting.substr(0, eq);
+		std::string value = eq == std::string::npos ? "" : setting.substr(eq + 1);
+		bool ok = !value.empty();
+
+		if (key == "scene")
+		{
+			scene = value;
+		}
+		else if (key == "width")
+		{
+			ok = ok && parse_size(value, MAX_JOB_RESOLUTION, width);
+		}
+		else if (key == "height")
+		{
+			ok = ok && parse_size(value, MAX_JOB_RESOLUTION, height);
+		}
+		else if (key == "spp")
+		{
+			ok = ok && parse_size(value, 1 << 16, spp);
+		}
+		else if (key == "output")
+		{
+			ok = ok && is_confined_path(value);
+			output = value;
+		}
+		else if (key == "eye" || key == "look_at" || key == "up")
+		{
+			glm::dvec3& v = key == "eye" ? eye : key == "look_at" ? look_at : up;
+			ok = ok && parse_vector(value, v);
+			custom_camera = true;
+		}
+		else
+		{
+			error = "unknown setting " + key;
+			return false;
+		}
+
+		if (!ok)
+		{
+			error = "invalid value for " + key;
+			return false;
+		}
+	}
+
+	if (custom_camera && (eye == look_at || glm::length(up) == 0.0))
+	{
+		error = "eye and look_at have to differ and up must not be 0";
+		return false;
+	}
+	return true;
+}
+
+RenderServer::RenderServer(Renderer& renderer, const std::string& address, const RenderJob& defaults) :
+	renderer(renderer),
+	address(address),
+	defaults(defaults)
+{
+}
+
+bool RenderServer::run()
+{
+	if (!is_local_address(address))
+	{
+		LOG(ERROR) << "Render servers only listen on unix:/path or a loopback address like localhost:port, not on "
+			<< address;
+		return false;
+	}
+
+	// the first job shouldn't wait for the default scene
+	if (!renderer.set_scene(defaults.scene))
+	{
+		return false;
+	}
+
+	Socket listener = Socket::listen(address);
+
+	if (!listener.valid())
+	{
+		return false;
+	}
+	LOG(INFO) << "Waiting for render jobs on " << address;
+
+	// one thread per connection and whether it has finished
+	std::vector<std::pair<std::thread, std::shared_ptr<std::atomic<bool>>>> threads;
+	while (true)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopping)
+			{
+				break;
+			}
+		}
+
+		// join the threads of closed connections
+		for (size_t i = 0; i < threads.size();)
+		{
+			if (threads[i].second->load())
+			{
+				threads[i].first.join();
+				threads[i] = std::move(threads.back());
+				threads.pop_back();
+			}
+			else
+			{
+				++i;
+			}
+		}
+
+		if (!listener.wait_readable(0.1))
+		{
+			continue;
+		}
+
+		Socket connection = listener.accept();
+		if (!connection.valid())
+		{
+			continue;
+		}
+		if (threads.size() >= MAX_CONNECTIONS)
+		{
+			LOG(WARNING) << "Turning away a client, " << MAX_CONNECTIONS << " are connected";
+			send_message(connection, static_cast<uint32_t>(RenderServerMessage::FAILED), to_payload("server busy"));
+			continue;
+		}
+
+		auto done = std::make_shared<std::atomic<bool>>(false);
+		std::thread thread([this, done, c = std::move(connection)]() mutable {
+			serve(c);
+			*done = true;
+		});
+		threads.emplace_back(std::move(thread), std::move(done));
+	}
+
+	for (auto& t : threads)
+	{
+		t.first.join();
+	}
+	listener.close();
+
+	if (address.compare(0, 5, "unix:") == 0)
+	{
+		std::remove(address.substr(5).c_str());
+	}
+	LOG(INFO) << "Render server stopped";
+	return true;
+}
+
+void RenderServer::serve(Socket& connection)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		// connected while the server was stopping
+		if (stopping)
+		{
+			return;
+		}
+		connections.push_back(&connection);
+	}
+
+	uint32_t type;
+	std::vector<char> payload;
+
+	while (recv_message(connection, type, payload) && type == static_cast<uint32_t>(RenderServerMessage::JOB))
+	{
+		auto received = std::chrono::steady_clock::now();
+		std::string settings(payload.begin(), payload.end());
+		bool quit = settings == "quit";
+		std::string reply;
+		bool ok = false;
+
+		{
+			// jobs wait here for the ones sent before
+			std::lock_guard<std::mutex> render_lock(render_mutex);
+			bool stopped;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopped = stopping;
+
+				if (quit && !stopping)
+				{
+					// wake up the other clients, they take the lost connection as the end
+					stopping = true;
+					for (Socket* other : connections)
+					{
+						if (other != &connection)
+						{
+							other->shutdown();
+						}
+					}
+				}
+			}
+
+			if (stopped)
+			{
+				reply = "server stopping";
+			}
+			else if (quit)
+			{
+				ok = true;
+				reply = "stopping";
+			}
+			else
+			{
+				ok = render(settings, elapsed_ms(received), reply);
+			}
+		}
+
+		if (!send_message(connection,
+			static_cast<uint32_t>(ok ? RenderServerMessage::DONE : RenderServerMessage::FAILED),
+			to_payload(reply)) || quit)
+		{
+			break;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	connections.erase(std::find(connections.begin(), connections.end(), &connection));
+}
+
+bool RenderServer::render(const std::string& settings, double queue_ms, std::string& reply)
+{
+	auto start = std::chrono::steady_clock::now();
+	RenderJob job = defaults;
+
+	if (!job.parse(settings, reply))
+	{
+		LOG(WARNING) << "Rejected render job \"" << settings << "\": " << reply;
+		return false;
+	}
+
+	if (!renderer.set_scene(job.scene))
+	{
+		reply = "unknown scene " + job.scene;
+		return false;
+	}
+	double scene_ms = elapsed_ms(start);
+
+	if (job.custom_camera)
+	{
+		renderer.set_camera(job.eye, job.look_at, job.up);
+	}
+	else
+	{
+		renderer.reset_camera();
+	}
+	renderer.set_resolution(job.width, job.height);
+	renderer.set_spp(job.spp);
+	renderer.set_output_file(job.output);
+	renderer.run(RenderMode::THREADS);
+
+	std::ostringstream oss;
+	oss << "file=" << job.output
+		<< " queue_ms=" << queue_ms
+		<< " scene_ms=" << scene_ms
+		<< " render_ms=" << Stats::get("Render time [ms]")
+		<< " write_ms=" << Stats::get("Image write time [ms]")
+		<< " total_ms=" << queue_ms + elapsed_ms(start);
+	reply = oss.str();
+	LOG(INFO) << "Rendered job \"" << settings << "\": " << reply;
+	return true;
+}
+
+bool RenderServer::submit(const std::string& address, const std::string& settings, std::string& reply)
+{
+	Socket socket = Socket::connect(address);
+	uint32_t type;
+	std::vector<char> payload;
+
+	if (!socket.valid() ||
+		!send_message(socket, static_cast<uint32_t>(RenderServerMessage::JOB), to_payload(settings)) ||
+		!recv_message(socket, type, payload))
+	{
+		reply = "no reply from " + address;
+		return false;
+	}
+	reply.assign(payload.begin(), payload.end());
+	return type == static_cast<uint32_t>(RenderServerMessage::DONE);
+}
+
+} // namespace rt
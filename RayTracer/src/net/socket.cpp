@@ -0,0 +1,352 @@
+#include <cstring>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#endif
+
+#include "net/socket.h"
+
+namespace rt
+{
+
+namespace
+{
+constexpr char UNIX_PREFIX[] = "unix:";
+
+// payloads larger than this are treated as a broken stream
+constexpr uint32_t MAX_MESSAGE_SIZE = 1u << 30;
+
+struct MessageHeader
+{
+	uint32_t type;
+	uint32_t size;
+};
+
+#if defined(_WIN32)
+using NativeSocket = SOCKET;
+
+bool init_sockets()
+{
+	static bool initialized = []() {
+		WSADATA data;
+		return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	}();
+	return initialized;
+}
+
+void close_native(NativeSocket s)
+{
+	closesocket(s);
+}
+#else
+using NativeSocket = int;
+
+bool init_sockets()
+{
+	return true;
+}
+
+void close_native(NativeSocket s)
+{
+	::close(s);
+}
+#endif
+
+bool is_unix_address(const std::string& address)
+{
+	return address.compare(0, sizeof(UNIX_PREFIX) - 1, UNIX_PREFIX) == 0;
+}
+
+// resolve "host:port", an empty host means all interfaces when listening
+addrinfo* resolve(const std::string& address, bool passive)
+{
+	size_t colon = address.find_last_of(':');
+
+	if (colon == std::string::npos)
+	{
+		LOG(ERROR) << "Address " << address << " is neither host:port nor unix:/path";
+		return nullptr;
+	}
+	std::string host = address.substr(0, colon);
+	std::string port = address.substr(colon + 1);
+
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+	addrinfo* result = nullptr;
+	if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0)
+	{
+		LOG(ERROR) << "Could not resolve " << address;
+		return nullptr;
+	}
+	return result;
+}
+} // namespace
+
+Socket& Socket::operator=(Socket&& other) noexcept
+{
+	if (this != &other)
+	{
+		close();
+		handle = other.handle;
+		other.handle = INVALID;
+	}
+	return *this;
+}
+
+Socket Socket::listen(const std::string& address)
+{
+	if (!init_sockets())
+	{
+		return Socket();
+	}
+
+	if (is_unix_address(address))
+	{
+#if defined(_WIN32)
+		LOG(ERROR) << "Unix domain sockets are not supported on this platform";
+		return Socket();
+#else
+		std::string path = address.substr(sizeof(UNIX_PREFIX) - 1);
+		sockaddr_un addr{};
+		addr.sun_family = AF_UNIX;
+
+		if (path.size() >= sizeof(addr.sun_path))
+		{
+			LOG(ERROR) << "Unix socket path " << path << " is too long";
+			return Socket();
+		}
+		std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		unlink(path.c_str());
+
+		NativeSocket s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s < 0 || bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(s, SOMAXCONN) != 0)
+		{
+			LOG(ERROR) << "Could not listen on " << address;
+			if (s >= 0)
+			{
+				close_native(s);
+			}
+			return Socket();
+		}
+		return Socket(static_cast<intptr_t>(s));
+#endif
+	}
+
+	addrinfo* info = resolve(address, true);
+	for (addrinfo* ai = info; ai; ai = ai->ai_next)
+	{
+		NativeSocket s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		Socket sock(static_cast<intptr_t>(s));
+
+		if (!sock.valid())
+		{
+			continue;
+		}
+		int reuse = 1;
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+		if (bind(s, ai->ai_addr, static_cast<int>(ai->ai_addrlen)) == 0 && ::listen(s, SOMAXCONN) == 0)
+		{
+			freeaddrinfo(info);
+			return sock;
+		}
+	}
+	if (info)
+	{
+		freeaddrinfo(info);
+	}
+	LOG(ERROR) << "Could not listen on " << address;
+	return Socket();
+}
+
+Socket Socket::connect(const std::string& address)
+{
+	if (!init_sockets())
+	{
+		return Socket();
+	}
+
+	if (is_unix_address(address))
+	{
+#if defined(_WIN32)
+		LOG(ERROR) << "Unix domain sockets are not supported on this platform";
+		return Socket();
+#else
+		std::string path = address.substr(sizeof(UNIX_PREFIX) - 1);
+		sockaddr_un addr{};
+		addr.sun_family = AF_UNIX;
+		std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+		Socket sock(static_cast<intptr_t>(socket(AF_UNIX, SOCK_STREAM, 0)));
+		if (!sock.valid() ||
+			::connect(static_cast<NativeSocket>(sock.handle), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+		{
+			LOG(ERROR) << "Could not connect to " << address;
+			return Socket();
+		}
+		return sock;
+#endif
+	}
+
+	addrinfo* info = resolve(address, false);
+	for (addrinfo* ai = info; ai; ai = ai->ai_next)
+	{
+		NativeSocket s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		Socket sock(static_cast<intptr_t>(s));
+
+		if (sock.valid() && ::connect(s, ai->ai_addr, static_cast<int>(ai->ai_addrlen)) == 0)
+		{
+			// tile requests are small and latency bound
+			int no_delay = 1;
+			setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&no_delay), sizeof(no_delay));
+			freeaddrinfo(info);
+			return sock;
+		}
+	}
+	if (info)
+	{
+		freeaddrinfo(info);
+	}
+	LOG(ERROR) << "Could not connect to " << address;
+	return Socket();
+}
+
+Socket Socket::accept()
+{
+	NativeSocket s = ::accept(static_cast<NativeSocket>(handle), nullptr, nullptr);
+	Socket sock(static_cast<intptr_t>(s));
+
+	if (sock.valid())
+	{
+		// fails harmlessly for Unix sockets
+		int no_delay = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&no_delay), sizeof(no_delay));
+	}
+	return sock;
+}
+
+bool Socket::send_all(const void* data, size_t bytes)
+{
+	const char* p = static_cast<const char*>(data);
+
+	while (bytes > 0)
+	{
+		int chunk = static_cast<int>(std::min<size_t>(bytes, 1 << 20));
+#if defined(MSG_NOSIGNAL)
+		// a dead peer must not kill the process with SIGPIPE
+		auto sent = send(static_cast<NativeSocket>(handle), p, chunk, MSG_NOSIGNAL);
+#else
+		auto sent = send(static_cast<NativeSocket>(handle), p, chunk, 0);
+#endif
+		if (sent <= 0)
+		{
+			return false;
+		}
+		p += sent;
+		bytes -= static_cast<size_t>(sent);
+	}
+	return true;
+}
+
+bool Socket::recv_all(void* data, size_t bytes)
+{
+	char* p = static_cast<char*>(data);
+
+	while (bytes > 0)
+	{
+		int chunk = static_cast<int>(std::min<size_t>(bytes, 1 << 20));
+		auto received = recv(static_cast<NativeSocket>(handle), p, chunk, 0);
+
+		if (received <= 0)
+		{
+			return false;
+		}
+		p += received;
+		bytes -= static_cast<size_t>(received);
+	}
+	return true;
+}
+
+void Socket::set_timeout(double seconds)
+{
+#if defined(_WIN32)
+	DWORD timeout = static_cast<DWORD>(seconds * 1e3);
+#else
+	timeval timeout{};
+	timeout.tv_sec = static_cast<time_t>(seconds);
+	timeout.tv_usec = static_cast<suseconds_t>((seconds - timeout.tv_sec) * 1e6);
+#endif
+	setsockopt(static_cast<NativeSocket>(handle), SOL_SOCKET, SO_RCVTIMEO,
+		reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
+
+bool Socket::wait_readable(double seconds)
+{
+	fd_set readable;
+	FD_ZERO(&readable);
+	FD_SET(static_cast<NativeSocket>(handle), &readable);
+
+	timeval timeout{};
+	timeout.tv_sec = static_cast<long>(seconds);
+	timeout.tv_usec = static_cast<long>((seconds - timeout.tv_sec) * 1e6);
+
+	// the first argument is ignored on Windows
+	return select(static_cast<int>(handle) + 1, &readable, nullptr, nullptr, &timeout) > 0;
+}
+
+void Socket::shutdown()
+{
+	if (valid())
+	{
+#if defined(_WIN32)
+		::shutdown(static_cast<NativeSocket>(handle), SD_BOTH);
+#else
+		::shutdown(static_cast<NativeSocket>(handle), SHUT_RDWR);
+#endif
+	}
+}
+
+void Socket::close()
+{
+	if (valid())
+	{
+		close_native(static_cast<NativeSocket>(handle));
+		handle = INVALID;
+	}
+}
+
+bool send_message(Socket& socket, uint32_t type, const std::vector<char>& payload)
+{
+	MessageHeader header{ type, static_cast<uint32_t>(payload.size()) };
+
+	return socket.send_all(&header, sizeof(header)) &&
+		(payload.empty() || socket.send_all(payload.data(), payload.size()));
+}
+
+bool recv_message(Socket& socket, uint32_t& type, std::vector<char>& payload)
+{
+	MessageHeader header;
+
+	if (!socket.recv_all(&header, sizeof(header)) || header.size > MAX_MESSAGE_SIZE)
+	{
+		return false;
+	}
+	type = header.type;
+	payload.resize(header.size);
+
+	return header.size == 0 || socket.recv_all(payload.data(), payload.size());
+}
+
+} // namespace rt
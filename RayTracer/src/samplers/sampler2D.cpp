@@ -3,13 +3,281 @@
 namespace rt
 {
 
-const glm::dvec2* StratifiedSampler2D::get2DArray()
+namespace
 {
-	if (currentPixel == sampler2Darray.size())
+// 2^-32, converts 0.32 fixed point to [0, 1)
+constexpr double FIXED_TO_DOUBLE = 1.0 / 4294967296.0;
+// 2^-53, the spacing of doubles below 1
+constexpr double DOUBLE_EPSILON = 1.0 / 9007199254740992.0;
+
+uint32_t reverse_bits(uint32_t x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	return x;
+}
+
+// hash of Laine and Karras, in which every bit only depends on the lower bits
+uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+// Owen scrambling of a 0.32 fixed point number: every bit is flipped depending on the higher ones
+uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+	return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+/*
+	Generator matrices of the first two Sobol dimensions: the van der Corput sequence
+	and the dimension of the primitive polynomial x + 1.
+*/
+struct SobolMatrices
+{
+	uint32_t m[2][32];
+
+	SobolMatrices()
 	{
+		for (int j = 0; j < 32; ++j)
+		{
+			m[0][j] = 1u << (31 - j);
+			m[1][j] = j == 0 ? 1u << 31 : m[1][j - 1] ^ (m[1][j - 1] >> 1);
+		}
+	}
+};
+
+const SobolMatrices sobol_matrices;
+
+uint32_t sobol(uint32_t index, int dim)
+{
+	uint32_t x = 0;
+	for (int j = 0; index; index >>= 1, ++j)
+	{
+		if (index & 1)
+		{
+			x ^= sobol_matrices.m[dim][j];
+		}
+	}
+	return x;
+}
+
+// Owen scrambled (0,2) sequence point of the given index
+std::pair<uint32_t, uint32_t> scrambled_sobol(uint32_t index, uint64_t seed)
+{
+	// shuffling the index keeps the stratification of the power of two prefixes
+	uint32_t i = nested_uniform_scramble(index, static_cast<uint32_t>(mix_bits(seed)));
+
+	return std::make_pair(nested_uniform_scramble(sobol(i, 0), static_cast<uint32_t>(mix_bits(seed + 1))),
+		nested_uniform_scramble(sobol(i, 1), static_cast<uint32_t>(mix_bits(seed + 2))));
+}
+
+constexpr uint32_t PRIMES[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53 };
+constexpr uint32_t NUM_PRIMES = sizeof(PRIMES) / sizeof(PRIMES[0]);
+
+/*
+	Radical inverse of index in the given base, whose digits are shifted by random
+	amounts that depend on the seed and on the digits in front of them.
+*/
+double scrambled_radical_inverse(uint64_t index, uint32_t base, uint64_t seed)
+{
+	double inv_base = 1.0 / base;
+	double inv_base_n = 1.0;
+	uint64_t reversed_digits = 0;
+
+	// until the digits fall below double precision
+	while (inv_base_n > DOUBLE_EPSILON)
+	{
+		uint64_t next = index / base;
+		uint64_t digit = index - next * base;
+
+		digit = (digit + mix_bits(seed ^ reversed_digits ^ (uint64_t(base) << 56))) % base;
+		reversed_digits = reversed_digits * base + digit;
+		inv_base_n *= inv_base;
+		index = next;
+	}
+	return std::min(reversed_digits * inv_base_n, 1.0 - DOUBLE_EPSILON);
+}
+}
+
+const glm::dvec2* Sampler2D::get2DArray()
+{
+	size_t pixel = currentPixel.fetch_add(1, std::memory_order_relaxed);
+
+	if (pixel >= pixelCount)
+	{
+		// keep the counter from wrapping around on repeated calls
+		currentPixel.store(pixelCount, std::memory_order_relaxed);
 		return nullptr;
 	}
-	return &sampler2Darray[currentPixel++][0];
+	return get2DArray(pixel);
+}
+
+const glm::dvec2* Sampler2D::get2DArray(size_t pixel) const
+{
+	// one buffer per thread, shared by all samplers since only the last array is valid
+	thread_local std::vector<glm::dvec2> samples;
+
+	if (pixel >= pixelCount)
+	{
+		return nullptr;
+	}
+	samples.resize(samplesPerPixel);
+	generate(pixel, samples.data());
+
+	return samples.data();
+}
+
+void StratifiedSampler2D::generate(size_t pixel,
+	glm::dvec2* out,
+	uint32_t pass,
+	uint32_t dimension) const
+{
+	// every pass jitters a new grid
+	PixelRNG rng(mix_bits(pixel_seed(pixel, dimension) + pass));
+
+	for (int k = 0; k < grid_dim; ++k)
+	{
+		for (int m = 0; m < grid_dim; ++m)
+		{
+			double u_rnd = rng.uniform();
+			double v_rnd = rng.uniform();
+
+			out[k * grid_dim + m] = glm::dvec2((k + u_rnd) / grid_dim,
+				(m + v_rnd) / grid_dim);
+		}
+	}
+}
+
+void SobolSampler2D::generate(size_t pixel,
+	glm::dvec2* out,
+	uint32_t pass,
+	uint32_t dimension) const
+{
+	uint64_t s = pixel_seed(pixel, dimension);
+	uint32_t first = pass * samplesPerPixel;
+
+	for (uint32_t i = 0; i < samplesPerPixel; ++i)
+	{
+		auto p = scrambled_sobol(first + i, s);
+		out[i] = glm::dvec2(p.first * FIXED_TO_DOUBLE, p.second * FIXED_TO_DOUBLE);
+	}
+}
+
+void HaltonSampler2D::generate(size_t pixel,
+	glm::dvec2* out,
+	uint32_t pass,
+	uint32_t dimension) const
+{
+	uint64_t s = pixel_seed(pixel, dimension);
+	uint32_t base_x = PRIMES[(2 * dimension) % NUM_PRIMES];
+	uint32_t base_y = PRIMES[(2 * dimension + 1) % NUM_PRIMES];
+	uint64_t first = uint64_t(pass) * samplesPerPixel;
+
+	for (uint32_t i = 0; i < samplesPerPixel; ++i)
+	{
+		out[i] = glm::dvec2(scrambled_radical_inverse(first + i, base_x, s),
+			scrambled_radical_inverse(first + i, base_y, mix_bits(s)));
+	}
+}
+
+PMJ02Sampler2D::PMJ02Sampler2D(size_t width,
+	size_t height,
+	unsigned int spp,
+	uint64_t seed) :
+	Sampler2D(width, height, spp, seed),
+	table_size(64)
+{
+	while (table_size < spp)
+	{
+		table_size *= 2;
+	}
+
+	sets.resize(size_t(NUM_SETS) * table_size);
+
+	for (uint32_t set = 0; set < NUM_SETS; ++set)
+	{
+		uint64_t set_seed = mix_bits(seed + 0x9e3779b97f4a7c15ull * (set + 1));
+
+		// unshuffled, so the table stays progressive: each power of two prefix is stratified
+		uint32_t flip_x = static_cast<uint32_t>(mix_bits(set_seed + 1));
+		uint32_t flip_y = static_cast<uint32_t>(mix_bits(set_seed + 2));
+
+		for (uint32_t i = 0; i < table_size; ++i)
+		{
+			sets[size_t(set) * table_size + i] = std::make_pair(
+				nested_uniform_scramble(sobol(i, 0), flip_x),
+				nested_uniform_scramble(sobol(i, 1), flip_y));
+		}
+	}
+}
+
+void PMJ02Sampler2D::generate(size_t pixel,
+	glm::dvec2* out,
+	uint32_t pass,
+	uint32_t dimension) const
+{
+	uint64_t s = pixel_seed(pixel, dimension);
+	uint64_t first = uint64_t(pass) * samplesPerPixel;
+
+	for (uint32_t i = 0; i < samplesPerPixel; ++i)
+	{
+		uint64_t index = first + i;
+
+		// a new set with a new shift once a set is used up
+		uint64_t h = mix_bits(s + index / table_size);
+		const auto& p = sets[(h % NUM_SETS) * table_size + index % table_size];
+
+		// the random digital shift permutes the elementary intervals among each other
+		uint32_t x = p.first ^ static_cast<uint32_t>(h >> 32);
+		uint32_t y = p.second ^ static_cast<uint32_t>(mix_bits(h));
+
+		out[i] = glm::dvec2(x * FIXED_TO_DOUBLE, y * FIXED_TO_DOUBLE);
+	}
+}
+
+std::unique_ptr<Sampler2D> make_sampler2D(SamplerType type,
+	size_t width,
+	size_t height,
+	size_t grid_dim,
+	uint64_t seed)
+{
+	unsigned int spp = static_cast<unsigned int>(grid_dim * grid_dim);
+
+	switch (type)
+	{
+	case SamplerType::SOBOL:
+		return std::make_unique<SobolSampler2D>(width, height, spp, seed);
+	case SamplerType::HALTON:
+		return std::make_unique<HaltonSampler2D>(width, height, spp, seed);
+	case SamplerType::PMJ02:
+		return std::make_unique<PMJ02Sampler2D>(width, height, spp, seed);
+	default:
+		return std::make_unique<StratifiedSampler2D>(width, height, grid_dim, seed);
+	}
+}
+
+const char* sampler_name(SamplerType type)
+{
+	switch (type)
+	{
+	case SamplerType::SOBOL:
+		return "sobol";
+	case SamplerType::HALTON:
+		return "halton";
+	case SamplerType::PMJ02:
+		return "pmj02";
+	default:
+		return "stratified";
+	}
 }
 
-} // namespace rt
\ No newline at end of file
+} // namespace rt
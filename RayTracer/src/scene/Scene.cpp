@@ -13,9 +13,18 @@
 #include "shape/quadric/quadrics.h"
 #include "light/light.h"
 #include "shape/bvh.h"
+#include "misc/stats.h"
+#include "shape/compressedmesh.h"
+#include "shape/mappedmesh.h"
 
 //#define SHOW_AXIS
 
+// uncomment to store the dragon mesh quantized instead of as single triangles
+//#define COMPRESS_MESHES
+
+// uncomment to convert the dragon mesh to a mesh file once and map it from disk
+//#define MAP_MESHES
+
 namespace rt
 {
 
@@ -38,11 +47,23 @@ Scene::Scene(
 	ray: the next ray to trace
 	o: the object that was hit
 */
-double Scene::shoot_ray(const Ray& ray, SurfaceInteraction* isect) const
+double Scene::shoot_ray(const Ray& ray, SurfaceInteraction* isect, const TileCull* cull) const
 {
 	double t_int = INFINITY;
 	double tmp = INFINITY;
 
+	++thread_ray_count;
+
+	if (cull)
+	{
+		for (size_t i = 0; i < cull->count; ++i)
+		{
+			const auto& entry = cull->entries[i];
+			entry.shape->intersect_culled(ray, isect, entry.nodes);
+		}
+		return ray.tMax;
+	}
+
 	// get nearest intersection point
 	for (auto& objs : sc)
 	{
@@ -56,7 +77,67 @@ double Scene::shoot_ray(const Ray& ray, SurfaceInteraction* isect) const
 		//	//std::cout << col[i].x << " " << col[i].y << " " << col[i].z << std::endl;
 		//}
 	}
-	return ray.tNearest;
+	return ray.tMax;
+}
+
+/*
+	Shoot all active rays of a packet and obtain their nearest intersection points.
+	After returning, the tMax of every ray holds its distance to the hit surface and
+	isects the corresponding intersection data.
+*/
+void Scene::shoot_packet(RayPacket& packet, SurfaceInteraction* isects, const TileCull* cull) const
+{
+	thread_ray_count += RayPacket::count(packet.active);
+
+	if (cull)
+	{
+		for (size_t i = 0; i < cull->count; ++i)
+		{
+			const auto& entry = cull->entries[i];
+			entry.shape->intersect_packet_culled(packet, packet.active, isects, entry.nodes);
+		}
+		return;
+	}
+
+	for (auto& objs : sc)
+	{
+		objs->intersect_packet(packet, packet.active, isects);
+	}
+}
+
+void Scene::update_lod(const glm::dvec3& eye, double pixel_angle)
+{
+	for (auto& objs : sc)
+	{
+		if (auto lod = dynamic_cast<LODMesh*>(objs.get()))
+		{
+			lod->select(eye, pixel_angle);
+			VLOG(1) << "LOD mesh: level " << lod->get_level() << " of " << lod->get_level_count();
+		}
+	}
+}
+
+void Scene::animate(size_t /*frame*/, size_t /*slot*/)
+{
+}
+
+void Scene::cull(const Frustum& frustum, TileCull& cull) const
+{
+	// the entries are reused from tile to tile to keep the node vectors allocated
+	cull.entries.resize(std::max(cull.entries.size(), sc.size()));
+	cull.count = 0;
+
+	for (auto& objs : sc)
+	{
+		auto& entry = cull.entries[cull.count];
+		entry.nodes.clear();
+
+		if (objs->cull(frustum, entry.nodes))
+		{
+			entry.shape = objs.get();
+			++cull.count;
+		}
+	}
 }
 
 GatheringScene::GatheringScene(size_t MAX_DEPTH) :
@@ -733,7 +814,7 @@ void TeapotScene::init()
 	// put triangle mesh into scene
 	for (auto& tm : tr_meshes)
 	{
-		sc.emplace_back(std::make_unique<TriangleMesh>(tm.tr_mesh));
+		sc.emplace_back(std::make_unique<LODMesh>(tm.tr_mesh));
 	}
 
 	/////////////////////////////////////
@@ -770,7 +851,7 @@ void TeapotScene::init()
 	// put triangle mesh into scene
 	for (auto& tm : tr_meshes)
 	{
-		sc.emplace_back(std::make_unique<TriangleMesh>(tm.tr_mesh));
+		sc.emplace_back(std::make_unique<LODMesh>(tm.tr_mesh));
 	}
 
 	/////////////////////////////////////
@@ -990,8 +1071,6 @@ void DragonScene::init()
 
 	for (const auto& dr_file : dragon_files)
 	{
-		auto tr_meshes = extractMeshes(dr_file);
-
 		std::shared_ptr<Material> dragon_mat =
 			std::shared_ptr<Material>(
 				new Material(glm::dvec3(0.0, 0.0, 0.0),
@@ -1001,6 +1080,23 @@ void DragonScene::init()
 		dragon_mat->setTransparent(glm::dvec3(1.0));
 		dragon_mat->setRefractiveIdx(1.5);
 
+#ifdef MAP_MESHES
+		// convert the mesh on the first run, later runs only map the converted file
+		std::string mesh_file = dr_file + ".rtmesh";
+
+		if (!std::ifstream(mesh_file).good() && !MappedMesh::convert_obj(dr_file, mesh_file, dr_to_world))
+		{
+			continue;
+		}
+
+		auto mapped = std::make_unique<MappedMesh>(mesh_file);
+		mapped->mat = dragon_mat;
+		sc.emplace_back(std::move(mapped));
+		continue;
+#endif
+
+		auto tr_meshes = extractMeshes(dr_file);
+
 		for (auto& tm : tr_meshes)
 		{
 			for (auto& tr : tm.tr_mesh)
@@ -1018,7 +1114,11 @@ void DragonScene::init()
 					dynamic_cast<Triangle*>(s.get())->bounding_box->centroid.z < 21.0f);
 				}),
 				tm.tr_mesh.end());*/
-			sc.emplace_back(std::make_unique<TriangleMesh>(tm.tr_mesh));
+#ifdef COMPRESS_MESHES
+			sc.emplace_back(std::make_unique<CompressedMesh>(tm.tr_mesh));
+#else
+			sc.emplace_back(std::make_unique<LODMesh>(tm.tr_mesh));
+#endif
 		}
 	}
 
@@ -1102,14 +1202,6 @@ void TetrahedronScene::init()
 		"../../resources/models/tetrahedron.obj"
 	};
 
-	glm::dmat4 th_to_world =
-		glm::rotate(
-			glm::scale(
-				//glm::dmat4(1.f),
-				glm::translate(glm::dmat4(1.0), glm::dvec3(0.5, 4.2, 20.0)),
-				glm::dvec3(5.0)),
-			glm::radians(150 + degree_step),
-			glm::dvec3(1.0, 1.0, 0.0));
 
 	// material for walls
 	auto wall_bot =
@@ -1176,11 +1268,11 @@ void TetrahedronScene::init()
 		//th_mat->setTransparent(glm::dvec3(1.0));
 		//th_mat->setRefractiveIdx(1.5);
 
+		// the triangles stay in object space, the instance moves them
 		for (auto& tm : tr_meshes)
 		{
 			for (auto& tr : tm.tr_mesh)
 			{
-				dynamic_cast<Triangle*>(tr.get())->set_objToWorld(th_to_world);
 				dynamic_cast<Triangle*>(tr.get())->set_material(th_mat);
 			}
 		}
@@ -1193,7 +1285,10 @@ void TetrahedronScene::init()
 					dynamic_cast<Triangle*>(s.get())->bounding_box->centroid.z < 21.0f);
 				}),
 				tm.tr_mesh.end());*/
-			sc.emplace_back(std::make_unique<TriangleMesh>(tm.tr_mesh));
+			auto tetrahedron = std::make_unique<Instance>(std::make_unique<TriangleMesh>(tm.tr_mesh),
+				tetrahedron_to_world(0));
+			tetrahedra.push_back(tetrahedron.get());
+			sc.emplace_back(std::move(tetrahedron));
 		}
 	}
 
@@ -1250,4 +1345,51 @@ void TetrahedronScene::init()
 	cam->update();
 }
 
+void TetrahedronScene::animate(size_t frame, size_t slot)
+{
+	for (Instance* tetrahedron : tetrahedra)
+	{
+		tetrahedron->set_transform(tetrahedron_to_world(frame), slot);
+	}
+}
+
+glm::dmat4 TetrahedronScene::tetrahedron_to_world(size_t frame) const
+{
+	return glm::rotate(
+		glm::scale(
+			glm::translate(glm::dmat4(1.0), glm::dvec3(0.5, 4.2, 20.0)),
+			glm::dvec3(5.0)),
+		glm::radians(150 + degree_step * (frame + 1)),
+		glm::dvec3(1.0, 1.0, 0.0));
+}
+
+std::unique_ptr<Scene> make_scene(const std::string& name)
+{
+	if (name == "gathering")
+	{
+		return std::make_unique<GatheringScene>();
+	}
+	else if (name == "mixed")
+	{
+		return std::make_unique<MixedScene>();
+	}
+	else if (name == "teapot")
+	{
+		return std::make_unique<TeapotScene>();
+	}
+	else if (name == "triangle")
+	{
+		return std::make_unique<SingleTriangleScene>();
+	}
+	else if (name == "dragon")
+	{
+		return std::make_unique<DragonScene>();
+	}
+	else if (name == "tetrahedron")
+	{
+		return std::make_unique<TetrahedronScene>(1);
+	}
+	return nullptr;
+}
+
 } // namespace rt
\ No newline at end of file
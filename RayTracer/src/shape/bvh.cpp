@@ -1,7 +1,12 @@
 #include "shape/bvh.h"
 #include "shape/shape.h"
 #include "shape/ray.h"
+#include "shape/frustum.h"
 #include "interaction/interaction.h"
+#include "threads/threadpool.h"
+#include "misc/stats.h"
+
+#include <algorithm>
 
 namespace rt
 {
@@ -29,6 +34,8 @@ BVH::BVH(const std::vector<std::shared_ptr<Shape>>& scene_objects,
 
 double BVH_Node::intersect(const Ray& ray, SurfaceInteraction* isect)
 {
+	++thread_node_visits;
+
 	if (!left_node && !right_node)
 	{
 		double t_min = INFINITY;
@@ -57,20 +64,119 @@ double BVH_Node::intersect(const Ray& ray, SurfaceInteraction* isect)
 	{
 		return INFINITY;
 	}
-	
-	//double t0_left = INFINITY;
-	//double t1_right = INFINITY;
+
+	// visit the nearer child first, the box of the farther one can then be culled
+	// against the narrowed ray interval
+	BVH_Node* near_node = left_node.get();
+	BVH_Node* far_node = right_node.get();
+
+	if (t1 < t0)
+	{
+		std::swap(near_node, far_node);
+		std::swap(t0, t1);
+	}
+
 	if (t0 < INFINITY)
 	{
-		t0= left_node->intersect(ray, isect);
+		t0 = near_node->intersect(ray, isect);
+	}
+	if (t1 <= ray.tMax)
+	{
+		t1 = far_node->intersect(ray, isect);
 	}
-	if (t1 < INFINITY)
+	else
 	{
-		t1= right_node->intersect(ray, isect);
+		t1 = INFINITY;
 	}
 	return std::min(t0, t1);
 }
 
+void BVH_Node::intersect(RayPacket& packet, PacketMask mask, SurfaceInteraction* isects)
+{
+	++thread_node_visits;
+
+	// the rays have diverged, trace the remaining ones on their own
+	if (RayPacket::count(mask) < RAY_PACKET_MIN_ACTIVE)
+	{
+		for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+		{
+			if (mask & RayPacket::lane_bit(i))
+			{
+				intersect(packet.rays[i], &isects[i]);
+			}
+		}
+		packet.update_t_max(mask);
+		return;
+	}
+
+	if (!left_node && !right_node)
+	{
+		for (const auto& object : shapes)
+		{
+			object->intersect_packet(packet, mask, isects);
+		}
+		return;
+	}
+
+	double t_left[RAY_PACKET_SIZE];
+	double t_right[RAY_PACKET_SIZE];
+	PacketMask m_left = 0;
+	PacketMask m_right = 0;
+
+	if (left_node)
+		m_left = left_node->box->intersect(packet, mask, t_left);
+
+	if (right_node)
+		m_right = right_node->box->intersect(packet, mask, t_right);
+
+	if (!m_left && !m_right)
+	{
+		return;
+	}
+
+	// the child which is entered first by the majority of the rays is visited first
+	int left_first = 0;
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+	{
+		if ((m_left & m_right) & RayPacket::lane_bit(i))
+		{
+			left_first += t_left[i] <= t_right[i] ? 1 : -1;
+		}
+	}
+
+	BVH_Node* near_node = left_node.get();
+	BVH_Node* far_node = right_node.get();
+	PacketMask m_near = m_left;
+	PacketMask m_far = m_right;
+	double* t_far = t_right;
+
+	if (left_first < 0)
+	{
+		std::swap(near_node, far_node);
+		std::swap(m_near, m_far);
+		t_far = t_left;
+	}
+
+	if (m_near)
+	{
+		near_node->intersect(packet, m_near, isects);
+	}
+
+	// cull the far child for rays that already found a nearer intersection
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+	{
+		if ((m_far & RayPacket::lane_bit(i)) && t_far[i] > packet.t_max[i])
+		{
+			m_far &= ~RayPacket::lane_bit(i);
+		}
+	}
+
+	if (m_far)
+	{
+		far_node->intersect(packet, m_far, isects);
+	}
+}
+
 double BVH_Tree::intersect(const Ray& ray, SurfaceInteraction* isect)
 {
 	double t_min = INFINITY;
@@ -80,6 +186,11 @@ double BVH_Tree::intersect(const Ray& ray, SurfaceInteraction* isect)
 	return t_min;
 }
 
+void BVH_Tree::intersect(RayPacket& packet, PacketMask mask, SurfaceInteraction* isects)
+{
+	bvh_node->intersect(packet, mask, isects);
+}
+
 // split order x, y then z, so n goes from 0 to 2
 bool BVH::build_bvh(BVH_Node* current_node, int depth)
 {
@@ -131,12 +242,30 @@ bool BVH::build_bvh(BVH_Node* current_node, int depth)
 	current_node->left_node->box->boundaries[1] = left_max_bound;
 	current_node->right_node->box->boundaries[0] = right_min_bound;
 	current_node->right_node->box->boundaries[1] = right_max_bound;
+	current_node->left_node->box->centroid = 0.5 * (left_min_bound + left_max_bound);
+	current_node->right_node->box->centroid = 0.5 * (right_min_bound + right_max_bound);
+
+	bool split_left = current_node->left_node->shapes.size() > MAX_TRIANGLE_COUNT;
+	bool split_right = current_node->right_node->shapes.size() > MAX_TRIANGLE_COUNT;
+	ThreadPool* pool = ThreadPool::current();
 
-	if (current_node->left_node->shapes.size() > MAX_TRIANGLE_COUNT)
+	// build big subtrees in parallel, the left one as a task and the right one on this thread
+	if (pool && split_left && split_right && current_node->shapes.size() >= PARALLEL_BUILD_SIZE)
+	{
+		TaskGroup group(*pool);
+		group.run([this, current_node, depth]() {
+			build_bvh(current_node->left_node.get(), depth + 1);
+		});
+		build_bvh(current_node->right_node.get(), depth + 1);
+		group.wait();
+		return true;
+	}
+
+	if (split_left)
 	{
 		build_bvh(current_node->left_node.get(),  depth+1);
 	} 
-	if (current_node->right_node->shapes.size() > MAX_TRIANGLE_COUNT)
+	if (split_right)
 	{
 		build_bvh(current_node->right_node.get(), depth+1);
 	}
@@ -155,4 +284,78 @@ double BVH::traverse_bvh(const Ray& ray, SurfaceInteraction *isect)
 	return this->bvh_tree.intersect(ray, isect);
 }
 
+void BVH::traverse_bvh(RayPacket& packet, PacketMask mask, SurfaceInteraction* isects)
+{
+	this->bvh_tree.intersect(packet, mask, isects);
+}
+
+void BVH::cull(const Frustum& frustum, std::vector<BVH_Node*>& nodes, int max_depth) const
+{
+	nodes.clear();
+	cull(bvh_tree.bvh_node.get(), frustum, nodes, max_depth);
+
+	std::sort(nodes.begin(), nodes.end(), [&frustum](const BVH_Node* a, const BVH_Node* b) {
+		return frustum.depth(a->box->centroid) < frustum.depth(b->box->centroid);
+	});
+}
+
+void BVH::cull(BVH_Node* node, const Frustum& frustum, std::vector<BVH_Node*>& nodes, int depth) const
+{
+	if (!node || node->shapes.empty())
+	{
+		return;
+	}
+
+	Frustum::Overlap overlap = frustum.classify(*node->box);
+
+	if (overlap == Frustum::Overlap::OUTSIDE)
+	{
+		return;
+	}
+
+	bool leaf = !node->left_node && !node->right_node;
+
+	if (overlap == Frustum::Overlap::INSIDE || leaf || depth == 0)
+	{
+		nodes.push_back(node);
+		return;
+	}
+
+	cull(node->left_node.get(), frustum, nodes, depth - 1);
+	cull(node->right_node.get(), frustum, nodes, depth - 1);
+}
+
+double BVH::traverse_bvh(const Ray& ray, SurfaceInteraction* isect, const std::vector<BVH_Node*>& nodes)
+{
+	double t_min = INFINITY;
+
+	for (BVH_Node* node : nodes)
+	{
+		// the box test clips against the interval narrowed by the nearer subtrees
+		if (node->box->intersect(ray) < INFINITY)
+		{
+			t_min = std::min(t_min, node->intersect(ray, isect));
+		}
+	}
+	return t_min;
+}
+
+void BVH::traverse_bvh(RayPacket& packet,
+	PacketMask mask,
+	SurfaceInteraction* isects,
+	const std::vector<BVH_Node*>& nodes)
+{
+	double t_entry[RAY_PACKET_SIZE];
+
+	for (BVH_Node* node : nodes)
+	{
+		PacketMask m = node->box->intersect(packet, mask, t_entry);
+
+		if (m)
+		{
+			node->intersect(packet, m, isects);
+		}
+	}
+}
+
 } //namespace rt
\ No newline at end of file
@@ -0,0 +1,485 @@
+#include <algorithm>
+#include <map>
+
+#include "shape/compressedmesh.h"
+#include "interaction/interaction.h"
+#include "misc/stats.h"
+
+namespace rt
+{
+
+namespace
+{
+constexpr int MAX_BUILD_DEPTH = 60;
+
+double sign_not_zero(double v)
+{
+	return v >= 0.0 ? 1.0 : -1.0;
+}
+
+uint16_t to_snorm16(double v)
+{
+	return static_cast<uint16_t>(static_cast<int16_t>(std::round(std::min(std::max(v, -1.0), 1.0) * 32767.0)));
+}
+
+double from_snorm16(uint16_t v)
+{
+	return std::max(static_cast<int16_t>(v) / 32767.0, -1.0);
+}
+
+// round outwards, so that the single precision box still contains the triangles
+float round_down(double v)
+{
+	float f = static_cast<float>(v);
+	return f > v ? std::nextafter(f, -INFINITY) : f;
+}
+
+float round_up(double v)
+{
+	float f = static_cast<float>(v);
+	return f < v ? std::nextafter(f, INFINITY) : f;
+}
+} // namespace
+
+OctNormal CompressedMesh::encode_normal(const glm::dvec3& n)
+{
+	double l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+
+	if (l1 == 0)
+	{
+		return 0;
+	}
+
+	// project onto the octahedron and fold the lower half over the upper one
+	double x = n.x / l1;
+	double y = n.y / l1;
+
+	if (n.z < 0)
+	{
+		double fx = (1.0 - std::abs(y)) * sign_not_zero(x);
+		double fy = (1.0 - std::abs(x)) * sign_not_zero(y);
+		x = fx;
+		y = fy;
+	}
+	return OctNormal(to_snorm16(x)) | (OctNormal(to_snorm16(y)) << 16);
+}
+
+glm::dvec3 CompressedMesh::decode_normal(OctNormal n)
+{
+	double x = from_snorm16(static_cast<uint16_t>(n & 0xffff));
+	double y = from_snorm16(static_cast<uint16_t>(n >> 16));
+	double z = 1.0 - std::abs(x) - std::abs(y);
+
+	if (z < 0)
+	{
+		double fx = (1.0 - std::abs(y)) * sign_not_zero(x);
+		double fy = (1.0 - std::abs(x)) * sign_not_zero(y);
+		x = fx;
+		y = fy;
+	}
+	return glm::normalize(glm::dvec3(x, y, z));
+}
+
+void CompressedMeshData::set_bounds(const glm::dvec3& b_min, const glm::dvec3& b_max)
+{
+	origin = b_min;
+	scale = (b_max - b_min) / static_cast<double>((1 << POSITION_BITS) - 1);
+}
+
+QuantizedPosition CompressedMeshData::encode_position(const glm::dvec3& p) const
+{
+	constexpr double max_value = static_cast<double>((1 << POSITION_BITS) - 1);
+	QuantizedPosition q = 0;
+
+	for (int k = 0; k < 3; ++k)
+	{
+		double v = scale[k] > 0 ? std::round((p[k] - origin[k]) / scale[k]) : 0.0;
+		q |= static_cast<QuantizedPosition>(std::min(std::max(v, 0.0), max_value)) << (k * POSITION_BITS);
+	}
+	return q;
+}
+
+CompressedMeshView CompressedMeshData::view() const
+{
+	CompressedMeshView v;
+	v.origin = origin;
+	v.scale = scale;
+	v.positions = positions.data();
+	v.normals = normals.data();
+	v.indices = indices.data();
+	v.nodes = nodes.data();
+	v.num_vertices = positions.size();
+	v.num_triangles = indices.size() / 3;
+	v.num_nodes = nodes.size();
+	return v;
+}
+
+namespace
+{
+struct BuildNode
+{
+	glm::dvec3 b_min;
+	glm::dvec3 b_max;
+	size_t first;
+	size_t count;
+	// children, 0 for leaves (the root is never a child)
+	size_t left = 0;
+	size_t right = 0;
+};
+
+class BVHBuilder
+{
+public:
+	BVHBuilder(const CompressedMeshView& mesh, size_t max_triangle_count) :
+		mesh(mesh), MAX_TRIANGLE_COUNT(max_triangle_count), tris(mesh.num_triangles), centroids(mesh.num_triangles)
+	{
+		for (uint32_t i = 0; i < tris.size(); ++i)
+		{
+			tris[i] = i;
+			centroids[i] = (mesh.decode_position(mesh.indices[3 * i]) + mesh.decode_position(mesh.indices[3 * i + 1]) +
+				mesh.decode_position(mesh.indices[3 * i + 2])) / 3.0;
+		}
+	}
+
+	size_t build(size_t first, size_t last, int depth)
+	{
+		size_t node_idx = nodes.size();
+		nodes.emplace_back();
+
+		glm::dvec3 b_min(INFINITY);
+		glm::dvec3 b_max(-INFINITY);
+		glm::dvec3 c_min(INFINITY);
+		glm::dvec3 c_max(-INFINITY);
+
+		for (size_t i = first; i < last; ++i)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				glm::dvec3 p = mesh.decode_position(mesh.indices[3 * tris[i] + k]);
+				b_min = glm::min(b_min, p);
+				b_max = glm::max(b_max, p);
+			}
+			c_min = glm::min(c_min, centroids[tris[i]]);
+			c_max = glm::max(c_max, centroids[tris[i]]);
+		}
+
+		nodes[node_idx].b_min = b_min;
+		nodes[node_idx].b_max = b_max;
+		nodes[node_idx].first = first;
+		nodes[node_idx].count = last - first;
+
+		if (last - first <= MAX_TRIANGLE_COUNT || depth >= MAX_BUILD_DEPTH)
+		{
+			return node_idx;
+		}
+
+		// split in the middle of the longest axis of the centroid bounds
+		glm::dvec3 extent = c_max - c_min;
+		int n = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		double m = 0.5 * (c_min[n] + c_max[n]);
+
+		auto mid_it = std::partition(tris.begin() + first, tris.begin() + last, [&](uint32_t t) {
+			return centroids[t][n] < m;
+		});
+		size_t mid = mid_it - tris.begin();
+
+		// all centroids on one side, split by count instead
+		if (mid == first || mid == last)
+		{
+			mid = (first + last) / 2;
+			std::nth_element(tris.begin() + first, tris.begin() + mid, tris.begin() + last, [&](uint32_t a, uint32_t b) {
+				return centroids[a][n] < centroids[b][n];
+			});
+		}
+
+		size_t left = build(first, mid, depth + 1);
+		size_t right = build(mid, last, depth + 1);
+		nodes[node_idx].left = left;
+		nodes[node_idx].right = right;
+		return node_idx;
+	}
+
+	CompressedMeshView mesh;
+	size_t MAX_TRIANGLE_COUNT;
+	std::vector<uint32_t> tris;
+	std::vector<glm::dvec3> centroids;
+	std::vector<BuildNode> nodes;
+};
+
+CompressedNode make_node(const BuildNode& b)
+{
+	CompressedNode node;
+
+	for (int k = 0; k < 3; ++k)
+	{
+		node.bounds[0][k] = round_down(b.b_min[k]);
+		node.bounds[1][k] = round_up(b.b_max[k]);
+	}
+	node.offset = static_cast<uint32_t>(b.first);
+	node.count = static_cast<uint32_t>(b.count);
+	return node;
+}
+} // namespace
+
+void CompressedMeshData::build_bvh(size_t max_triangle_count, size_t nodes_per_page)
+{
+	nodes.clear();
+
+	if (indices.empty())
+	{
+		return;
+	}
+
+	BVHBuilder builder(view(), max_triangle_count);
+	builder.build(0, builder.tris.size(), 0);
+
+	// lay the nodes out as treelets: starting from a treelet root, the tree is expanded
+	// breadth first as long as the children fit into the page the treelet started in.
+	// The nodes left unexpanded become the roots of the following treelets
+	std::vector<std::pair<size_t, size_t>> treelet_roots;
+	std::vector<std::pair<size_t, size_t>> queue;
+
+	nodes.push_back(make_node(builder.nodes[0]));
+	treelet_roots.push_back({ 0, 0 });
+
+	while (!treelet_roots.empty())
+	{
+		auto root = treelet_roots.back();
+		treelet_roots.pop_back();
+
+		size_t page = nodes.size() / nodes_per_page;
+		queue.clear();
+		queue.push_back(root);
+
+		for (size_t q = 0; q < queue.size(); ++q)
+		{
+			size_t b = queue[q].first;
+			size_t o = queue[q].second;
+			const BuildNode& build_node = builder.nodes[b];
+
+			if (build_node.left == 0)
+			{
+				continue;
+			}
+
+			// the treelet root always gets expanded, so that every treelet makes progress
+			if (q > 0 && (nodes.size() + 1) / nodes_per_page != page)
+			{
+				treelet_roots.push_back(queue[q]);
+				continue;
+			}
+
+			size_t child = nodes.size();
+			nodes[o].offset = static_cast<uint32_t>(child);
+			nodes[o].count = 0;
+
+			nodes.push_back(make_node(builder.nodes[build_node.left]));
+			nodes.push_back(make_node(builder.nodes[build_node.right]));
+			queue.push_back({ build_node.left, child });
+			queue.push_back({ build_node.right, child + 1 });
+		}
+	}
+
+	// sort the triangles by the leaves and the vertices by their first use, so that
+	// the data of a subtree stays close together
+	std::vector<uint32_t> sorted_indices(indices.size());
+	std::vector<uint32_t> vertex_map(positions.size(), UINT32_MAX);
+	std::vector<QuantizedPosition> sorted_positions;
+	std::vector<OctNormal> sorted_normals;
+
+	sorted_positions.reserve(positions.size());
+	sorted_normals.reserve(normals.size());
+
+	for (size_t i = 0; i < builder.tris.size(); ++i)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			uint32_t v = indices[3 * builder.tris[i] + k];
+
+			if (vertex_map[v] == UINT32_MAX)
+			{
+				vertex_map[v] = static_cast<uint32_t>(sorted_positions.size());
+				sorted_positions.push_back(positions[v]);
+				sorted_normals.push_back(normals[v]);
+			}
+			sorted_indices[3 * i + k] = vertex_map[v];
+		}
+	}
+
+	indices.swap(sorted_indices);
+	positions.swap(sorted_positions);
+	normals.swap(sorted_normals);
+}
+
+CompressedMesh::CompressedMesh(const std::vector<std::shared_ptr<Shape>>& triangles, size_t max_triangle_count)
+{
+	glm::dvec3 b_min(INFINITY);
+	glm::dvec3 b_max(-INFINITY);
+
+	for (const auto& s : triangles)
+	{
+		b_min = glm::min(b_min, s->bounding_box->boundaries[0]);
+		b_max = glm::max(b_max, s->bounding_box->boundaries[1]);
+	}
+
+	data.set_bounds(b_min, b_max);
+
+	// share vertices with the same quantized position and normal
+	std::map<std::pair<QuantizedPosition, OctNormal>, uint32_t> welded;
+
+	for (const auto& s : triangles)
+	{
+		const Triangle* tr = dynamic_cast<const Triangle*>(s.get());
+
+		if (!tr)
+		{
+			continue;
+		}
+
+		if (!mat)
+		{
+			mat = tr->mat;
+		}
+
+		for (int k = 0; k < 3; ++k)
+		{
+			auto key = std::make_pair(data.encode_position(tr->get_vertex(k)), encode_normal(tr->get_vertex_normal(k)));
+			auto it = welded.emplace(key, static_cast<uint32_t>(data.positions.size()));
+
+			if (it.second)
+			{
+				data.positions.push_back(key.first);
+				data.normals.push_back(key.second);
+			}
+			data.indices.push_back(it.first->second);
+		}
+	}
+
+	bounding_box = std::make_unique<Bounds3>(b_min, b_max);
+
+	data.build_bvh(max_triangle_count, NODES_PER_PAGE);
+	mesh = data.view();
+
+	size_t uncompressed = triangles.size() * (sizeof(Triangle) + sizeof(Bounds3));
+	LOG(INFO) << "Compressed mesh: " << triangle_count() << " triangles, " << mesh.num_vertices <<
+		" vertices, " << memory_usage() / 1024 << " kB instead of about " << uncompressed / 1024 << " kB";
+}
+
+double CompressedMesh::intersect(const CompressedNode& node, const Ray& ray) const
+{
+	double t0 = ray.tMin;
+	double t1 = ray.tMax;
+
+	for (int k = 0; k < 3; ++k)
+	{
+		double t_near = (node.bounds[ray.sign[k]][k] - ray.ro[k]) * ray.inv_rd[k];
+		double t_far = (node.bounds[1 - ray.sign[k]][k] - ray.ro[k]) * ray.inv_rd[k];
+
+		t0 = t_near > t0 ? t_near : t0;
+		t1 = t_far < t1 ? t_far : t1;
+	}
+	return t0 <= t1 ? t0 : INFINITY;
+}
+
+double CompressedMesh::intersect(const Ray& ray, SurfaceInteraction* isect)
+{
+	if (mesh.num_nodes == 0)
+	{
+		return INFINITY;
+	}
+
+	struct Entry
+	{
+		uint32_t node;
+		double t;
+	};
+
+	Entry stack[2 * MAX_BUILD_DEPTH + 2];
+	int top = 0;
+
+	double t_hit = INFINITY;
+	size_t hit_tri = 0;
+	glm::dvec3 hit_b;
+
+	double t_root = intersect(mesh.nodes[0], ray);
+	if (t_root < INFINITY)
+	{
+		stack[top++] = { 0, t_root };
+	}
+
+	while (top > 0)
+	{
+		Entry e = stack[--top];
+
+		// a nearer hit has been found since the node was pushed
+		if (e.t > ray.tMax)
+		{
+			continue;
+		}
+
+		const CompressedNode& node = mesh.nodes[e.node];
+		++thread_node_visits;
+
+		if (node.count > 0)
+		{
+			for (size_t i = node.offset; i < node.offset + node.count; ++i)
+			{
+				glm::dvec3 b;
+				double t = intersect_triangle(ray,
+					mesh.decode_position(mesh.indices[3 * i]),
+					mesh.decode_position(mesh.indices[3 * i + 1]),
+					mesh.decode_position(mesh.indices[3 * i + 2]),
+					&b);
+
+				if (t < INFINITY)
+				{
+					ray.tMax = t;
+					t_hit = t;
+					hit_tri = i;
+					hit_b = b;
+				}
+			}
+			continue;
+		}
+
+		uint32_t left = node.offset;
+		uint32_t right = node.offset + 1;
+		double t_left = intersect(mesh.nodes[left], ray);
+		double t_right = intersect(mesh.nodes[right], ray);
+
+		// push the farther child first, so that the nearer one is visited next
+		if (t_left > t_right)
+		{
+			std::swap(left, right);
+			std::swap(t_left, t_right);
+		}
+		if (t_right < INFINITY)
+		{
+			stack[top++] = { right, t_right };
+		}
+		if (t_left < INFINITY)
+		{
+			stack[top++] = { left, t_left };
+		}
+	}
+
+	if (t_hit < INFINITY)
+	{
+		isect->p = ray.ro + t_hit * ray.rd;
+		isect->normal = glm::normalize(hit_b.x * decode_normal(mesh.normals[mesh.indices[3 * hit_tri]]) +
+			hit_b.y * decode_normal(mesh.normals[mesh.indices[3 * hit_tri + 1]]) +
+			hit_b.z * decode_normal(mesh.normals[mesh.indices[3 * hit_tri + 2]]));
+		isect->mat = mat;
+	}
+	return t_hit;
+}
+
+size_t CompressedMesh::memory_usage() const
+{
+	return mesh.num_vertices * sizeof(QuantizedPosition) +
+		mesh.num_vertices * sizeof(OctNormal) +
+		mesh.num_triangles * 3 * sizeof(uint32_t) +
+		mesh.num_nodes * sizeof(CompressedNode);
+}
+
+} // namespace rt
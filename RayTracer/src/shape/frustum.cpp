@@ -0,0 +1,60 @@
+#include "shape/frustum.h"
+#include "shape/shape.h"
+
+namespace rt
+{
+Frustum::Frustum(const Ray corners[4], const Ray& center) :
+	center(center)
+{
+	glm::dvec3 inside = center.ro + center.rd;
+
+	for (int i = 0; i < 4; ++i)
+	{
+		const Ray& a = corners[i];
+		const Ray& b = corners[(i + 1) % 4];
+
+		// the plane contains the corner ray a and the point b.ro + b.rd, this works for
+		// rays with a common origin as well as for parallel rays of an orthographic camera
+		glm::dvec3 n = glm::normalize(glm::cross(a.rd, b.ro + b.rd - a.ro));
+		double d = -glm::dot(n, a.ro);
+
+		if (glm::dot(n, inside) + d < 0)
+		{
+			n = -n;
+			d = -d;
+		}
+		normals[i] = n;
+		offsets[i] = d;
+	}
+}
+
+Frustum::Overlap Frustum::classify(const Bounds3& box) const
+{
+	Overlap result = Overlap::INSIDE;
+
+	for (int i = 0; i < 4; ++i)
+	{
+		// corners of the box farthest inside and farthest outside along the plane normal
+		glm::dvec3 p_vertex;
+		glm::dvec3 n_vertex;
+
+		for (int k = 0; k < 3; ++k)
+		{
+			bool positive = normals[i][k] >= 0;
+			p_vertex[k] = box.boundaries[positive ? 1 : 0][k];
+			n_vertex[k] = box.boundaries[positive ? 0 : 1][k];
+		}
+
+		if (glm::dot(normals[i], p_vertex) + offsets[i] < 0)
+		{
+			return Overlap::OUTSIDE;
+		}
+		if (glm::dot(normals[i], n_vertex) + offsets[i] < 0)
+		{
+			result = Overlap::INTERSECTING;
+		}
+	}
+	return result;
+}
+
+} // namespace rt
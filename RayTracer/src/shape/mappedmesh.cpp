@@ -0,0 +1,354 @@
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "shape/mappedmesh.h"
+
+namespace rt
+{
+
+namespace
+{
+constexpr char MESH_MAGIC[8] = { 'R', 'T', 'M', 'E', 'S', 'H', '\0', '\0' };
+constexpr uint32_t MESH_VERSION = 1;
+
+struct MeshFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t position_bits;
+	double origin[3];
+	double scale[3];
+	uint64_t num_vertices;
+	uint64_t num_triangles;
+	uint64_t num_nodes;
+	// byte offsets of the sections from the start of the file
+	uint64_t nodes_offset;
+	uint64_t indices_offset;
+	uint64_t positions_offset;
+	uint64_t normals_offset;
+};
+
+static_assert(sizeof(MeshFileHeader) <= MappedMesh::PAGE_SIZE, "mesh file header exceeds a page");
+
+uint64_t align_to_page(uint64_t offset)
+{
+	return (offset + MappedMesh::PAGE_SIZE - 1) / MappedMesh::PAGE_SIZE * MappedMesh::PAGE_SIZE;
+}
+
+void write_section(std::ofstream& ofs, uint64_t offset, const void* data, size_t bytes)
+{
+	ofs.seekp(static_cast<std::streamoff>(offset));
+	ofs.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+}
+
+// parse the vertex index of an .obj face element like "7", "7/2" or "7/2/5"
+int64_t parse_obj_index(const std::string& element, size_t vertex_count)
+{
+	int64_t idx = std::stoll(element.substr(0, element.find('/')));
+
+	// negative indices count backwards from the last vertex
+	return idx < 0 ? static_cast<int64_t>(vertex_count) + idx : idx - 1;
+}
+} // namespace
+
+bool MappedMesh::write(const std::string& file, const CompressedMeshData& data)
+{
+	std::ofstream ofs{ file, std::ios::binary | std::ios::trunc };
+
+	if (!ofs.is_open())
+	{
+		LOG(ERROR) << "Could not open mesh file " << file << " for writing";
+		return false;
+	}
+
+	MeshFileHeader header{};
+	std::memcpy(header.magic, MESH_MAGIC, sizeof(MESH_MAGIC));
+	header.version = MESH_VERSION;
+	header.position_bits = POSITION_BITS;
+	for (int k = 0; k < 3; ++k)
+	{
+		header.origin[k] = data.origin[k];
+		header.scale[k] = data.scale[k];
+	}
+	header.num_vertices = data.positions.size();
+	header.num_triangles = data.indices.size() / 3;
+	header.num_nodes = data.nodes.size();
+
+	header.nodes_offset = PAGE_SIZE;
+	header.indices_offset = align_to_page(header.nodes_offset + data.nodes.size() * sizeof(CompressedNode));
+	header.positions_offset = align_to_page(header.indices_offset + data.indices.size() * sizeof(uint32_t));
+	header.normals_offset = align_to_page(header.positions_offset + data.positions.size() * sizeof(QuantizedPosition));
+	uint64_t file_size = align_to_page(header.normals_offset + data.normals.size() * sizeof(OctNormal));
+
+	write_section(ofs, 0, &header, sizeof(header));
+	write_section(ofs, header.nodes_offset, data.nodes.data(), data.nodes.size() * sizeof(CompressedNode));
+	write_section(ofs, header.indices_offset, data.indices.data(), data.indices.size() * sizeof(uint32_t));
+	write_section(ofs, header.positions_offset, data.positions.data(), data.positions.size() * sizeof(QuantizedPosition));
+	write_section(ofs, header.normals_offset, data.normals.data(), data.normals.size() * sizeof(OctNormal));
+
+	// pad the last section to a full page
+	ofs.seekp(static_cast<std::streamoff>(file_size - 1));
+	ofs.put('\0');
+
+	return ofs.good();
+}
+
+bool MappedMesh::convert_obj(const std::string& obj_file,
+	const std::string& mesh_file,
+	const glm::dmat4& obj_to_world,
+	size_t max_triangle_count)
+{
+	std::ifstream ifs{ obj_file };
+
+	if (!ifs.is_open())
+	{
+		LOG(ERROR) << "Could not open " << obj_file;
+		return false;
+	}
+
+	std::istringstream iss;
+	std::string line;
+	std::string type;
+	glm::dvec3 p;
+	glm::dvec3 b_min(INFINITY);
+	glm::dvec3 b_max(-INFINITY);
+
+	// first pass: bounds of the transformed vertices for the quantization grid
+	while (std::getline(ifs, line))
+	{
+		iss.str(line);
+		iss.clear();
+
+		if (iss >> type && type == "v" && iss >> p.x >> p.y >> p.z)
+		{
+			p = glm::dvec3(obj_to_world * glm::dvec4(p, 1.0));
+			b_min = glm::min(b_min, p);
+			b_max = glm::max(b_max, p);
+		}
+	}
+
+	CompressedMeshData data;
+	data.set_bounds(b_min, b_max);
+
+	// second pass: quantized vertices and faces, fans for polygons
+	ifs.clear();
+	ifs.seekg(0);
+
+	std::string element;
+	std::vector<int64_t> polygon;
+
+	while (std::getline(ifs, line))
+	{
+		iss.str(line);
+		iss.clear();
+
+		if (!(iss >> type))
+		{
+			continue;
+		}
+
+		if (type == "v" && iss >> p.x >> p.y >> p.z)
+		{
+			data.positions.push_back(data.encode_position(glm::dvec3(obj_to_world * glm::dvec4(p, 1.0))));
+		}
+		else if (type == "f")
+		{
+			polygon.clear();
+			while (iss >> element)
+			{
+				polygon.push_back(parse_obj_index(element, data.positions.size()));
+			}
+
+			for (size_t i = 2; i < polygon.size(); ++i)
+			{
+				for (int64_t v : { polygon[0], polygon[i - 1], polygon[i] })
+				{
+					if (v < 0 || v >= static_cast<int64_t>(data.positions.size()))
+					{
+						LOG(ERROR) << "Invalid vertex index in " << obj_file << ": " << line;
+						return false;
+					}
+					data.indices.push_back(static_cast<uint32_t>(v));
+				}
+			}
+		}
+	}
+
+	// smooth shading normals, single precision is enough for the accumulation
+	std::vector<glm::vec3> normal_sums(data.positions.size(), glm::vec3(0.f));
+	CompressedMeshView view = data.view();
+
+	for (size_t i = 0; i < data.indices.size(); i += 3)
+	{
+		glm::dvec3 p0 = view.decode_position(data.indices[i]);
+		glm::dvec3 n = glm::cross(view.decode_position(data.indices[i + 1]) - p0,
+			view.decode_position(data.indices[i + 2]) - p0);
+
+		for (int k = 0; k < 3; ++k)
+		{
+			normal_sums[data.indices[i + k]] += glm::vec3(n);
+		}
+	}
+
+	data.normals.reserve(normal_sums.size());
+	for (const auto& n : normal_sums)
+	{
+		data.normals.push_back(CompressedMesh::encode_normal(glm::dvec3(n)));
+	}
+	normal_sums.clear();
+	normal_sums.shrink_to_fit();
+
+	data.build_bvh(max_triangle_count, NODES_PER_PAGE);
+
+	LOG(INFO) << "Converted " << obj_file << ": " << data.indices.size() / 3 << " triangles, " <<
+		data.positions.size() << " vertices";
+
+	return write(mesh_file, data);
+}
+
+MappedMesh::MappedMesh(const std::string& file)
+{
+#if defined(_WIN32)
+	file_handle = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_FLAG_RANDOM_ACCESS, nullptr);
+	LARGE_INTEGER size;
+
+	if (file_handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_handle, &size))
+	{
+		LOG(ERROR) << "Could not open mesh file " << file;
+		return;
+	}
+	length = static_cast<size_t>(size.QuadPart);
+
+	mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping_handle)
+	{
+		base = MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+	}
+#else
+	fd = open(file.c_str(), O_RDONLY);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		LOG(ERROR) << "Could not open mesh file " << file;
+		return;
+	}
+	length = static_cast<size_t>(st.st_size);
+
+	base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+	{
+		base = nullptr;
+	}
+	else
+	{
+		// the BVH treelets make each page self-contained, read-ahead of the neighboring
+		// pages would mostly load data that is not needed
+		madvise(base, length, MADV_RANDOM);
+	}
+#endif
+
+	if (!base)
+	{
+		LOG(ERROR) << "Could not map mesh file " << file;
+		return;
+	}
+
+	const char* bytes = static_cast<const char*>(base);
+	MeshFileHeader header;
+
+	if (length < PAGE_SIZE)
+	{
+		LOG(ERROR) << "Mesh file " << file << " is truncated";
+		return;
+	}
+	std::memcpy(&header, bytes, sizeof(header));
+
+	if (std::memcmp(header.magic, MESH_MAGIC, sizeof(MESH_MAGIC)) != 0 ||
+		header.version != MESH_VERSION ||
+		header.position_bits != POSITION_BITS ||
+		header.normals_offset + header.num_vertices * sizeof(OctNormal) > length ||
+		header.positions_offset + header.num_vertices * sizeof(QuantizedPosition) > length ||
+		header.indices_offset + header.num_triangles * 3 * sizeof(uint32_t) > length ||
+		header.nodes_offset + header.num_nodes * sizeof(CompressedNode) > length)
+	{
+		LOG(ERROR) << "Mesh file " << file << " has an invalid header";
+		return;
+	}
+
+	mesh.origin = glm::dvec3(header.origin[0], header.origin[1], header.origin[2]);
+	mesh.scale = glm::dvec3(header.scale[0], header.scale[1], header.scale[2]);
+	mesh.nodes = reinterpret_cast<const CompressedNode*>(bytes + header.nodes_offset);
+	mesh.indices = reinterpret_cast<const uint32_t*>(bytes + header.indices_offset);
+	mesh.positions = reinterpret_cast<const QuantizedPosition*>(bytes + header.positions_offset);
+	mesh.normals = reinterpret_cast<const OctNormal*>(bytes + header.normals_offset);
+	mesh.num_vertices = header.num_vertices;
+	mesh.num_triangles = header.num_triangles;
+	mesh.num_nodes = header.num_nodes;
+
+	if (mesh.num_nodes > 0)
+	{
+		const CompressedNode& root = mesh.nodes[0];
+		bounding_box = std::make_unique<Bounds3>(
+			glm::dvec3(root.bounds[0][0], root.bounds[0][1], root.bounds[0][2]),
+			glm::dvec3(root.bounds[1][0], root.bounds[1][1], root.bounds[1][2]));
+	}
+
+	LOG(INFO) << "Mapped mesh file " << file << ": " << mesh.num_triangles << " triangles, " <<
+		length / (1024 * 1024) << " MB";
+}
+
+MappedMesh::~MappedMesh()
+{
+#if defined(_WIN32)
+	if (base)
+		UnmapViewOfFile(base);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle != INVALID_HANDLE_VALUE)
+		CloseHandle(file_handle);
+#else
+	if (base)
+		munmap(base, length);
+	if (fd >= 0)
+		close(fd);
+#endif
+}
+
+double MappedMesh::residency() const
+{
+#if defined(_WIN32)
+	return -1.0;
+#else
+	if (!base)
+	{
+		return -1.0;
+	}
+
+	size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t pages = (length + page_size - 1) / page_size;
+	std::vector<unsigned char> resident(pages);
+
+	if (mincore(base, length, resident.data()) != 0)
+	{
+		return -1.0;
+	}
+
+	size_t count = 0;
+	for (unsigned char r : resident)
+	{
+		count += r & 1;
+	}
+	return static_cast<double>(count) / pages;
+#endif
+}
+
+} // namespace rt
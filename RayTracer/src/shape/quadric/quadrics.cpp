@@ -4,7 +4,11 @@ namespace rt
 {
 
 // TODO: implement function for solving a quadratic equation
-bool Quadric::solveQuadraticEq(double* t, double a, double b, double c)
+/*
+	Solve a*t^2 + b*t + c = 0 and store the smallest root that is not smaller than
+	t_min in t. Returns false, if there is no such root.
+*/
+bool Quadric::solveQuadraticEq(double* t, double a, double b, double c, double t_min)
 {
 	double disc = sqrt(b * b - 4 * a * c);
 
@@ -37,7 +41,7 @@ bool Quadric::solveQuadraticEq(double* t, double a, double b, double c)
 	{
 		std::swap(t0, t1);
 	}
-	*t = t1 < 0.0 ? INFINITY : (t0 < 0.0 ? t1 : t0);
+	*t = t1 < t_min ? INFINITY : (t0 < t_min ? t1 : t0);
 	return *t < INFINITY;
 }
 
@@ -65,15 +69,17 @@ double Sphere::intersect(const Ray& ray, SurfaceInteraction* isect)
 	tmp = tmp >= 0 ? tmp : fmax(t1, t2);
 	tmp = tmp >= 0 ? tmp : INFINITY;
 	*/
-	if (Quadric::solveQuadraticEq(&tmp, term_1, term_2, term_3))
+	if (Quadric::solveQuadraticEq(&tmp, term_1, term_2, term_3, ray.tMin))
 	{
-		if (tmp < ray.tNearest)
+		if (tmp > ray.tMax)
 		{
-			ray.tNearest = tmp;
-			isect->p = ray.ro + ray.rd * tmp;
-			isect->normal = get_normal(isect->p);
-			isect->mat = mat;
+			return INFINITY;
 		}
+
+		ray.tMax = tmp;
+		isect->p = ray.ro + ray.rd * tmp;
+		isect->normal = get_normal(isect->p);
+		isect->mat = mat;
 	}
 	return tmp;
 }
@@ -104,12 +110,12 @@ double Cylinder::intersect(const Ray& ray, SurfaceInteraction* isect)
 	x2 = (-b - discr) / a * 0.5f;
 
 	// get intersection points
-	if (x1 > 0)
+	if (ray.in_range(x1))
 	{
 		isect_p1 = transformed_ray.ro + x1 * transformed_ray.rd;
 	}
 
-	if (x2 > 0)
+	if (ray.in_range(x2))
 	{
 		isect_p2 = transformed_ray.ro + x2 * transformed_ray.rd;
 	}
@@ -135,9 +141,9 @@ double Cylinder::intersect(const Ray& ray, SurfaceInteraction* isect)
 
 	tmp2 = std::min(tmp1, tmp2);
 
-	if (tmp2 < ray.tNearest)
+	if (tmp2 < INFINITY)
 	{
-		ray.tNearest = tmp2;
+		ray.tMax = tmp2;
 		isect->p = ray.ro + ray.rd * tmp2;
 		isect->normal = get_normal(transformed_ray.ro + tmp2 * transformed_ray.rd, surf_hit);
 		isect->mat = mat;
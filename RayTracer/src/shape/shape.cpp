@@ -1,8 +1,76 @@
 #include "shape/shape.h"
 #include "shape/bvh.h"
+#include "shape/frustum.h"
+#include "shape/simplify.h"
 
 namespace rt
 {
+void Shape::intersect_packet(RayPacket& packet, PacketMask mask, SurfaceInteraction* isects)
+{
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+	{
+		if (mask & RayPacket::lane_bit(i))
+		{
+			intersect(packet.rays[i], &isects[i]);
+		}
+	}
+	packet.update_t_max(mask);
+}
+
+bool Shape::cull(const Frustum& frustum, std::vector<BVH_Node*>& /*nodes*/) const
+{
+	return !bounding_box || frustum.classify(*bounding_box) != Frustum::Overlap::OUTSIDE;
+}
+
+double Shape::intersect_culled(const Ray& ray, SurfaceInteraction* isect, const std::vector<BVH_Node*>& /*nodes*/)
+{
+	return intersect(ray, isect);
+}
+
+void Shape::intersect_packet_culled(RayPacket& packet,
+	PacketMask mask,
+	SurfaceInteraction* isects,
+	const std::vector<BVH_Node*>& /*nodes*/)
+{
+	intersect_packet(packet, mask, isects);
+}
+
+PacketMask Bounds3::intersect(const RayPacket& packet, PacketMask mask, double* t_entry) const
+{
+	alignas(64) double t0[RAY_PACKET_SIZE];
+	alignas(64) double t1[RAY_PACKET_SIZE];
+
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+	{
+		t0[i] = packet.t_min[i];
+		t1[i] = packet.t_max[i];
+	}
+
+	// the near and far slab are selected by the direction sign like in the single ray
+	// test, so that NaNs of rays on a slab plane are ignored the same way. The selects
+	// compile to blends, the lane loop stays free of branches
+	for (int k = 0; k < 3; ++k)
+	{
+		for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+		{
+			bool negative = packet.inv_rd[k][i] < 0;
+			double t_near = ((negative ? boundaries[1][k] : boundaries[0][k]) - packet.ro[k][i]) * packet.inv_rd[k][i];
+			double t_far = ((negative ? boundaries[0][k] : boundaries[1][k]) - packet.ro[k][i]) * packet.inv_rd[k][i];
+
+			t0[i] = t_near > t0[i] ? t_near : t0[i];
+			t1[i] = t_far < t1[i] ? t_far : t1[i];
+		}
+	}
+
+	PacketMask hit = 0;
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+	{
+		t_entry[i] = t0[i];
+		hit |= PacketMask(t0[i] <= t1[i]) << i;
+	}
+	return hit & mask;
+}
+
 double Plane::intersect(const Ray& ray, SurfaceInteraction* isect)
 {
 	double denom = glm::dot(normal, ray.rd);
@@ -14,17 +82,14 @@ double Plane::intersect(const Ray& ray, SurfaceInteraction* isect)
 	double t = num / denom;
 
 	//if(t >= 0) std::cout << t << std::endl;
-	t = t >= 0 ? t : INFINITY;
+	t = ray.in_range(t) ? t : INFINITY;
 
-	if (t >= 0 && t < INFINITY)
+	if (t < INFINITY)
 	{
-		if (t < ray.tNearest)
-		{
-			ray.tNearest = t;
-			isect->p = ray.ro + ray.rd * t;
-			isect->normal = get_normal(isect->p);
-			isect->mat = mat;
-		}
+		ray.tMax = t;
+		isect->p = ray.ro + ray.rd * t;
+		isect->normal = get_normal(isect->p);
+		isect->mat = mat;
 	}
 
 	return t;
@@ -40,7 +105,7 @@ double Plane::intersect(const Ray& ray)
 
 	double t = num / denom;
 
-	return t >= 0 ? t : INFINITY;
+	return ray.in_range(t) ? t : INFINITY;
 }
 
 double Rectangle::intersect(const Ray& ray, SurfaceInteraction* isect)
@@ -53,7 +118,7 @@ double Rectangle::intersect(const Ray& ray, SurfaceInteraction* isect)
 
 	double t = num / denom;
 
-	if (t < 0) return INFINITY;
+	if (!ray.in_range(t)) return INFINITY;
 
 	glm::dvec3 isec_p = ray.ro + t * ray.rd;
 
@@ -65,15 +130,12 @@ double Rectangle::intersect(const Ray& ray, SurfaceInteraction* isect)
 
 	if (test)
 	{
-		if (t < ray.tNearest)
-		{
-			ray.tNearest = t;
-			isect->p = isec_p;
-			isect->normal = get_normal(isect->p);
-			isect->mat = mat;
-		}
+		ray.tMax = t;
+		isect->p = isec_p;
+		isect->normal = get_normal(isect->p);
+		isect->mat = mat;
 	}
-	return test ? t : INFINITY;;
+	return test ? t : INFINITY;
 
 }
 
@@ -136,8 +198,8 @@ double Cube::intersect(const Ray& ray, SurfaceInteraction* isect)
 	for (int i = 0; i < 6; ++i)
 	{
 		tmp = i % 3;
-		// filter out negative parameters
-		if (t[i >= 3][tmp] >= 0.f)
+		// filter out parameters outside of the valid ray interval
+		if (ray.in_range(t[i >= 3][tmp]))
 		{
 			isec_t = t[i >= 3][tmp];
 			isec_p = transformed_ray.ro + isec_t * transformed_ray.rd;
@@ -167,17 +229,14 @@ double Cube::intersect(const Ray& ray, SurfaceInteraction* isect)
 		}
 	}
 
-	if (isec_t >= 0 && isec_t < INFINITY)
+	if (isec_t < INFINITY)
 	{
-		if (isec_t < ray.tNearest)
-		{
-			// update maximum intersection parameter
-			ray.tNearest = isec_t;
-			// update intersection properties
-			isect->p = ray.ro + ray.rd * isec_t;
-			isect->normal = get_normal(isect->p);
-			isect->mat = mat;
-		}
+		// update maximum intersection parameter
+		ray.tMax = isec_t;
+		// update intersection properties
+		isect->p = ray.ro + ray.rd * isec_t;
+		isect->normal = get_normal(isect->p);
+		isect->mat = mat;
 	}
 
 	return isec_t;
@@ -242,7 +301,7 @@ double Cube::intersect(const Ray& ray)
 	for (int i = 0; i < 6; ++i)
 	{
 		tmp = i % 3;
-		if (t[i >= 3][tmp] >= 0.f)
+		if (ray.in_range(t[i >= 3][tmp]))
 		{
 			isec_t = t[i >= 3][tmp];
 			isec_p = transformed_ray.ro + isec_t * transformed_ray.rd;
@@ -318,10 +377,12 @@ static inline glm::dvec3 Permute(const glm::dvec3& v, int x, int y, int z) {
 }
 
 // watertight ray-triangle intersection test based on implementation of pbrt
-double Triangle::intersect(const Ray& ray, SurfaceInteraction* isect)
+double intersect_triangle(const Ray& ray,
+	const glm::dvec3& p0,
+	const glm::dvec3& p1,
+	const glm::dvec3& p2,
+	glm::dvec3* barycentric)
 {
-	// Get triangle vertices in _p0_, _p1_, and _p2_
-
 	// Perform ray--triangle intersection test
 
 	// Transform triangle vertices to ray coordinate space
@@ -382,89 +443,279 @@ double Triangle::intersect(const Ray& ray, SurfaceInteraction* isect)
 	p1t.z *= Sz;
 	p2t.z *= Sz;
 	double tScaled = e0 * p0t.z + e1 * p1t.z + e2 * p2t.z;
-	if (det < 0 && (tScaled >= 0 || tScaled < ray.tNearest * det))
+	if (det < 0 && (tScaled >= 0 || tScaled < ray.tMax * det))
 		return INFINITY;
-	else if (det > 0 && (tScaled <= 0 || tScaled > ray.tNearest* det))
+	else if (det > 0 && (tScaled <= 0 || tScaled > ray.tMax * det))
 		return INFINITY;
 
 	double invDet = 1 / det;
 	double t = tScaled * invDet;
 
-	if (t < ray.tNearest)
+	if (t < ray.tMin)
+		return INFINITY;
+
+	if (barycentric)
 	{
-		ray.tNearest = t;
-		isect->p = ray.ro + t * ray.rd;
-		isect->normal = get_normal(isect->p);
-		isect->mat = mat;
+		*barycentric = glm::dvec3(e0, e1, e2) * invDet;
 	}
 	return t;
 }
 
+double Triangle::intersect(const Ray& ray, SurfaceInteraction* isect)
+{
+	double t = intersect_triangle(ray, p0, p1, p2, nullptr);
+
+	if (t == INFINITY)
+		return INFINITY;
+
+	ray.tMax = t;
+	isect->p = ray.ro + t * ray.rd;
+	isect->normal = get_normal(isect->p);
+	isect->mat = mat;
+	return t;
+}
+
 double UnitCube::intersect(const Ray& ray, SurfaceInteraction* isect)
 {
 	assert(abs(length(ray.rd)) > 0);
 
+	// the transformed ray carries its own reciprocal direction and slab signs, so the
+	// unit cube can be tested like any other box
 	Ray transformed_ray{ world_to_obj * glm::dvec4(ray.ro, 1.0),
-		world_to_obj * glm::dvec4(ray.rd, 0.0) };
+		world_to_obj * glm::dvec4(ray.rd, 0.0),
+		ray.tMin,
+		ray.tMax };
+	Bounds3 unit_box{ -boundaries, boundaries };
 
+	double t0 = unit_box.intersect(transformed_ray);
 
-	// no need for checking division by zero, doubleing point arithmetic is helping here
-	glm::dvec3 inv_rd = 1.0 / transformed_ray.rd;
-	glm::dvec3 t[2] = { glm::dvec3(INFINITY), glm::dvec3(INFINITY) };
-	// interval of intersection
-	double t0 = 0.0, t1 = INFINITY;
+	if (t0 < INFINITY)
+	{
+		// update maximum intersection parameter
+		ray.tMax = t0;
+		// update intersection properties
+		isect->p = ray.ro + ray.rd * t0;
+		isect->normal = get_normal(isect->p);
+		isect->mat = mat;
+	}
+
+	return t0;
+}
+
+double TriangleMesh::intersect(const Ray& ray, SurfaceInteraction* isect)
+{
+	double t_int = INFINITY;
+	double tmp = INFINITY;
+	bool hit = false;
+
+	return bvh->traverse_bvh(ray, isect);
+}
 
-	// the case where the ray is parallel to the plane is handled correctly by these two
-	// calculations => if the ray is outside the slabs, the values will both be -/+ inf,
-	// if it is inside, the values will be inf with different signs
-	t[0] = -boundaries - transformed_ray.ro;
-	t[1] = boundaries - transformed_ray.ro;
+void TriangleMesh::intersect_packet(RayPacket& packet, PacketMask mask, SurfaceInteraction* isects)
+{
+	bvh->traverse_bvh(packet, mask, isects);
+}
+
+bool TriangleMesh::cull(const Frustum& frustum, std::vector<BVH_Node*>& nodes) const
+{
+	if (frustum.classify(*bounding_box) == Frustum::Overlap::OUTSIDE)
+	{
+		return false;
+	}
+
+	bvh->cull(frustum, nodes);
+	return !nodes.empty();
+}
+
+double TriangleMesh::intersect_culled(const Ray& ray, SurfaceInteraction* isect, const std::vector<BVH_Node*>& nodes)
+{
+	return bvh->traverse_bvh(ray, isect, nodes);
+}
+
+void TriangleMesh::intersect_packet_culled(RayPacket& packet,
+	PacketMask mask,
+	SurfaceInteraction* isects,
+	const std::vector<BVH_Node*>& nodes)
+{
+	bvh->traverse_bvh(packet, mask, isects, nodes);
+}
+
+LODMesh::LODMesh(std::vector<std::shared_ptr<Shape>> tr_mesh,
+	size_t min_triangle_count,
+	size_t max_levels) :
+	min_triangle_count(min_triangle_count),
+	max_levels(max_levels),
+	levels_built(false),
+	active(0)
+{
+	triangle_counts.push_back(tr_mesh.size());
+	levels.push_back(std::make_unique<TriangleMesh>(tr_mesh));
+	bounding_box = std::make_unique<Bounds3>(*levels[0]->bounding_box);
+}
+
+void LODMesh::build_levels()
+{
+	levels_built = true;
+	std::vector<std::shared_ptr<Shape>> tr_mesh = levels[0]->tr_mesh;
 
-	for (int i = 0; i < 3; ++i)
+	while (levels.size() < max_levels && tr_mesh.size() / 4 >= min_triangle_count)
 	{
-		t[0][i] *= inv_rd[i];
-		t[1][i] *= inv_rd[i];
+		auto simplified = simplify_mesh(tr_mesh, tr_mesh.size() / 4);
 
-		if (t[0][i] > t[1][i])
+		// the mesh can't be simplified any further
+		if (simplified.size() >= tr_mesh.size())
 		{
-			std::swap(t[0][i], t[1][i]);
+			break;
 		}
 
-		// narrow interval and check if intersection possible
-		// smaller interval bound may only get larger, the bigger interval bound may only 
-		// become smaller
-		t0 = t0 > t[0][i] ? t0 : t[0][i];
-		t1 = t1 < t[1][i] ? t1 : t[1][i];
+		tr_mesh = std::move(simplified);
+		triangle_counts.push_back(tr_mesh.size());
+		levels.push_back(std::make_unique<TriangleMesh>(tr_mesh));
+	}
+
+	LOG(INFO) << "Built " << levels.size() << " levels of detail, " << triangle_counts.front() <<
+		" to " << triangle_counts.back() << " triangles";
+}
+
+void LODMesh::select(const glm::dvec3& eye, double pixel_angle)
+{
+	// level of detail is off, the simplified levels aren't needed
+	if (pixel_angle <= 0)
+	{
+		active = 0;
+		return;
+	}
+
+	if (!levels_built)
+	{
+		build_levels();
+	}
+
+	const Bounds3& box = *bounding_box;
+	double extent = glm::length(box.boundaries[1] - box.boundaries[0]);
+	double distance = glm::length(box.centroid - eye) - 0.5 * extent;
+
+	// the eye is inside the bounding sphere
+	if (distance <= 0)
+	{
+		active = 0;
+		return;
+	}
+
+	// projected size of the bounding box diagonal in pixels, its square overestimates
+	// the number of covered pixels
+	double pixels = extent / (distance * pixel_angle);
+	double needed = pixels * pixels * TRIANGLES_PER_PIXEL;
+
+	active = 0;
+	while (active + 1 < levels.size() && triangle_counts[active + 1] >= needed)
+	{
+		++active;
+	}
+}
+
+thread_local size_t thread_animation_slot = 0;
+
+Instance::Instance(std::unique_ptr<Shape> shape, const glm::dmat4& obj_to_world) :
+	shape(std::move(shape))
+{
+	assert(this->shape->bounding_box);
+
+	for (size_t slot = 0; slot < MAX_SLOTS; ++slot)
+	{
+		set_transform(obj_to_world, slot);
+	}
+}
+
+void Instance::set_transform(const glm::dmat4& obj_to_world, size_t slot)
+{
+	assert(slot < MAX_SLOTS);
+	Placement& placement = placements[slot];
+	placement.obj_to_world = obj_to_world;
+	placement.world_to_obj = glm::inverse(obj_to_world);
+	placement.normal_to_world = glm::transpose(glm::dmat3(glm::dvec3(placement.world_to_obj[0]),
+		glm::dvec3(placement.world_to_obj[1]),
+		glm::dvec3(placement.world_to_obj[2])));
+
+	// bounds of the transformed corners of the object space bounds
+	placement.min_bounds = glm::dvec3(INFINITY);
+	placement.max_bounds = glm::dvec3(-INFINITY);
+
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		glm::dvec3 p(shape->bounding_box->boundaries[corner & 1].x,
+			shape->bounding_box->boundaries[(corner >> 1) & 1].y,
+			shape->bounding_box->boundaries[(corner >> 2) & 1].z);
+		p = obj_to_world * glm::dvec4(p, 1.0);
+		placement.min_bounds = glm::min(placement.min_bounds, p);
+		placement.max_bounds = glm::max(placement.max_bounds, p);
+	}
+
+	// the bounds seen by code that doesn't know about slots
+	if (slot == 0)
+	{
+		bounding_box = std::make_unique<Bounds3>(placement.min_bounds, placement.max_bounds);
+	}
+}
+
+void Instance::to_world(const Placement& placement, SurfaceInteraction* isect)
+{
+	isect->p = placement.obj_to_world * glm::dvec4(isect->p, 1.0);
+	isect->normal = glm::normalize(placement.normal_to_world * isect->normal);
+}
 
-		if (t0 > t1)
+double Instance::intersect(const Ray& ray, SurfaceInteraction* isect)
+{
+	const Placement& placement = placements[thread_animation_slot];
+
+	// the direction isn't normalized, so the ray parameters are the same in both spaces
+	Ray local(placement.world_to_obj * glm::dvec4(ray.ro, 1.0),
+		placement.world_to_obj * glm::dvec4(ray.rd, 0.0),
+		ray.tMin,
+		ray.tMax);
+	shape->intersect(local, isect);
+
+	if (local.tMax < ray.tMax)
+	{
+		ray.tMax = local.tMax;
+		to_world(placement, isect);
+	}
+	return ray.tMax;
+}
+
+void Instance::intersect_packet(RayPacket& packet, PacketMask mask, SurfaceInteraction* isects)
+{
+	const Placement& placement = placements[thread_animation_slot];
+	RayPacket local;
+
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+	{
+		if (mask & RayPacket::lane_bit(i))
 		{
-			return INFINITY;
+			const Ray& ray = packet.rays[i];
+			local.set(i, Ray(placement.world_to_obj * glm::dvec4(ray.ro, 1.0),
+				placement.world_to_obj * glm::dvec4(ray.rd, 0.0),
+				ray.tMin,
+				ray.tMax));
 		}
 	}
+	shape->intersect_packet(local, mask, isects);
 
-	if (t0 >= 0 && t0 < INFINITY)
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i)
 	{
-		if (t0 < ray.tNearest)
+		if ((mask & RayPacket::lane_bit(i)) && local.rays[i].tMax < packet.rays[i].tMax)
 		{
-			// update maximum intersection parameter
-			ray.tNearest = t0;
-			// update intersection properties
-			isect->p = ray.ro + ray.rd * t0;
-			isect->normal = get_normal(isect->p);
-			isect->mat = mat;
+			packet.rays[i].tMax = local.rays[i].tMax;
+			to_world(placement, &isects[i]);
 		}
 	}
-
-	return t0;
+	packet.update_t_max(mask);
 }
 
-double TriangleMesh::intersect(const Ray& ray, SurfaceInteraction* isect)
+bool Instance::cull(const Frustum& frustum, std::vector<BVH_Node*>& /*nodes*/) const
 {
-	double t_int = INFINITY;
-	double tmp = INFINITY;
-	bool hit = false;
-
-	return bvh->traverse_bvh(ray, isect);
+	const Placement& placement = placements[thread_animation_slot];
+	return frustum.classify(Bounds3(placement.min_bounds, placement.max_bounds)) != Frustum::Overlap::OUTSIDE;
 }
 
 } //namespace rt
@@ -0,0 +1,372 @@
+#include <algorithm>
+#include <array>
+#include <map>
+#include <queue>
+
+#include "shape/simplify.h"
+#include "shape/shape.h"
+
+namespace rt
+{
+
+namespace
+{
+/*
+	Symmetric 4x4 matrix summing up the squared distances to a set of planes,
+	only the upper triangle is stored.
+*/
+struct Quadric
+{
+	// a00 a01 a02 a03 a11 a12 a13 a22 a23 a33
+	double a[10] = {};
+
+	Quadric() = default;
+
+	// plane with the unit normal n and the offset d, so that dot(n, p) + d = 0
+	Quadric(const glm::dvec3& n, double d)
+	{
+		a[0] = n.x * n.x; a[1] = n.x * n.y; a[2] = n.x * n.z; a[3] = n.x * d;
+		a[4] = n.y * n.y; a[5] = n.y * n.z; a[6] = n.y * d;
+		a[7] = n.z * n.z; a[8] = n.z * d;
+		a[9] = d * d;
+	}
+
+	Quadric& operator+=(const Quadric& q)
+	{
+		for (int i = 0; i < 10; ++i)
+		{
+			a[i] += q.a[i];
+		}
+		return *this;
+	}
+
+	Quadric operator+(const Quadric& q) const
+	{
+		Quadric r = *this;
+		r += q;
+		return r;
+	}
+
+	double error(const glm::dvec3& p) const
+	{
+		return a[0] * p.x * p.x + 2.0 * a[1] * p.x * p.y + 2.0 * a[2] * p.x * p.z + 2.0 * a[3] * p.x +
+			a[4] * p.y * p.y + 2.0 * a[5] * p.y * p.z + 2.0 * a[6] * p.y +
+			a[7] * p.z * p.z + 2.0 * a[8] * p.z +
+			a[9];
+	}
+
+	/*
+		Position with the minimal error. Returns false, if the system is close to
+		singular (e.g. for planar neighborhoods).
+	*/
+	bool optimum(glm::dvec3* p) const
+	{
+		glm::dmat3 A(glm::dvec3(a[0], a[1], a[2]),
+			glm::dvec3(a[1], a[4], a[5]),
+			glm::dvec3(a[2], a[5], a[7]));
+
+		if (std::abs(glm::determinant(A)) < 1e-12)
+		{
+			return false;
+		}
+		*p = -(glm::inverse(A) * glm::dvec3(a[3], a[6], a[8]));
+		return true;
+	}
+};
+
+struct Collapse
+{
+	double cost;
+	size_t v0, v1;
+	// versions of the vertices when the collapse was computed, used to detect outdated entries
+	uint32_t version0, version1;
+	glm::dvec3 p;
+
+	bool operator>(const Collapse& c) const
+	{
+		return cost > c.cost;
+	}
+};
+
+struct Vec3Less
+{
+	bool operator()(const glm::dvec3& a, const glm::dvec3& b) const
+	{
+		if (a.x != b.x) return a.x < b.x;
+		if (a.y != b.y) return a.y < b.y;
+		return a.z < b.z;
+	}
+};
+
+glm::dvec3 face_normal(const glm::dvec3& p0, const glm::dvec3& p1, const glm::dvec3& p2)
+{
+	return glm::cross(p1 - p0, p2 - p0);
+}
+} // namespace
+
+std::vector<std::shared_ptr<Shape>> simplify_mesh(const std::vector<std::shared_ptr<Shape>>& triangles,
+	size_t target_count)
+{
+	std::vector<glm::dvec3> positions;
+	std::vector<glm::dvec3> normals;
+	std::vector<std::array<size_t, 3>> faces;
+	std::vector<std::shared_ptr<Material>> materials;
+	std::map<glm::dvec3, size_t, Vec3Less> welded;
+
+	// weld vertices with the same position, the triangles of a mesh don't share them
+	for (const auto& s : triangles)
+	{
+		const Triangle* tr = dynamic_cast<const Triangle*>(s.get());
+
+		if (!tr)
+		{
+			continue;
+		}
+
+		std::array<size_t, 3> face;
+
+		for (int k = 0; k < 3; ++k)
+		{
+			auto it = welded.emplace(tr->get_vertex(k), positions.size());
+
+			if (it.second)
+			{
+				positions.push_back(tr->get_vertex(k));
+				normals.push_back(glm::dvec3(0.0));
+			}
+			face[k] = it.first->second;
+			normals[face[k]] += tr->get_vertex_normal(k);
+		}
+
+		if (face[0] != face[1] && face[1] != face[2] && face[0] != face[2])
+		{
+			faces.push_back(face);
+			materials.push_back(tr->mat);
+		}
+	}
+
+	if (faces.size() <= target_count)
+	{
+		return triangles;
+	}
+
+	std::vector<Quadric> quadrics(positions.size());
+	std::vector<std::vector<size_t>> vertex_faces(positions.size());
+	std::vector<bool> face_alive(faces.size(), true);
+	std::vector<bool> vertex_alive(positions.size(), true);
+	std::vector<uint32_t> version(positions.size(), 0);
+
+	for (size_t f = 0; f < faces.size(); ++f)
+	{
+		const auto& face = faces[f];
+		glm::dvec3 n = face_normal(positions[face[0]], positions[face[1]], positions[face[2]]);
+		double len = glm::length(n);
+
+		if (len > 0)
+		{
+			n /= len;
+			Quadric q(n, -glm::dot(n, positions[face[0]]));
+
+			for (int k = 0; k < 3; ++k)
+			{
+				quadrics[face[k]] += q;
+			}
+		}
+
+		for (int k = 0; k < 3; ++k)
+		{
+			vertex_faces[face[k]].push_back(f);
+		}
+	}
+
+	std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> heap;
+
+	auto push_edge = [&](size_t v0, size_t v1) {
+		Quadric q = quadrics[v0] + quadrics[v1];
+		glm::dvec3 p;
+
+		if (!q.optimum(&p))
+		{
+			// choose the best of the end points and the midpoint
+			glm::dvec3 candidates[3] = { positions[v0], positions[v1], 0.5 * (positions[v0] + positions[v1]) };
+			p = candidates[0];
+
+			for (int i = 1; i < 3; ++i)
+			{
+				if (q.error(candidates[i]) < q.error(p))
+				{
+					p = candidates[i];
+				}
+			}
+		}
+		heap.push(Collapse{ std::max(q.error(p), 0.0), v0, v1, version[v0], version[v1], p });
+	};
+
+	for (const auto& face : faces)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			size_t v0 = face[k];
+			size_t v1 = face[(k + 1) % 3];
+
+			// every inner edge is shared by two faces, push it once
+			if (v0 < v1)
+			{
+				push_edge(v0, v1);
+			}
+		}
+	}
+
+	size_t alive_faces = faces.size();
+	std::vector<size_t> neighbors;
+
+	while (alive_faces > target_count && !heap.empty())
+	{
+		Collapse c = heap.top();
+		heap.pop();
+
+		if (!vertex_alive[c.v0] || !vertex_alive[c.v1] ||
+			version[c.v0] != c.version0 || version[c.v1] != c.version1)
+		{
+			continue;
+		}
+
+		// reject the collapse if one of the remaining faces around the edge would flip
+		bool flips = false;
+
+		for (size_t v : { c.v0, c.v1 })
+		{
+			for (size_t f : vertex_faces[v])
+			{
+				const auto& face = faces[f];
+
+				if (!face_alive[f] ||
+					std::count(face.begin(), face.end(), c.v0) + std::count(face.begin(), face.end(), c.v1) == 2)
+				{
+					continue;
+				}
+
+				glm::dvec3 p[3];
+				for (int k = 0; k < 3; ++k)
+				{
+					p[k] = (face[k] == v) ? c.p : positions[face[k]];
+				}
+
+				glm::dvec3 n_old = face_normal(positions[face[0]], positions[face[1]], positions[face[2]]);
+				glm::dvec3 n_new = face_normal(p[0], p[1], p[2]);
+
+				if (glm::dot(n_old, n_new) <= 0)
+				{
+					flips = true;
+					break;
+				}
+			}
+			if (flips)
+			{
+				break;
+			}
+		}
+
+		if (flips)
+		{
+			continue;
+		}
+
+		// move v0 to the new position and let the faces of v1 point to v0
+		positions[c.v0] = c.p;
+		quadrics[c.v0] += quadrics[c.v1];
+		normals[c.v0] += normals[c.v1];
+		vertex_alive[c.v1] = false;
+
+		for (size_t f : vertex_faces[c.v1])
+		{
+			if (!face_alive[f])
+			{
+				continue;
+			}
+
+			auto& face = faces[f];
+
+			if (std::find(face.begin(), face.end(), c.v0) != face.end())
+			{
+				face_alive[f] = false;
+				--alive_faces;
+			}
+			else
+			{
+				std::replace(face.begin(), face.end(), c.v1, c.v0);
+				vertex_faces[c.v0].push_back(f);
+			}
+		}
+		vertex_faces[c.v1].clear();
+
+		auto& v0_faces = vertex_faces[c.v0];
+		v0_faces.erase(std::remove_if(v0_faces.begin(), v0_faces.end(), [&face_alive](size_t f) {
+			return !face_alive[f];
+		}), v0_faces.end());
+
+		++version[c.v0];
+		++version[c.v1];
+
+		// the costs of all edges around v0 have changed
+		neighbors.clear();
+		for (size_t f : v0_faces)
+		{
+			for (size_t v : faces[f])
+			{
+				if (v != c.v0)
+				{
+					neighbors.push_back(v);
+				}
+			}
+		}
+		std::sort(neighbors.begin(), neighbors.end());
+		neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+
+		for (size_t v : neighbors)
+		{
+			push_edge(c.v0, v);
+		}
+	}
+
+	std::vector<std::shared_ptr<Shape>> simplified;
+	simplified.reserve(alive_faces);
+
+	for (size_t f = 0; f < faces.size(); ++f)
+	{
+		if (!face_alive[f])
+		{
+			continue;
+		}
+
+		const auto& face = faces[f];
+		const glm::dvec3& p0 = positions[face[0]];
+		const glm::dvec3& p1 = positions[face[1]];
+		const glm::dvec3& p2 = positions[face[2]];
+		glm::dvec3 n = glm::cross(p1 - p0, p2 - p1);
+
+		if (glm::length(n) == 0)
+		{
+			continue;
+		}
+		n = glm::normalize(n);
+
+		glm::dvec3 vn[3];
+		for (int k = 0; k < 3; ++k)
+		{
+			// meshes without shading normals fall back to flat shading
+			vn[k] = glm::length(normals[face[k]]) > 0 ? glm::normalize(normals[face[k]]) : n;
+		}
+
+		simplified.push_back(std::make_shared<Triangle>(
+			p0, p1, p2,
+			vn[0], vn[1], vn[2],
+			n,
+			glm::dmat4(1.0),
+			materials[f]));
+	}
+
+	return simplified;
+}
+
+} // namespace rt
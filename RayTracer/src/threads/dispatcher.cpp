@@ -1,18 +1,206 @@
+#include <algorithm>
+
 #include "threads/dispatcher.h"
 
 namespace rt
 {
 
-int Slice::get_index()
+// interleave the bits of x and y, x in the even bits
+static uint64_t morton_index(uint32_t x, uint32_t y)
+{
+	uint64_t index = 0;
+	for (int b = 0; b < 32; ++b)
+	{
+		index |= (uint64_t((x >> b) & 1) << (2 * b)) | (uint64_t((y >> b) & 1) << (2 * b + 1));
+	}
+	return index;
+}
+
+// distance of (x, y) along the Hilbert curve filling a n x n grid, n a power of two
+static uint64_t hilbert_index(uint32_t n, uint32_t x, uint32_t y)
+{
+	uint64_t index = 0;
+
+	for (uint32_t s = n / 2; s > 0; s /= 2)
+	{
+		uint32_t rx = (x & s) > 0;
+		uint32_t ry = (y & s) > 0;
+		index += uint64_t(s) * s * ((3 * rx) ^ ry);
+
+		// rotate the quadrant, so that the curve of the sub grid starts and ends at
+		// the right corners
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = s - 1 - (x & (s - 1));
+				y = s - 1 - (y & (s - 1));
+			}
+			std::swap(x, y);
+		}
+		x &= s - 1;
+		y &= s - 1;
+	}
+	return index;
+}
+
+void Slice::sort_pairs(TileOrder order)
+{
+	if (order == TileOrder::COLUMNS)
+	{
+		return;
+	}
+
+	uint32_t n = 1;
+	while (n < static_cast<uint32_t>(std::max(dx, dy)))
+	{
+		n *= 2;
+	}
+
+	// tile centers relative to the image center, in tiles
+	double cx = 0.5 * (dx - 1);
+	double cy = 0.5 * (dy - 1);
+
+	std::vector<std::pair<double, std::pair<int, int>>> keyed;
+	keyed.reserve(pairs.size());
+
+	for (const auto& p : pairs)
+	{
+		uint32_t x = static_cast<uint32_t>(p.first / w_step);
+		uint32_t y = static_cast<uint32_t>(p.second / h_step);
+		double key = 0.0;
+
+		if (order == TileOrder::MORTON)
+		{
+			key = static_cast<double>(morton_index(x, y));
+		}
+		else if (order == TileOrder::HILBERT)
+		{
+			key = static_cast<double>(hilbert_index(n, x, y));
+		}
+		else
+		{
+			// ring around the center first, then the angle, so each ring is walked
+			// around once
+			double ox = x - cx;
+			double oy = y - cy;
+			double ring = std::ceil(std::max(std::abs(ox), std::abs(oy)) - 1e-9);
+			key = ring * 8.0 + (std::atan2(oy, ox) + M_PI) / M_PI;
+		}
+		keyed.emplace_back(key, p);
+	}
+
+	std::stable_sort(keyed.begin(), keyed.end(),
+		[](const auto& a, const auto& b) { return a.first < b.first; });
+
+	for (size_t i = 0; i < keyed.size(); ++i)
+	{
+		pairs[i] = keyed[i].second;
+	}
+}
+
+void Slice::sort_by_cost(const std::vector<double>& cost)
+{
+	assert(cost.size() == pairs.size());
+
+	std::vector<size_t> order(pairs.size());
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		order[i] = i;
+	}
+
+	std::stable_sort(order.begin(), order.end(),
+		[&cost](size_t a, size_t b) { return cost[a] > cost[b]; });
+
+	std::vector<std::pair<int, int>> sorted;
+	sorted.reserve(pairs.size());
+	for (size_t i : order)
+	{
+		sorted.push_back(pairs[i]);
+	}
+	pairs.swap(sorted);
+}
+
+size_t Slice::part_of_row(size_t y) const
+{
+	size_t parts = get_parts();
+	return std::min(parts - 1, (y / h_step) * parts / static_cast<size_t>(dy));
+}
+
+void Slice::partition(size_t parts)
+{
+	parts = std::max<size_t>(1, std::min(parts, static_cast<size_t>(std::max(dy, 1))));
+	part_begin.assign(parts + 1, 0);
+
+	std::stable_sort(pairs.begin(), pairs.end(), [this](const auto& a, const auto& b) {
+		return part_of_row(a.second) < part_of_row(b.second);
+	});
+
+	for (const auto& p : pairs)
+	{
+		++part_begin[part_of_row(p.second) + 1];
+	}
+	for (size_t i = 0; i < parts; ++i)
+	{
+		part_begin[i + 1] += part_begin[i];
+	}
+
+	part_next.reset(new std::atomic<size_t>[parts]);
+	for (size_t i = 0; i < parts; ++i)
+	{
+		part_next[i] = part_begin[i];
+	}
+}
+
+void Slice::rewind()
 {
-	if (idx == length || ++idx == length)
+	for (size_t i = 0; i < get_parts(); ++i)
 	{
-		return -1;
+		part_next[i] = part_begin[i];
 	}
-	else
+	stolen = 0;
+}
+
+std::pair<size_t, size_t> Slice::part_rows(size_t part) const
+{
+	size_t parts = get_parts();
+	size_t tile_rows = static_cast<size_t>(dy);
+
+	// inverse of part_of_row: first tile row r with r * parts / tile_rows >= part
+	size_t first = (part * tile_rows + parts - 1) / parts;
+	size_t last = ((part + 1) * tile_rows + parts - 1) / parts;
+
+	return std::make_pair(std::min(first * h_step, img_height), std::min(last * h_step, img_height));
+}
+
+int Slice::get_index(size_t part)
+{
+	size_t parts = get_parts();
+	part = std::min(part, parts - 1);
+
+	for (size_t k = 0; k < parts; ++k)
 	{
-		return idx;
+		size_t p = (part + k) % parts;
+
+		// checked first, so that exhausted parts aren't counted up any further
+		if (part_next[p].load(std::memory_order_relaxed) >= part_begin[p + 1])
+		{
+			continue;
+		}
+
+		// relaxed suffices, the pairs are not written while tiles are handed out
+		size_t i = part_next[p].fetch_add(1, std::memory_order_relaxed);
+
+		if (i < part_begin[p + 1])
+		{
+			if (k > 0)
+			{
+				++stolen;
+			}
+			return static_cast<int>(i);
+		}
 	}
+	return -1;
 }
 
 } // namespace rt
\ No newline at end of file
@@ -0,0 +1,258 @@
+#include "threads/threadpool.h"
+#include "threads/topology.h"
+
+namespace rt
+{
+
+ThreadPool* ThreadPool::current_pool = nullptr;
+
+// worker index of the calling thread together with the pool it belongs to
+static thread_local const ThreadPool* worker_pool = nullptr;
+static thread_local int worker_id = -1;
+// number of tasks the calling thread is executing, nested ones run inside TaskGroup::wait
+static thread_local int task_depth = 0;
+
+ThreadPool::ThreadPool(size_t num_threads, bool pin_threads) :
+	stop(false), pending(0), next_queue(0), idle(0)
+{
+	num_threads = std::max<size_t>(num_threads, 1);
+
+	if (pin_threads)
+	{
+		cpus = cpu_placement_order();
+	}
+
+	for (size_t i = 0; i < num_threads; ++i)
+	{
+		workers.push_back(std::make_unique<Worker>(deque_lock_stats));
+	}
+
+	for (size_t i = 0; i < num_threads; ++i)
+	{
+		threads.emplace_back(&ThreadPool::worker_loop, this, static_cast<int>(i));
+	}
+
+	LOG(INFO) << "Started thread pool with " << num_threads << " workers"
+		<< (cpus.empty() ? "" : ", pinned to CPUs");
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		stop = true;
+	}
+	wake_up.notify_all();
+
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+
+	if (current_pool == this)
+	{
+		current_pool = nullptr;
+	}
+}
+
+ThreadPool* ThreadPool::current()
+{
+	return current_pool;
+}
+
+void ThreadPool::set_current(ThreadPool* pool)
+{
+	current_pool = pool;
+}
+
+void ThreadPool::reset_busy_time()
+{
+	for (auto& w : workers)
+	{
+		w->busy_ns = 0;
+	}
+}
+
+int ThreadPool::worker_index() const
+{
+	return worker_pool == this ? worker_id : -1;
+}
+
+void ThreadPool::submit(Task task)
+{
+	int self = worker_index();
+
+	// workers push to their own deque, other threads distribute round robin
+	size_t q = self >= 0 ? static_cast<size_t>(self) : next_queue++ % workers.size();
+
+	// count the task before it becomes visible, so that the counter can't drop below
+	// zero when the task gets stolen right away
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		++pending;
+	}
+
+	{
+		std::lock_guard<CountingMutex> lock(workers[q]->mutex);
+		workers[q]->tasks.push_back(std::move(task));
+	}
+	wake_up.notify_one();
+}
+
+bool ThreadPool::pop_or_steal(int self, Task* task)
+{
+	if (self >= 0)
+	{
+		Worker& own = *workers[self];
+		std::lock_guard<CountingMutex> lock(own.mutex);
+
+		if (!own.tasks.empty())
+		{
+			*task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			return true;
+		}
+	}
+
+	// steal the oldest task of another worker, which is usually the biggest chunk
+	size_t n = workers.size();
+	size_t start = self >= 0 ? static_cast<size_t>(self) + 1 : next_queue.load();
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		Worker& victim = *workers[(start + i) % n];
+		std::lock_guard<CountingMutex> lock(victim.mutex);
+
+		if (!victim.tasks.empty())
+		{
+			*task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::execute(Task& task)
+{
+	--pending;
+
+	// nested tasks are part of the busy time of the outermost one
+	int self = worker_index();
+	bool timed = self >= 0 && task_depth == 0;
+	auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+	++task_depth;
+	task.fn();
+	--task_depth;
+
+	if (timed)
+	{
+		workers[self]->busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count();
+	}
+
+	// the group may be destroyed as soon as its count is 0, its waiter is woken up
+	// through the pool
+	if (task.group && --task.group->count == 0)
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		wake_up.notify_all();
+	}
+}
+
+bool ThreadPool::run_one()
+{
+	Task task;
+
+	if (!pop_or_steal(worker_index(), &task))
+	{
+		return false;
+	}
+	execute(task);
+	return true;
+}
+
+void ThreadPool::worker_loop(int index)
+{
+	worker_pool = this;
+	worker_id = index;
+
+	// more workers than CPUs share them round robin
+	if (!cpus.empty() && !pin_current_thread(cpus[index % cpus.size()]))
+	{
+		LOG(WARNING) << "Could not pin worker " << index << " to CPU " << cpus[index % cpus.size()];
+	}
+
+	Task task;
+
+	while (true)
+	{
+		if (pop_or_steal(index, &task))
+		{
+			execute(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		++idle;
+		wake_up.wait(lock, [this]() { return stop || pending > 0; });
+		--idle;
+
+		if (stop)
+		{
+			return;
+		}
+	}
+}
+
+void ThreadPool::parallel_for(size_t begin,
+	size_t end,
+	size_t grain,
+	const std::function<void(size_t, size_t)>& body)
+{
+	grain = std::max<size_t>(grain, 1);
+
+	// a single chunk runs on the calling thread
+	if (end - begin <= grain)
+	{
+		if (begin < end)
+		{
+			body(begin, end);
+		}
+		return;
+	}
+
+	TaskGroup group(*this);
+
+	for (size_t b = begin; b < end; b += grain)
+	{
+		size_t e = std::min(b + grain, end);
+		group.run([&body, b, e]() { body(b, e); });
+	}
+	group.wait();
+}
+
+void TaskGroup::run(std::function<void()> task)
+{
+	++count;
+	pool.submit(ThreadPool::Task{ std::move(task), this });
+}
+
+void TaskGroup::wait()
+{
+	while (count > 0)
+	{
+		if (pool.run_one())
+		{
+			continue;
+		}
+
+		// sleep until the tasks of the group are finished elsewhere or there are new
+		// tasks to help with
+		std::unique_lock<std::mutex> lock(pool.sleep_mutex);
+		pool.wake_up.wait(lock, [this]() { return count == 0 || pool.pending > 0; });
+	}
+}
+
+} // namespace rt
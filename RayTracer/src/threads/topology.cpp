@@ -0,0 +1,335 @@
+#include <map>
+#include <sstream>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include "threads/topology.h"
+
+namespace rt
+{
+
+#if !defined(_WIN32)
+static std::vector<int> allowed_cpus()
+{
+	std::vector<int> cpus;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+	{
+		for (int i = 0; i < CPU_SETSIZE; ++i)
+		{
+			if (CPU_ISSET(i, &set))
+			{
+				cpus.push_back(i);
+			}
+		}
+	}
+	return cpus;
+}
+
+// first integer of a file, or fallback if it can't be read
+static long long read_value(const std::string& path, long long fallback)
+{
+	std::ifstream ifs(path);
+	long long value;
+	return ifs >> value ? value : fallback;
+}
+
+// parse a sysfs CPU list such as "0-7,16-23"
+static std::vector<int> parse_cpu_list(const std::string& list)
+{
+	std::vector<int> cpus;
+	std::stringstream ss(list);
+	std::string range;
+
+	while (std::getline(ss, range, ','))
+	{
+		if (range.empty())
+		{
+			continue;
+		}
+		size_t dash = range.find('-');
+		int first = std::stoi(range.substr(0, dash));
+		int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+
+		for (int cpu = first; cpu <= last; ++cpu)
+		{
+			cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+/*
+	CPUs granted by the cgroup CPU quota (rounded up), 0 if there is no quota.
+	Checks cgroup v2 (cpu.max of the own cgroup or of the mounted root, which is the
+	own cgroup inside containers) and then cgroup v1 (cfs quota and period).
+*/
+static size_t cgroup_cpu_limit()
+{
+	std::vector<std::string> cpu_max_paths;
+	std::ifstream cgroup("/proc/self/cgroup");
+	std::string line;
+
+	while (std::getline(cgroup, line))
+	{
+		// the unified hierarchy is listed as "0::/path"
+		if (line.compare(0, 3, "0::") == 0)
+		{
+			cpu_max_paths.push_back("/sys/fs/cgroup" + line.substr(3) + "/cpu.max");
+		}
+	}
+	cpu_max_paths.push_back("/sys/fs/cgroup/cpu.max");
+
+	for (const auto& path : cpu_max_paths)
+	{
+		std::ifstream ifs(path);
+		std::string quota;
+		long long period;
+
+		if (ifs >> quota >> period)
+		{
+			if (quota == "max" || period <= 0)
+			{
+				return 0;
+			}
+			long long q = std::stoll(quota);
+			return static_cast<size_t>((q + period - 1) / period);
+		}
+	}
+
+	long long quota = read_value("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", -1);
+	long long period = read_value("/sys/fs/cgroup/cpu/cpu.cfs_period_us", 0);
+
+	if (quota > 0 && period > 0)
+	{
+		return static_cast<size_t>((quota + period - 1) / period);
+	}
+	return 0;
+}
+#endif
+
+size_t default_thread_count()
+{
+	size_t count = std::thread::hardware_concurrency();
+
+#if defined(_WIN32)
+	DWORD_PTR process_mask;
+	DWORD_PTR system_mask;
+
+	if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+	{
+		size_t allowed = 0;
+		for (; process_mask; process_mask &= process_mask - 1)
+		{
+			++allowed;
+		}
+		count = count ? std::min(count, allowed) : allowed;
+	}
+#else
+	size_t allowed = allowed_cpus().size();
+	if (allowed > 0)
+	{
+		count = count ? std::min(count, allowed) : allowed;
+	}
+
+	size_t limit = cgroup_cpu_limit();
+	if (limit > 0)
+	{
+		count = count ? std::min(count, limit) : limit;
+	}
+#endif
+
+	return std::max<size_t>(count, 1);
+}
+
+std::vector<int> cpu_placement_order()
+{
+	std::vector<int> first;
+	std::vector<int> siblings;
+
+#if defined(_WIN32)
+	// only the first processor group (64 logical CPUs) is considered
+	DWORD length = 0;
+	GetLogicalProcessorInformation(nullptr, &length);
+	std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(
+		length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+
+	DWORD_PTR process_mask = ~DWORD_PTR(0);
+	DWORD_PTR system_mask;
+	GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask);
+
+	if (!info.empty() && GetLogicalProcessorInformation(info.data(), &length))
+	{
+		for (const auto& entry : info)
+		{
+			if (entry.Relationship != RelationProcessorCore)
+			{
+				continue;
+			}
+			bool core_used = false;
+
+			for (int cpu = 0; cpu < static_cast<int>(sizeof(DWORD_PTR) * 8); ++cpu)
+			{
+				DWORD_PTR bit = DWORD_PTR(1) << cpu;
+
+				if ((entry.ProcessorMask & bit) && (process_mask & bit))
+				{
+					(core_used ? siblings : first).push_back(cpu);
+					core_used = true;
+				}
+			}
+		}
+	}
+#else
+	// logical CPUs sharing package and core id are SMT siblings
+	std::map<std::pair<long long, long long>, int> cores;
+
+	for (int cpu : allowed_cpus())
+	{
+		std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+		auto key = std::make_pair(read_value(dir + "physical_package_id", 0),
+			read_value(dir + "core_id", cpu));
+
+		if (cores.emplace(key, cpu).second)
+		{
+			first.push_back(cpu);
+		}
+		else
+		{
+			siblings.push_back(cpu);
+		}
+	}
+#endif
+
+	// interleave the NUMA nodes: the k-th core of every node before the k+1-th ones
+	auto interleave = [](std::vector<int>& cpus) {
+		std::vector<int> nodes = cpu_numa_nodes(cpus);
+		std::map<int, int> count;
+		std::vector<std::pair<int, int>> ranked;
+
+		for (size_t i = 0; i < cpus.size(); ++i)
+		{
+			ranked.emplace_back(count[nodes[i]]++, cpus[i]);
+		}
+		std::stable_sort(ranked.begin(), ranked.end(),
+			[](const auto& a, const auto& b) { return a.first < b.first; });
+
+		for (size_t i = 0; i < cpus.size(); ++i)
+		{
+			cpus[i] = ranked[i].second;
+		}
+	};
+	interleave(first);
+	interleave(siblings);
+
+	first.insert(first.end(), siblings.begin(), siblings.end());
+	return first;
+}
+
+std::vector<int> cpu_numa_nodes(const std::vector<int>& cpus)
+{
+	std::vector<int> nodes(cpus.size(), 0);
+
+#if defined(_WIN32)
+	for (size_t i = 0; i < cpus.size(); ++i)
+	{
+		UCHAR node;
+		if (cpus[i] >= 0 && GetNumaProcessorNode(static_cast<UCHAR>(cpus[i]), &node))
+		{
+			nodes[i] = node;
+		}
+	}
+#else
+	std::ifstream online("/sys/devices/system/node/online");
+	std::string list;
+
+	if (!(online >> list))
+	{
+		return nodes;
+	}
+
+	std::map<int, int> node_of_cpu;
+	for (int node : parse_cpu_list(list))
+	{
+		std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+		std::string cpu_list;
+
+		if (ifs >> cpu_list)
+		{
+			for (int cpu : parse_cpu_list(cpu_list))
+			{
+				node_of_cpu[cpu] = node;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < cpus.size(); ++i)
+	{
+		auto it = node_of_cpu.find(cpus[i]);
+		if (it != node_of_cpu.end())
+		{
+			nodes[i] = it->second;
+		}
+	}
+#endif
+
+	return nodes;
+}
+
+bool move_to_numa_node(void* begin, size_t bytes, int node)
+{
+#if defined(_WIN32) || !defined(SYS_move_pages)
+	return false;
+#else
+	// flag of move_pages from numaif.h, which is only shipped with libnuma
+	constexpr int MPOL_MF_MOVE_PAGES = 1 << 1;
+
+	uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+	uintptr_t first = (reinterpret_cast<uintptr_t>(begin) + page_size - 1) & ~(page_size - 1);
+	uintptr_t end = (reinterpret_cast<uintptr_t>(begin) + bytes) & ~(page_size - 1);
+
+	if (first >= end)
+	{
+		return true;
+	}
+
+	std::vector<void*> pages;
+	for (uintptr_t p = first; p < end; p += page_size)
+	{
+		pages.push_back(reinterpret_cast<void*>(p));
+	}
+	std::vector<int> targets(pages.size(), node);
+	std::vector<int> status(pages.size(), 0);
+
+	return syscall(SYS_move_pages, 0, pages.size(), pages.data(), targets.data(),
+		status.data(), MPOL_MF_MOVE_PAGES) >= 0;
+#endif
+}
+
+bool pin_current_thread(int cpu)
+{
+#if defined(_WIN32)
+	if (cpu < 0 || cpu >= static_cast<int>(sizeof(DWORD_PTR) * 8))
+	{
+		return false;
+	}
+	return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#else
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+	{
+		return false;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
+
+} // namespace rt